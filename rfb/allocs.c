@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+// Counts heap allocations, for check.sh: preloaded (LD_PRELOAD) into the
+// server, it counts calls to malloc(), calloc() and realloc(), and writes
+// the count to stderr on SIGUSR2.
+
+static unsigned long gAllocs = 0;
+static void *(*gMalloc)(size_t);
+static void *(*gCalloc)(size_t, size_t);
+static void *(*gRealloc)(void *, size_t);
+
+
+static void ALLOCS_Report(int sig)
+{
+  char line[64];
+  int len = snprintf(line, sizeof(line), "Allocations: %lu\n", __atomic_load_n(&gAllocs, __ATOMIC_RELAXED));
+  write(2, line, len);
+}
+
+
+__attribute__((constructor)) static void ALLOCS_Init(void)
+{
+  signal(SIGUSR2, ALLOCS_Report);
+}
+
+
+void *malloc(size_t size)
+{
+  if (!gMalloc)
+  {
+    gMalloc = dlsym(RTLD_NEXT, "malloc");
+  }
+  __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+  return gMalloc(size);
+}
+
+
+// dlsym() itself may call calloc(), which can fail while we look for the
+// real one:
+void *calloc(size_t count, size_t size)
+{
+  static int resolving = 0;
+  if (!gCalloc)
+  {
+    if (resolving)
+    {
+      return NULL;
+    }
+    resolving = 1;
+    gCalloc = dlsym(RTLD_NEXT, "calloc");
+  }
+  __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+  return gCalloc(count, size);
+}
+
+
+void *realloc(void *p, size_t size)
+{
+  if (!gRealloc)
+  {
+    gRealloc = dlsym(RTLD_NEXT, "realloc");
+  }
+  __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+  return gRealloc(p, size);
+}
+
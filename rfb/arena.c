@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_Round(zzsize) (((zzsize) + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+#define ARENA_InUse(zza) ((zza)->used + (zza)->extra_size)
+
+
+static U8 *ARENA_NewBlock(int size)
+{
+  void *p = NULL;
+  return posix_memalign(&p, ARENA_ALIGN, size) ? NULL : p;
+}
+
+
+int ARENA_Init(rfb_arena *a, int size)
+{
+  memset(a, 0, sizeof(*a));
+  a->size = ARENA_Round(size);
+  a->data = ARENA_NewBlock(a->size);
+  if (!a->data)
+  {
+    a->size = 0;
+    return -1;
+  }
+  return 0;
+}
+
+
+void ARENA_Free(rfb_arena *a)
+{
+  a->peak = 0; // Nothing to make room for.
+  ARENA_Reset(a);
+  free(a->data);
+  memset(a, 0, sizeof(*a));
+}
+
+
+// Returns 'size' bytes (uninitialised), or NULL if out of memory.
+void *ARENA_Alloc(rfb_arena *a, int size)
+{
+  rfb_arena_extra *e;
+  size = ARENA_Round(size);
+  if (a->used + size <= a->size)
+  {
+    a->last = a->used;
+    a->used += size;
+    a->peak = Max(a->peak, ARENA_InUse(a));
+    return a->data + a->last;
+  }
+  // Doesn't fit; borrow it until the reset:
+  e = (rfb_arena_extra*)ARENA_NewBlock(sizeof(rfb_arena_extra) + size);
+  if (!e)
+  {
+    return NULL;
+  }
+  e->next = a->extra;
+  e->size = size;
+  a->extra = e;
+  a->extra_size += size;
+  a->peak = Max(a->peak, ARENA_InUse(a));
+  return e->data;
+}
+
+
+// Makes 'p' (from ARENA_Alloc(), 'size' bytes) 'new_size' bytes, keeping
+// what's in it. The latest allocation grows in place if there's room;
+// anything else moves.
+void *ARENA_Grow(rfb_arena *a, void *p, int size, int new_size)
+{
+  U8 *grown;
+  if ((U8*)p == a->data + a->last && a->last + ARENA_Round(new_size) <= a->size)
+  {
+    a->used = a->last + ARENA_Round(new_size);
+    a->peak = Max(a->peak, ARENA_InUse(a));
+    return p;
+  }
+  grown = ARENA_Alloc(a, new_size);
+  if (grown)
+  {
+    memcpy(grown, p, Min(size, new_size));
+  }
+  return grown;
+}
+
+
+// Everything allocated after a mark can be given back early with
+// ARENA_Rewind() (e.g. once a rectangle has been encoded), to be reused
+// before the reset:
+int ARENA_Mark(const rfb_arena *a)
+{
+  return a->used;
+}
+
+
+void ARENA_Rewind(rfb_arena *a, int mark)
+{
+  a->used = mark;
+  a->last = mark;
+}
+
+
+// Gives everything back. If the arena was too small since the last reset,
+// it's replaced by one big enough for all of it.
+void ARENA_Reset(rfb_arena *a)
+{
+  rfb_arena_extra *e, *next;
+  for (e = a->extra; e; e = next)
+  {
+    next = e->next;
+    free(e);
+  }
+  if (a->peak > a->size)
+  {
+    int size = a->size ? a->size : ARENA_INIT_SIZE;
+    U8 *data;
+    while (size < a->peak)
+    {
+      size *= 2;
+    }
+    data = ARENA_NewBlock(size);
+    if (data)
+    {
+      free(a->data);
+      a->data = data;
+      a->size = size;
+    }
+  }
+  a->extra = NULL;
+  a->extra_size = 0;
+  a->used = 0;
+  a->last = 0;
+  a->peak = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "rfb.h"
+
+// A bump allocator for memory that's only needed while an update is being
+// encoded. Taking some is just moving a pointer on, and it's all given back
+// at once by ARENA_Reset() when the update is done. If an update needs more
+// than the arena has, the rest comes from malloc() for now, and the arena is
+// made big enough at the next reset. So once it has seen the biggest update
+// it's going to, it never allocates anything again.
+
+// What an arena starts with:
+#define ARENA_INIT_SIZE  (64*1024)
+
+// Every allocation is aligned to this (a cache line, and enough for SIMD):
+#define ARENA_ALIGN      64
+
+// Memory from malloc(), for what didn't fit:
+typedef struct rfb_arena_extra {
+  struct rfb_arena_extra *next;
+  int size;
+  U8 data[0] __attribute__((aligned(ARENA_ALIGN)));
+} rfb_arena_extra;
+
+typedef struct {
+  U8 *data;
+  int size;
+  int used;
+  int last; // Where the latest allocation starts, so it can grow in place.
+  // Since the last reset: what's been borrowed from malloc(), and the most
+  // that was in use at once (which is how big the arena needs to be):
+  rfb_arena_extra *extra;
+  int extra_size;
+  int peak;
+} rfb_arena;
+
+int ARENA_Init(rfb_arena *a, int size);
+void ARENA_Free(rfb_arena *a);
+void *ARENA_Alloc(rfb_arena *a, int size);
+void *ARENA_Grow(rfb_arena *a, void *p, int size, int new_size);
+int ARENA_Mark(const rfb_arena *a);
+void ARENA_Rewind(rfb_arena *a, int mark);
+void ARENA_Reset(rfb_arena *a);
+
+#endif // ARENA_H
@@ -0,0 +1,88 @@
+#!/bin/sh
+# Checks that need a running server, each against a fresh one (on the usual
+# port, which has to be free). `make check` runs them.
+
+cd "$(dirname "$0")"
+logs=$(mktemp -d)
+failed=0
+
+# Starts the server with the given options (preloading $PRELOAD, if it's
+# set), and gives it a moment to start listening:
+start()
+{
+  LD_PRELOAD=$PRELOAD ./rfbtest.elf "$@" > "$logs/server.log" 2>&1 &
+  server=$!
+  sleep 1
+}
+
+stop()
+{
+  kill -INT $server
+  wait $server
+}
+
+result()
+{
+  if [ "$2" = 0 ]
+  then
+    echo "PASS: $1"
+  else
+    echo "FAIL: $1"
+    cat "$logs/bench.log"
+    failed=1
+  fi
+}
+
+# Runs rfbbench with the given options (after $PRODUCER, if it's set), and
+# says how it went:
+bench()
+{
+  name=$1
+  shift
+  if [ -n "$PRODUCER" ]
+  then
+    $PRODUCER > "$logs/producer.log" 2>&1
+  fi
+  ./rfbbench.elf "$@" > "$logs/bench.log" 2>&1
+  result "$name" $?
+}
+
+# Heap allocations the server has made so far (with allocs.so preloaded):
+allocs()
+{
+  kill -USR2 $server
+  sleep 0.2
+  grep Allocations "$logs/server.log" | tail -n 1 | cut -d' ' -f2
+}
+
+# More stalled Raw clients than there are frames (FB_MAX_FRAMES), each
+# holding on to a different one, mustn't stop new ones being published:
+start -g 2000x2000
+bench "stalled clients" -c 2 -d 6 -s 17
+stop
+
+# A producer that dies part way through a frame mustn't stop the rest (here,
+# the server's own painting) from drawing:
+start -m /rfbcheck
+PRODUCER="./shmdraw.elf -a /rfbcheck 1" bench "abandoned frame" -c 1 -d 3
+stop
+
+# Once they've warmed up, a sharing group's updates shouldn't need the
+# heap. Each worker's pool only grows when it has more blocks in use than
+# ever before, so allocations should all but stop; pools that were too
+# small kept allocating 20 or so blocks a second here, with no end to it:
+PRELOAD=./allocs.so start -t 2
+./rfbbench.elf -c 4 -d 22 > "$logs/bench.log" 2>&1 &
+sleep 10
+before=$(allocs)
+sleep 10
+after=$(allocs)
+wait $!
+status=$?
+echo "Allocations between 10 and 20 seconds in: $((after - before))" >> "$logs/bench.log"
+[ $status = 0 ] && [ $((after - before)) -lt 50 ]
+result "steady-state allocations" $?
+stop
+
+rm -rf "$logs"
+exit $failed
@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "cursor.h"
+
+// The classic arrow: 'X' is black, '.' is white, and spaces are see-through.
+// The hotspot is its tip:
+static const char *gArrow[] = {
+  "X           ",
+  "XX          ",
+  "X.X         ",
+  "X..X        ",
+  "X...X       ",
+  "X....X      ",
+  "X.....X     ",
+  "X......X    ",
+  "X.......X   ",
+  "X........X  ",
+  "X.....XXXXX ",
+  "X..X..X     ",
+  "X.X X..X    ",
+  "XX  X..X    ",
+  "X    X..X   ",
+  "     X..X   ",
+  "      XX    ",
+};
+
+
+void CURSOR_Init(rfb_cursor *c, int x, int y)
+{
+  int i, j;
+  memset(c, 0, sizeof(*c));
+  c->height = sizeof(gArrow) / sizeof(gArrow[0]);
+  c->width = strlen(gArrow[0]);
+  for (i=0; i<c->height; ++i)
+  {
+    for (j=0; j<c->width; ++j)
+    {
+      char p = gArrow[i][j];
+      c->pixels[i*c->width + j] = (p == '.') ? FB_RGB(255, 255, 255) : FB_RGB(0, 0, 0);
+      c->mask[i*c->width + j] = (p != ' ');
+    }
+  }
+  CURSOR_Move(c, x, y, -1);
+}
+
+
+// Called by the application as the pointer moves. 'mover' is the connection
+// it came from (which needn't be told where it put it):
+void CURSOR_Move(rfb_cursor *c, int x, int y, int mover)
+{
+  U64 pos = ((U64)(x & 0xFFFF) << 48) | ((U64)(y & 0xFFFF) << 32) | (U32)mover;
+  __atomic_store_n(&c->position, pos, __ATOMIC_RELAXED);
+}
+
+
+U64 CURSOR_Position(const rfb_cursor *c)
+{
+  return __atomic_load_n(&c->position, __ATOMIC_RELAXED);
+}
+
+
+// Where the cursor covers, at 'pos':
+void CURSOR_Bounds(const rfb_cursor *c, U64 pos, rfb_rect *r)
+{
+  r->x = CURSOR_X(pos) - c->hot_x;
+  r->y = CURSOR_Y(pos) - c->hot_y;
+  r->w = c->width;
+  r->h = c->height;
+}
+
+
+// Copies 'r' of 'frame' to 'dst' (r->w pixels per row), with the cursor at
+// 'pos' drawn over it:
+void CURSOR_Composite(const rfb_cursor *c, U64 pos, const rfb_frame *frame, const rfb_rect *r, U32 *dst)
+{
+  rfb_rect bounds, overlap;
+  int x, y;
+  for (y=0; y<r->h; ++y)
+  {
+    memcpy(dst + y*r->w, FB_PIXEL_PTR(frame, r->x, r->y+y), r->w * sizeof(U32));
+  }
+  CURSOR_Bounds(c, pos, &bounds);
+  if (!RECT_Intersect(r, &bounds, &overlap))
+  {
+    return;
+  }
+  for (y=overlap.y; y<overlap.y+overlap.h; ++y)
+  {
+    int from = (y - bounds.y)*c->width + (overlap.x - bounds.x);
+    U32 *row = dst + (y - r->y)*r->w + (overlap.x - r->x);
+    for (x=0; x<overlap.w; ++x)
+    {
+      if (c->mask[from + x])
+      {
+        row[x] = c->pixels[from + x];
+      }
+    }
+  }
+}
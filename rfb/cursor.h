@@ -0,0 +1,38 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include "rfb.h"
+#include "fb.h"
+
+// The pointer: its shape, and where the application last saw it. It's never
+// drawn into the framebuffer. Clients that can draw it themselves (the Cursor
+// pseudo-encoding) are sent its shape once, and its position when someone
+// else moves it (PointerPos). Everyone else gets it composited into their
+// updates as they're encoded.
+
+#define CURSOR_MAX_WIDTH   32
+#define CURSOR_MAX_HEIGHT  32
+
+// Position, and the connection (socket) that moved it there, in one value so
+// it can be read and written atomically:
+#define CURSOR_X(zzpos)      ((int)(((zzpos) >> 48) & 0xFFFF))
+#define CURSOR_Y(zzpos)      ((int)(((zzpos) >> 32) & 0xFFFF))
+#define CURSOR_MOVER(zzpos)  ((int)((zzpos) & 0xFFFFFFFF))
+
+typedef struct {
+  int width;
+  int height;
+  int hot_x;
+  int hot_y;
+  U32 pixels[CURSOR_MAX_WIDTH*CURSOR_MAX_HEIGHT]; // Native format.
+  U8 mask[CURSOR_MAX_WIDTH*CURSOR_MAX_HEIGHT]; // Nonzero where it's opaque.
+  U64 position;
+} rfb_cursor;
+
+void CURSOR_Init(rfb_cursor *c, int x, int y);
+void CURSOR_Move(rfb_cursor *c, int x, int y, int mover);
+U64 CURSOR_Position(const rfb_cursor *c);
+void CURSOR_Bounds(const rfb_cursor *c, U64 pos, rfb_rect *r);
+void CURSOR_Composite(const rfb_cursor *c, U64 pos, const rfb_frame *frame, const rfb_rect *r, U32 *dst);
+
+#endif // CURSOR_H
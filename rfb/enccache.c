@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "encode.h"
+
+// Sharing encoded rectangles between connections. Connections whose settings
+// (pixel format, encodings and their parameters) are the same are put in one
+// group. While a group has more than one member, each rectangle its members
+// send is encoded once, kept by (damage generation, rectangle), and queued to
+// every member that asks for the same thing by reference rather than being
+// encoded again. Fifty viewers on one wall display cost about one encode.
+//
+// The stateless encodings (Raw, RRE, Hextile) can be shared as they are. The
+// zlib-based ones can't, since each client decompresses what it's sent with
+// streams whose history is its own. So shared rectangles are encoded
+// "independently", without reference to anything sent before:
+// - Tight resets each zlib stream it uses (which the protocol has bits for),
+//   and a member that was sent someone else's rectangle resets its streams
+//   again before it next uses them for itself.
+// - ZRLE has no way of resetting its one stream, so instead its compressed
+//   data simply doesn't refer back past the start of the rectangle. The
+//   connection's own stream does the same the next time it's used. ZRLE's
+//   zlib header goes out once per connection, so it's spliced in when a
+//   client's first ZRLE rectangle is a shared one.
+// Either way, compression suffers a little for not having the history.
+
+
+// All groups, shared by all threads:
+static rfb_encgroup *gGroups = NULL;
+static pthread_mutex_t gGroupLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// FNV-1a, over the settings:
+static U32 ENC_SettingsHash(const rfb_encsettings *s)
+{
+  const U8 *p = (const U8*)s;
+  U32 hash = 2166136261U;
+  int i;
+  for (i=0; i<sizeof(*s); ++i)
+  {
+    hash = (hash ^ p[i]) * 16777619U;
+  }
+  return hash;
+}
+
+
+static void ENC_PutGroup(rfb_encgroup *g)
+{
+  rfb_encgroup **pg;
+  int i;
+  pthread_mutex_lock(&gGroupLock);
+  if (__atomic_sub_fetch(&g->refs, 1, __ATOMIC_RELAXED) == 0)
+  {
+    for (pg = &gGroups; *pg; pg = &(*pg)->next)
+    {
+      if (*pg == g)
+      {
+        *pg = g->next;
+        break;
+      }
+    }
+    for (i=0; i<ENC_CACHE_ENTRIES; ++i)
+    {
+      OUT_Release(g->entries[i].data);
+    }
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+  }
+  pthread_mutex_unlock(&gGroupLock);
+}
+
+
+// Puts the connection in the group for its current settings (which it calls
+// whenever they change), creating it if need be.
+void ENC_JoinGroup(rfb_encstate *es)
+{
+  rfb_encsettings s;
+  rfb_encgroup *g;
+  U32 hash;
+  int i;
+  // Zeroed first, so padding and unused entries hash and compare the same:
+  memset(&s, 0, sizeof(s));
+  s.format = es->translator.format;
+  for (i=0; i<es->encoder_count; ++i)
+  {
+    s.encodings[i] = es->encoders[i]->type;
+  }
+  s.encoding_count = es->encoder_count;
+  s.preferred = ENC_PreferredType(es);
+  s.quality = ENC_Quality(es);
+  s.compress = ENC_CompressLevel(es);
+  hash = ENC_SettingsHash(&s);
+  if (es->group && es->group->hash == hash && !memcmp(&es->group->settings, &s, sizeof(s)))
+  {
+    return;
+  }
+  ENC_LeaveGroup(es);
+  pthread_mutex_lock(&gGroupLock);
+  for (g = gGroups; g; g = g->next)
+  {
+    if (g->hash == hash && !memcmp(&g->settings, &s, sizeof(s)))
+    {
+      break;
+    }
+  }
+  if (!g && (g = calloc(1, sizeof(rfb_encgroup))))
+  {
+    g->settings = s;
+    g->hash = hash;
+    pthread_mutex_init(&g->lock, NULL);
+    g->next = gGroups;
+    gGroups = g;
+  }
+  if (g)
+  {
+    __atomic_add_fetch(&g->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&gGroupLock);
+  // Without a group, the connection just doesn't share:
+  es->group = g;
+}
+
+
+void ENC_LeaveGroup(rfb_encstate *es)
+{
+  if (es->group)
+  {
+    ENC_PutGroup(es->group);
+    es->group = NULL;
+  }
+}
+
+
+// Whether the connection's rectangles are worth sharing (i.e. someone else
+// has the same settings):
+int ENC_IsShared(const rfb_encstate *es)
+{
+  return es->group && __atomic_load_n(&es->group->refs, __ATOMIC_RELAXED) > 1;
+}
+
+
+rfb_shared *ENC_Lookup(rfb_encgroup *g, unsigned int generation, const rfb_rect *r)
+{
+  rfb_shared *data = NULL;
+  int i;
+  pthread_mutex_lock(&g->lock);
+  for (i=0; i<ENC_CACHE_ENTRIES; ++i)
+  {
+    rfb_cached_rect *c = &g->entries[i];
+    if (c->data && c->generation == generation && !memcmp(&c->r, r, sizeof(*r)))
+    {
+      data = c->data;
+      OUT_Hold(data);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g->lock);
+  return data;
+}
+
+
+void ENC_Remember(rfb_encgroup *g, unsigned int generation, const rfb_rect *r, rfb_shared *data)
+{
+  rfb_cached_rect *c;
+  pthread_mutex_lock(&g->lock);
+  c = &g->entries[g->oldest];
+  g->oldest = (g->oldest + 1) % ENC_CACHE_ENTRIES;
+  OUT_Release(c->data);
+  c->generation = generation;
+  c->r = *r;
+  c->data = data;
+  OUT_Hold(data);
+  pthread_mutex_unlock(&g->lock);
+}
+
+
+// Queues a shared encoding of a single ZRLE rectangle, adding the zlib
+// header if it's the connection's first:
+static int ENC_QueueSharedZRLE(rfb_encstate *es, rfb_outbuf *out, rfb_shared *data)
+{
+  static const U8 header[2] = { 0x78, 0x01 };
+  int needs_header = ENC_SharedZRLE(es);
+  U32 len;
+  U8 *p;
+  if (needs_header < 0)
+  {
+    return -1;
+  }
+  if (!needs_header)
+  {
+    return OUT_RefShared(out, data, 0, data->len);
+  }
+  // Rectangle header, then the data's U32 length, grown by two:
+  p = OUT_Reserve(out, 12 + 4 + 2);
+  if (!p)
+  {
+    return -1;
+  }
+  memcpy(p, data->data, 12);
+  p += 12;
+  len = RFB32P(data->data + 12) + 2;
+  PUT32(p, len);
+  memcpy(p, header, 2);
+  return OUT_RefShared(out, data, 12 + 4, data->len - (12 + 4));
+}
+
+
+// Queues 'r' for a connection in a sharing group: from the group's cache if
+// another member already sent it for the same generation, otherwise encoded
+// independently and left in the cache for the others.
+int ENC_EncodeShared(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  rfb_encgroup *g = es->group;
+  rfb_shared *data = ENC_Lookup(g, es->generation, r);
+  int result;
+  if (!data)
+  {
+    es->independent = 1;
+    result = ENC_EncodeRect(es, es->staging, r);
+    es->independent = 0;
+    if (result < 0)
+    {
+      OUT_Clear(es->staging);
+      return -1;
+    }
+    data = OUT_Share(es->staging);
+    if (!data)
+    {
+      return -1;
+    }
+    ENC_Remember(g, es->generation, r, data);
+  }
+  result = ENC_QueueEncoded(es, out, data);
+  OUT_Release(data);
+  return result;
+}
+
+
+// Queues rectangles that were encoded independently (by ENC_EncodeShared()
+// or ENC_EncodeRects()) for the connection, letting its own streams know.
+int ENC_QueueEncoded(rfb_encstate *es, rfb_outbuf *out, rfb_shared *data)
+{
+  // What the (first) rectangle went out as. Zlib-based encodings' rects
+  // are all the same type, since they're never sent as solid RRE, and
+  // never fall back to Raw:
+  S32 type = (S32)RFB32P(data->data + 8);
+  if (type == ENC_ZRLE)
+  {
+    return ENC_QueueSharedZRLE(es, out, data);
+  }
+  if (type == ENC_TIGHT && ENC_SharedTight(es) < 0)
+  {
+    return -1;
+  }
+  return OUT_RefShared(out, data, 0, data->len);
+}
@@ -0,0 +1,615 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encode.h"
+
+
+int gCompressLevel = ENC_DEFAULT_COMPRESS;
+
+
+// Scratch space for encoding one rectangle, given back once it's done (see
+// ENC_EncodePiece()):
+U8 *ENC_Scratch(rfb_encstate *es, int size)
+{
+  return ARENA_Alloc(es->arena, size);
+}
+
+
+int ENC_CompressLevel(const rfb_encstate *es)
+{
+  return (es->compress >= 0) ? es->compress : gCompressLevel;
+}
+
+
+// Writes one native pixel in the client's format, returning its size:
+int ENC_PutPixel(rfb_encstate *es, U32 pixel, U8 *dst)
+{
+  PIX_TranslateRow(&es->translator, &pixel, dst, 1);
+  return es->translator.bytes_per_pixel;
+}
+
+
+// Where (x, y) is in a frame's blob:
+#define ENC_FrameOffset(zzframe,zzx,zzy) ((int)((U8*)FB_PIXEL_PTR(zzframe, zzx, zzy) - (zzframe)->blob->data))
+
+
+// Raw: native-format clients get the frame's memory by reference, which
+// keeps the frame from being reused until it's been sent. Nothing is
+// converted or copied: full-width rectangles are one contiguous span,
+// otherwise each row is its own iovec. Rows too narrow to be worth an iovec
+// of their own are just copied. Everyone else gets the rectangle translated
+// into the output queue.
+static int ENC_EncodeRaw(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_frame *frame = es->frame;
+  int row_bytes = r->w * es->translator.bytes_per_pixel;
+  int y;
+  U8 *p;
+  if (es->native && r->w == frame->stride)
+  {
+    return OUT_RefShared(out, frame->blob, ENC_FrameOffset(frame, r->x, r->y), row_bytes * r->h);
+  }
+  if (es->native && row_bytes >= RAW_MIN_REF_BYTES)
+  {
+    for (y=0; y<r->h; ++y)
+    {
+      if (OUT_RefShared(out, frame->blob, ENC_FrameOffset(frame, r->x, r->y+y), row_bytes) < 0)
+      {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  p = OUT_Reserve(out, row_bytes * r->h);
+  if (!p)
+  {
+    return -1;
+  }
+  PIX_TranslateRect(&es->translator, FB_PIXEL_PTR(frame, r->x, r->y), frame->stride, p, r->w, r->h);
+  return 0;
+}
+
+
+// Finds the pixel that covers most of 'r', if any covers more than half of
+// it (Boyer-Moore majority vote). Otherwise it's just a popular one.
+static U32 ENC_Background(const rfb_frame *frame, const rfb_rect *r)
+{
+  U32 candidate = *FB_PIXEL_PTR(frame, r->x, r->y);
+  int votes = 0;
+  int x, y;
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    for (x=0; x<r->w; ++x)
+    {
+      if (!votes)
+      {
+        candidate = row[x];
+        votes = 1;
+      }
+      else
+      {
+        votes += (row[x] == candidate) ? 1 : -1;
+      }
+    }
+  }
+  return candidate;
+}
+
+
+typedef struct {
+  U32 pixel;
+  int x, y, w, h;
+} enc_subrect;
+
+
+// RRE: a background colour plus solid subrectangles. Each row's runs of
+// non-background pixels become subrectangles, which grow downwards while
+// the rows below have an identical run. Gives up (falling back to Raw) as
+// soon as it's bigger than Raw would be.
+static int ENC_EncodeRRE(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_frame *frame = es->frame;
+  int bpp = es->translator.bytes_per_pixel;
+  int max_subrects = (r->w*r->h*bpp - 4 - bpp) / (bpp + 8);
+  enc_subrect *subs;
+  int *prev, *cur, *swap;
+  int prev_count = 0, cur_count, count = 0;
+  int x, y, i, end;
+  U32 bg;
+  U8 *p;
+  if (max_subrects < 0)
+  {
+    return ENC_FALLBACK;
+  }
+  subs = (enc_subrect*)ENC_Scratch(es, sizeof(enc_subrect) * (max_subrects+1));
+  prev = (int*)ENC_Scratch(es, sizeof(int) * (r->w+1) * 2);
+  if (!subs || !prev)
+  {
+    return -1;
+  }
+  // Subrectangles ending on the previous row, and on this one, in x order:
+  cur = prev + r->w+1;
+  bg = ENC_Background(frame, r);
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    cur_count = 0;
+    i = 0;
+    for (x=0; x<r->w; x=end)
+    {
+      U32 pixel = row[x];
+      for (end=x+1; end<r->w && row[end]==pixel; ++end);
+      if (pixel == bg)
+      {
+        continue;
+      }
+      while (i < prev_count && subs[prev[i]].x < x)
+      {
+        ++i;
+      }
+      if (i < prev_count && subs[prev[i]].x == x && subs[prev[i]].w == end-x && subs[prev[i]].pixel == pixel)
+      {
+        // Same run as the row above, so grow that one:
+        ++subs[prev[i]].h;
+        cur[cur_count++] = prev[i];
+        continue;
+      }
+      if (count == max_subrects)
+      {
+        return ENC_FALLBACK;
+      }
+      subs[count].pixel = pixel;
+      subs[count].x = x;
+      subs[count].y = y;
+      subs[count].w = end-x;
+      subs[count].h = 1;
+      cur[cur_count++] = count++;
+    }
+    swap = prev; prev = cur; cur = swap;
+    prev_count = cur_count;
+  }
+  p = OUT_Reserve(out, 4 + bpp + count*(bpp+8));
+  if (!p)
+  {
+    return -1;
+  }
+  PUT32(p, count);
+  p += ENC_PutPixel(es, bg, p);
+  for (i=0; i<count; ++i)
+  {
+    p += ENC_PutPixel(es, subs[i].pixel, p);
+    PUT16(p, subs[i].x);
+    PUT16(p, subs[i].y);
+    PUT16(p, subs[i].w);
+    PUT16(p, subs[i].h);
+  }
+  return 0;
+}
+
+
+static const rfb_encoder gEncoders[] = {
+  { ENC_RAW, "Raw", ENC_EncodeRaw },
+  { ENC_RRE, "RRE", ENC_EncodeRRE },
+  { ENC_HEXTILE, "Hextile", ENC_EncodeHextile },
+  { ENC_ZRLE, "ZRLE", ENC_EncodeZRLE },
+  { ENC_TIGHT, "Tight", ENC_EncodeTight, 2048, 65536 }, // Tight's size limits.
+};
+
+#define ENCODER_COUNT (sizeof(gEncoders)/sizeof(gEncoders[0]))
+
+
+static const rfb_encoder *ENC_Find(S32 type)
+{
+  int i;
+  for (i=0; i<ENCODER_COUNT; ++i)
+  {
+    if (gEncoders[i].type == type)
+    {
+      return &gEncoders[i];
+    }
+  }
+  return NULL;
+}
+
+
+const char *ENC_Name(S32 type)
+{
+  const rfb_encoder *enc = ENC_Find(type);
+  if (enc)
+  {
+    return enc->name;
+  }
+  switch (type)
+  {
+    case ENC_COPYRECT: return "CopyRect";
+    case ENC_PSEUDO_CURSOR: return "Cursor";
+    case ENC_PSEUDO_POINTERPOS: return "PointerPos";
+    case ENC_PSEUDO_LASTRECT: return "LastRect";
+    case ENC_PSEUDO_DESKTOPSIZE: return "DesktopSize";
+    case ENC_PSEUDO_FENCE: return "Fence";
+    case ENC_PSEUDO_CONTINUOUS: return "ContinuousUpdates";
+  }
+  if (type >= ENC_PSEUDO_QUALITY_0 && type <= ENC_PSEUDO_QUALITY_9)
+  {
+    return "QualityLevel";
+  }
+  if (type >= ENC_PSEUDO_COMPRESS_0 && type <= ENC_PSEUDO_COMPRESS_9)
+  {
+    return "CompressLevel";
+  }
+  return "?";
+}
+
+
+void ENC_Init(rfb_encstate *es, rfb_arena *arena, rfb_outbuf *staging, rfb_enchelper *helper)
+{
+  memset(es, 0, sizeof(*es));
+  es->arena = arena;
+  es->staging = staging;
+  es->helper = helper;
+  es->quality = -1;
+  es->compress = -1;
+  es->adapted_quality = -1;
+}
+
+
+void ENC_Free(rfb_encstate *es)
+{
+  ENC_LeaveGroup(es);
+  PIX_Free(&es->translator);
+  ENC_FreeZRLE(es);
+  ENC_FreeTight(es);
+}
+
+
+int ENC_SetPixelFormat(rfb_encstate *es, const pixel_format *f)
+{
+  if (PIX_Init(&es->translator, f) < 0)
+  {
+    return -1;
+  }
+  es->native = FB_IsNativeFormat(f);
+  ENC_JoinGroup(es);
+  return 0;
+}
+
+
+// Takes the client's SetEncodings list (as it arrived: big-endian S32s).
+void ENC_SetEncodings(rfb_encstate *es, const S32 *encodings, int count)
+{
+  int i, j;
+  es->encoder_count = 0;
+  es->flags = 0;
+  es->quality = -1;
+  es->compress = -1;
+  // The client may not support what we'd adapted to any more:
+  es->adapted = NULL;
+  es->adapted_quality = -1;
+  for (i=0; i<count; ++i)
+  {
+    S32 type = (S32)RFB32P(&encodings[i]);
+    const rfb_encoder *enc;
+    if (type >= ENC_PSEUDO_QUALITY_0 && type <= ENC_PSEUDO_QUALITY_9)
+    {
+      es->quality = type - ENC_PSEUDO_QUALITY_0;
+      continue;
+    }
+    if (type >= ENC_PSEUDO_COMPRESS_0 && type <= ENC_PSEUDO_COMPRESS_9)
+    {
+      es->compress = type - ENC_PSEUDO_COMPRESS_0;
+      continue;
+    }
+    switch (type)
+    {
+      case ENC_PSEUDO_CURSOR: es->flags |= ENC_FLAG_CURSOR; continue;
+      case ENC_PSEUDO_POINTERPOS: es->flags |= ENC_FLAG_POINTERPOS; continue;
+      case ENC_PSEUDO_LASTRECT: es->flags |= ENC_FLAG_LASTRECT; continue;
+      case ENC_PSEUDO_DESKTOPSIZE: es->flags |= ENC_FLAG_DESKTOPSIZE; continue;
+      case ENC_PSEUDO_FENCE: es->flags |= ENC_FLAG_FENCE; continue;
+      case ENC_PSEUDO_CONTINUOUS: es->flags |= ENC_FLAG_CONTINUOUS; continue;
+      case ENC_COPYRECT: es->flags |= ENC_FLAG_COPYRECT; continue;
+    }
+    enc = ENC_Find(type);
+    if (!enc || es->encoder_count == ENC_MAX_PREFS)
+    {
+      continue;
+    }
+    for (j=0; j<es->encoder_count && es->encoders[j] != enc; ++j);
+    if (j == es->encoder_count)
+    {
+      es->encoders[es->encoder_count++] = enc;
+    }
+  }
+  ENC_JoinGroup(es);
+}
+
+
+int ENC_Supports(const rfb_encstate *es, S32 type)
+{
+  int i;
+  for (i=0; i<es->encoder_count; ++i)
+  {
+    if (es->encoders[i]->type == type)
+    {
+      return 1;
+    }
+  }
+  return type == ENC_RAW; // Every client has to take Raw.
+}
+
+
+static int ENC_IsSolid(const rfb_frame *frame, const rfb_rect *r)
+{
+  U32 pixel = *FB_PIXEL_PTR(frame, r->x, r->y);
+  int x, y;
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    for (x=0; x<r->w; ++x)
+    {
+      if (row[x] != pixel)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+
+static const rfb_encoder *ENC_Preferred(const rfb_encstate *es)
+{
+  if (es->adapted)
+  {
+    return es->adapted;
+  }
+  return es->encoder_count ? es->encoders[0] : ENC_Find(ENC_RAW);
+}
+
+
+S32 ENC_PreferredType(const rfb_encstate *es)
+{
+  return ENC_Preferred(es)->type;
+}
+
+
+// JPEG quality level (0-9) to use, or -1 if the client can't take JPEG.
+// The link may call for less than the client asked for, but never more:
+int ENC_Quality(const rfb_encstate *es)
+{
+  if (es->quality < 0 || es->adapted_quality < 0)
+  {
+    return es->quality;
+  }
+  return Min(es->quality, es->adapted_quality);
+}
+
+
+// Uses 'type' instead of the client's preferred encoding (if the client
+// supports it, or it's Raw, which every client does), and at most JPEG
+// quality 'quality' (-1 for the client's). Returns 1 if anything changed.
+int ENC_Adapt(rfb_encstate *es, S32 type, int quality)
+{
+  const rfb_encoder *enc = ENC_Find(type);
+  if (!enc || (type != ENC_RAW && !ENC_Supports(es, type)))
+  {
+    enc = NULL;
+  }
+  if (enc == es->adapted && quality == es->adapted_quality)
+  {
+    return 0;
+  }
+  es->adapted = enc;
+  es->adapted_quality = quality;
+  ENC_JoinGroup(es);
+  return 1;
+}
+
+
+// Picks the encoding for one rectangle: normally the client's favourite of
+// the ones we have, but solid areas are nearly free as RRE, so if the
+// favourite would send them pixel by pixel we use that instead.
+static const rfb_encoder *ENC_Choose(rfb_encstate *es, const rfb_rect *r)
+{
+  const rfb_encoder *preferred = ENC_Preferred(es);
+  if (preferred->type == ENC_RAW && ENC_Supports(es, ENC_RRE) && ENC_IsSolid(es->frame, r))
+  {
+    return ENC_Find(ENC_RRE);
+  }
+  return preferred;
+}
+
+
+// Size of the pieces 'r' has to be split into for the client's preferred
+// encoding (most have no limit, so it's just 'r'), or to be encoded in
+// parallel.
+static void ENC_PieceSize(const rfb_encstate *es, const rfb_rect *r, int *w, int *h)
+{
+  const rfb_encoder *enc = ENC_Preferred(es);
+  int max_width = enc->max_width;
+  int max_pixels = enc->max_pixels;
+  if (es->parallel)
+  {
+    max_width = max_width ? Min(max_width, ENC_PARALLEL_PIECE) : ENC_PARALLEL_PIECE;
+    max_pixels = max_pixels ? Min(max_pixels, ENC_PARALLEL_PIECE*ENC_PARALLEL_PIECE) : ENC_PARALLEL_PIECE*ENC_PARALLEL_PIECE;
+  }
+  *w = max_width ? Min(r->w, max_width) : r->w;
+  *h = max_pixels ? Min(r->h, Max(max_pixels / *w, 1)) : r->h;
+}
+
+
+// How many rectangles ENC_EncodeRect() will send for 'r', which the
+// FramebufferUpdate header needs to know up front.
+int ENC_RectCount(const rfb_encstate *es, const rfb_rect *r)
+{
+  int w, h;
+  ENC_PieceSize(es, r, &w, &h);
+  return ((r->w + w-1) / w) * ((r->h + h-1) / h);
+}
+
+
+// Fills 'pieces' with the ENC_RectCount() rectangles 'r' is sent as, in the
+// order they go out. Returns how many there are.
+int ENC_SplitRect(const rfb_encstate *es, const rfb_rect *r, rfb_rect *pieces)
+{
+  rfb_rect piece;
+  int count = 0;
+  int w, h;
+  ENC_PieceSize(es, r, &w, &h);
+  for (piece.y=r->y; piece.y<r->y+r->h; piece.y+=h)
+  {
+    for (piece.x=r->x; piece.x<r->x+r->w; piece.x+=w)
+    {
+      piece.w = Min(w, r->x+r->w - piece.x);
+      piece.h = Min(h, r->y+r->h - piece.y);
+      pieces[count++] = piece;
+    }
+  }
+  return count;
+}
+
+
+// Queues one rectangle (header and data) that needs no splitting:
+int ENC_EncodePiece(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_encoder *enc = ENC_Choose(es, r);
+  int header = out->len; // Where the header lands in the queue's own data.
+  int mark = ARENA_Mark(es->arena);
+  int result;
+  U8 *p = OUT_Reserve(out, 12);
+  if (!p)
+  {
+    return -1;
+  }
+  PUT16(p, r->x);
+  PUT16(p, r->y);
+  PUT16(p, r->w);
+  PUT16(p, r->h);
+  PUT32(p, enc->type);
+  result = enc->encode(es, out, r);
+  if (result == ENC_FALLBACK)
+  {
+    p = out->data + header + 8;
+    PUT32(p, ENC_RAW);
+    result = ENC_EncodeRaw(es, out, r);
+  }
+  ARENA_Rewind(es->arena, mark);
+  return result < 0 ? -1 : 0;
+}
+
+
+// Queues 'r' (headers and data) in whatever encodings suit it, as
+// ENC_RectCount() rectangles:
+int ENC_EncodeRect(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  rfb_rect piece;
+  int w, h;
+  if (!es->independent && ENC_IsShared(es))
+  {
+    return ENC_EncodeShared(es, out, r);
+  }
+  ENC_PieceSize(es, r, &w, &h);
+  for (piece.y=r->y; piece.y<r->y+r->h; piece.y+=h)
+  {
+    for (piece.x=r->x; piece.x<r->x+r->w; piece.x+=w)
+    {
+      piece.w = Min(w, r->x+r->w - piece.x);
+      piece.h = Min(h, r->y+r->h - piece.y);
+      if (ENC_EncodePiece(es, out, &piece) < 0)
+      {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Queues a CopyRect rectangle for a move FB_DetectMoves() found. It's only
+// a header and the source position, so it doesn't go through the registry:
+int ENC_QueueCopy(rfb_outbuf *out, const rfb_damage *copy)
+{
+  U8 *p = OUT_Reserve(out, 16);
+  if (!p)
+  {
+    return -1;
+  }
+  PUT16(p, copy->r.x);
+  PUT16(p, copy->r.y);
+  PUT16(p, copy->r.w);
+  PUT16(p, copy->r.h);
+  PUT32(p, ENC_COPYRECT);
+  PUT16(p, copy->src_x);
+  PUT16(p, copy->src_y);
+  return 0;
+}
+
+
+static U8 *ENC_QueueHeader(rfb_outbuf *out, const rfb_rect *r, S32 type, int extra)
+{
+  U8 *p = OUT_Reserve(out, 12 + extra);
+  if (!p)
+  {
+    return NULL;
+  }
+  PUT16(p, r->x);
+  PUT16(p, r->y);
+  PUT16(p, r->w);
+  PUT16(p, r->h);
+  PUT32(p, type);
+  return p;
+}
+
+
+// Queues pixels that aren't in the framebuffer (e.g. with the cursor drawn
+// over them), 'r->w' per row, as a Raw rectangle at 'r':
+int ENC_QueuePixels(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r, const U32 *src)
+{
+  U8 *p = ENC_QueueHeader(out, r, ENC_RAW, r->w * r->h * es->translator.bytes_per_pixel);
+  if (!p)
+  {
+    return -1;
+  }
+  PIX_TranslateRect(&es->translator, src, r->w, p, r->w, r->h);
+  return 0;
+}
+
+
+// Queues a cursor shape (Cursor pseudo-encoding): 'r' is its hotspot and
+// size, then come its pixels and a bitmask of where it's opaque (a byte per
+// pixel in 'mask', a bit per pixel on the wire):
+int ENC_QueueCursor(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r, const U32 *pixels, const U8 *mask)
+{
+  int mask_row = (r->w + 7) / 8;
+  int pixel_bytes = r->w * r->h * es->translator.bytes_per_pixel;
+  int x, y;
+  U8 *p = ENC_QueueHeader(out, r, ENC_PSEUDO_CURSOR, pixel_bytes + mask_row * r->h);
+  if (!p)
+  {
+    return -1;
+  }
+  PIX_TranslateRect(&es->translator, pixels, r->w, p, r->w, r->h);
+  p += pixel_bytes;
+  memset(p, 0, mask_row * r->h);
+  for (y=0; y<r->h; ++y, p+=mask_row)
+  {
+    for (x=0; x<r->w; ++x)
+    {
+      if (mask[y*r->w + x])
+      {
+        p[x/8] |= 0x80 >> (x%8);
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Tells the client where the pointer is (PointerPos pseudo-encoding):
+int ENC_QueuePointerPos(rfb_outbuf *out, int x, int y)
+{
+  rfb_rect r = { x, y, 0, 0 };
+  return ENC_QueueHeader(out, &r, ENC_PSEUDO_POINTERPOS, 0) ? 0 : -1;
+}
@@ -0,0 +1,209 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include "rfb.h"
+#include "fb.h"
+#include "outbuf.h"
+#include "pixfmt.h"
+#include "arena.h"
+
+// Rectangle encodings. Each connection keeps the encodings its client said
+// it supports (in the client's order of preference), and every rectangle
+// goes out in whichever of those suits its content best.
+
+enum {
+  ENC_RAW = 0,
+  ENC_COPYRECT = 1,
+  ENC_RRE = 2,
+  ENC_HEXTILE = 5,
+  ENC_TIGHT = 7,
+  ENC_ZRLE = 16,
+  // Pseudo-encodings:
+  ENC_PSEUDO_COMPRESS_0 = -256,
+  ENC_PSEUDO_COMPRESS_9 = -247,
+  ENC_PSEUDO_CURSOR = -239,
+  ENC_PSEUDO_POINTERPOS = -232,
+  ENC_PSEUDO_LASTRECT = -224,
+  ENC_PSEUDO_DESKTOPSIZE = -223,
+  ENC_PSEUDO_QUALITY_0 = -32,
+  ENC_PSEUDO_QUALITY_9 = -23,
+  ENC_PSEUDO_FENCE = -312,
+  ENC_PSEUDO_CONTINUOUS = -313,
+};
+
+// Pseudo-encodings the client supports:
+#define ENC_FLAG_CURSOR       0x01
+#define ENC_FLAG_POINTERPOS   0x02
+#define ENC_FLAG_LASTRECT     0x04
+#define ENC_FLAG_DESKTOPSIZE  0x08
+#define ENC_FLAG_FENCE        0x10
+#define ENC_FLAG_CONTINUOUS   0x20
+// Not a pseudo-encoding, but CopyRect is only used for moves (see ENC_QueueCopy):
+#define ENC_FLAG_COPYRECT     0x40
+
+// Most (real) encodings we remember from a client's list:
+#define ENC_MAX_PREFS 16
+
+// Narrowest Raw row we'll send from framebuffer memory by reference, rather
+// than copying it into the output queue:
+#define RAW_MIN_REF_BYTES 256
+
+// zlib level for encodings that compress, unless the client asks for
+// another with the compress-level pseudo-encodings (-z sets it):
+#define ENC_DEFAULT_COMPRESS 2
+
+extern int gCompressLevel;
+
+// Encoded rectangles each group of identically set up connections keeps for
+// sharing (see enccache.c); the oldest is replaced first. A big update split
+// up to be encoded in parallel can be a couple of hundred of them:
+#define ENC_CACHE_ENTRIES 256
+
+// What's encoded for sharing comes from the encoding thread's pool, and
+// goes back to it from whichever thread lets it go last. A group's cache
+// can give back all it holds at once, so that's how many free blocks the
+// pool keeps of each size:
+#define ENC_POOL_MAX_FREE (ENC_CACHE_ENTRIES + OUT_POOL_MAX_FREE)
+
+// Updates of at least this many pixels are split into pieces of at most
+// ENC_PARALLEL_PIECE square and encoded by several threads at once (see
+// encpool.c). The piece size is a multiple of every encoding's tile size:
+#define ENC_PARALLEL_MIN_PIXELS  (512*512)
+#define ENC_PARALLEL_PIECE       256
+
+// Everything (besides the pixels) that decides what a rectangle encodes to.
+// Connections with the same settings can share encoded rectangles:
+typedef struct {
+  pixel_format format;
+  S32 encodings[ENC_MAX_PREFS];
+  int encoding_count;
+  S32 preferred; // Differs from encodings[0] when adapted to the link.
+  int quality;
+  int compress;
+} rfb_encsettings;
+
+typedef struct {
+  unsigned int generation; // Damage generation the rectangle was sent for.
+  rfb_rect r;
+  rfb_shared *data; // Headers and all, as queued. NULL if unused.
+} rfb_cached_rect;
+
+typedef struct rfb_encgroup {
+  rfb_encsettings settings;
+  U32 hash;
+  int refs; // Connections in the group.
+  pthread_mutex_t lock; // For the entries.
+  rfb_cached_rect entries[ENC_CACHE_ENTRIES];
+  int oldest;
+  struct rfb_encgroup *next;
+} rfb_encgroup;
+
+
+struct rfb_encstate;
+
+// What each thread that encodes pieces of a parallel update needs of its own.
+// Its zlib streams are only ever used independently (see enccache.c), so
+// they can encode for any connection:
+typedef struct rfb_enchelper {
+  rfb_arena arena;
+  rfb_outbuf out;
+  rfb_sharedpool pool; // For what's encoded in 'out'.
+  struct rfb_zrle *zrle;
+  struct rfb_tight *tight;
+} rfb_enchelper;
+
+// Queues the encoded data for 'r' (the rectangle header is already queued).
+// Returns 0 if done, ENC_FALLBACK if nothing was queued because another
+// encoding would do better, or -1 on error.
+typedef int (*enc_rect_fn)(struct rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+
+#define ENC_FALLBACK 1
+
+typedef struct {
+  S32 type;
+  const char *name;
+  enc_rect_fn encode;
+  // Biggest rectangle the encoding can take (0: no limit). Bigger ones are
+  // sent in pieces:
+  int max_width;
+  int max_pixels;
+} rfb_encoder;
+
+
+typedef struct rfb_encstate {
+  const rfb_frame *frame; // What's being encoded, while an update is.
+  rfb_arena *arena; // The owning worker's, for scratch space.
+  rfb_translator translator; // Converts to the client's pixel format.
+  int native; // Client uses our native pixel format, so needs no conversion.
+  // Encodings we implement, in the client's order of preference:
+  const rfb_encoder *encoders[ENC_MAX_PREFS];
+  int encoder_count;
+  int flags; // ENC_FLAG_*
+  int quality; // 0-9 from the quality pseudo-encodings, or -1.
+  int compress; // 0-9 from the compress-level pseudo-encodings, or -1.
+  // What suits the link to the client, which overrides its preference (see
+  // ENC_Adapt()):
+  const rfb_encoder *adapted; // NULL: the client's preferred encoding.
+  int adapted_quality; // -1: the client's quality level.
+  struct rfb_zrle *zrle; // ZRLE's zlib stream and tile cache, once used.
+  struct rfb_tight *tight; // Tight's zlib streams and JPEG compressor, likewise.
+  // Connections set up the same way share their encoded rectangles:
+  rfb_encgroup *group;
+  rfb_outbuf *staging; // The owning worker's, for encoding rectangles to share.
+  rfb_enchelper *helper; // The owning worker's, for its part of parallel updates.
+  unsigned int generation; // Damage generation of what's being encoded.
+  // Encoding for more than one connection, so the output mustn't depend on
+  // this one's compression history:
+  int independent;
+  // The update being encoded is big enough to split up and encode in
+  // parallel (see ENC_Parallel()):
+  int parallel;
+} rfb_encstate;
+
+
+void ENC_Init(rfb_encstate *es, rfb_arena *arena, rfb_outbuf *staging, rfb_enchelper *helper);
+void ENC_Free(rfb_encstate *es);
+int ENC_SetPixelFormat(rfb_encstate *es, const pixel_format *f);
+void ENC_SetEncodings(rfb_encstate *es, const S32 *encodings, int count);
+int ENC_Supports(const rfb_encstate *es, S32 type);
+int ENC_RectCount(const rfb_encstate *es, const rfb_rect *r);
+int ENC_SplitRect(const rfb_encstate *es, const rfb_rect *r, rfb_rect *pieces);
+int ENC_EncodePiece(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+int ENC_EncodeRect(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+int ENC_QueueCopy(rfb_outbuf *out, const rfb_damage *copy);
+int ENC_QueuePixels(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r, const U32 *src);
+int ENC_QueueCursor(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r, const U32 *pixels, const U8 *mask);
+int ENC_QueuePointerPos(rfb_outbuf *out, int x, int y);
+const char *ENC_Name(S32 type);
+U8 *ENC_Scratch(rfb_encstate *es, int size);
+int ENC_PutPixel(rfb_encstate *es, U32 pixel, U8 *dst);
+int ENC_CompressLevel(const rfb_encstate *es);
+int ENC_Quality(const rfb_encstate *es);
+S32 ENC_PreferredType(const rfb_encstate *es);
+int ENC_Adapt(rfb_encstate *es, S32 type, int quality);
+
+// Sharing between connections (enccache.c):
+void ENC_JoinGroup(rfb_encstate *es);
+void ENC_LeaveGroup(rfb_encstate *es);
+int ENC_IsShared(const rfb_encstate *es);
+int ENC_EncodeShared(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+rfb_shared *ENC_Lookup(rfb_encgroup *g, unsigned int generation, const rfb_rect *r);
+void ENC_Remember(rfb_encgroup *g, unsigned int generation, const rfb_rect *r, rfb_shared *data);
+int ENC_QueueEncoded(rfb_encstate *es, rfb_outbuf *out, rfb_shared *data);
+
+// Encoding big updates in parallel (encpool.c):
+int ENC_InitHelper(rfb_enchelper *h);
+int ENC_StartHelpers(int count);
+int ENC_Parallel(const rfb_encstate *es, const rfb_rect *rects, int count);
+int ENC_EncodeRects(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *rects, int count, int sock);
+
+// Encoders (see the registry in encode.c):
+int ENC_EncodeHextile(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+int ENC_EncodeZRLE(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+void ENC_FreeZRLE(rfb_encstate *es);
+int ENC_SharedZRLE(rfb_encstate *es);
+int ENC_EncodeTight(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r);
+void ENC_FreeTight(rfb_encstate *es);
+int ENC_SharedTight(rfb_encstate *es);
+
+#endif // ENCODE_H
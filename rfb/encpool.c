@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "encode.h"
+
+// Encoding big updates in parallel. A worker with an update of at least
+// ENC_PARALLEL_MIN_PIXELS to encode splits it into pieces (ENC_SplitRect()),
+// posts them as a job, and starts encoding them itself. Helper threads,
+// which otherwise sleep, wake up and steal pieces from it: whoever is free
+// claims the next one, much as FB_ScanTiles() shares out strips. A worker
+// never waits for helpers to be free, since it gets through its own job
+// alone if they're all busy. Each piece is encoded into a block of its own.
+// Whenever the worker finishes a piece, it queues (and sends) every piece
+// that's done and comes before the first that isn't, so the client sees
+// them just as if they'd been encoded one after another, and gets the first
+// as soon as it's ready rather than once they all are.
+//
+// Every piece is its own rectangle, encoded independently (see enccache.c),
+// which is what lets it be encoded on any thread:
+// - Raw isn't worth it (it's nearly all copying), so those updates aren't
+//   split. RRE and Hextile have no state, so their pieces are just smaller
+//   rectangles.
+// - ZRLE's compressed data for each piece starts afresh, without referring
+//   back to earlier pieces, so the client's one stream can take them in
+//   turn.
+// - Tight could reset the zlib streams each piece uses, which the protocol
+//   has bits for, but it's picked for slow links, where the bytes that
+//   costs (nearly half as many again) matter more than the time saved. So
+//   Tight updates aren't split either.
+// Pieces are square, so compression only loses the history from the rows
+// above. When the connection's settings are shared with others, pieces go
+// in (and come from) the group's cache like any other rectangle.
+
+
+typedef struct rfb_encjob {
+  rfb_encstate *es; // The connection's; only read while the job's on.
+  const rfb_rect *pieces;
+  rfb_shared **results; // What each piece was encoded to (NULL on error).
+  int *done; // Whether each piece's result is there yet.
+  int count;
+  int claimed; // Pieces handed out so far (may run past 'count').
+  int helpers; // Helpers working on it (with gJobLock held).
+  // The worker's side: where pieces go, and how many have gone so far:
+  rfb_outbuf *out;
+  int sock;
+  int queued;
+  int result;
+  struct rfb_encjob *next;
+} rfb_encjob;
+
+
+// Jobs with pieces left to claim, and helper threads, shared by all threads:
+static rfb_encjob *gJobs = NULL;
+static pthread_mutex_t gJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gJobPosted = PTHREAD_COND_INITIALIZER;
+// Helpers finished a piece, or left a job:
+static pthread_cond_t gJobProgress = PTHREAD_COND_INITIALIZER;
+static int gHelperCount = 0;
+
+
+int ENC_InitHelper(rfb_enchelper *h)
+{
+  memset(h, 0, sizeof(*h));
+  if (OUT_Init(&h->out) < 0 || ARENA_Init(&h->arena, ARENA_INIT_SIZE) < 0)
+  {
+    return -1;
+  }
+  h->pool.max_free = ENC_POOL_MAX_FREE;
+  h->out.pool = &h->pool;
+  return 0;
+}
+
+
+// Encodes piece 'i' with the helper's scratch space and zlib streams:
+static void ENC_EncodeJobPiece(rfb_encjob *job, rfb_enchelper *h, int i)
+{
+  rfb_encstate es = *job->es;
+  rfb_encgroup *g = ENC_IsShared(&es) ? es.group : NULL;
+  const rfb_rect *r = &job->pieces[i];
+  rfb_shared *data = g ? ENC_Lookup(g, es.generation, r) : NULL;
+  if (data)
+  {
+    job->results[i] = data;
+    return;
+  }
+  es.arena = &h->arena;
+  es.zrle = h->zrle;
+  es.tight = h->tight;
+  es.independent = 1;
+  if (ENC_EncodePiece(&es, &h->out, r) < 0)
+  {
+    OUT_Clear(&h->out);
+  }
+  else if ((data = OUT_Share(&h->out)) && g)
+  {
+    ENC_Remember(g, es.generation, r, data);
+  }
+  // Created the first time they're needed:
+  h->zrle = es.zrle;
+  h->tight = es.tight;
+  job->results[i] = data;
+}
+
+
+static void ENC_WorkOn(rfb_encjob *job, rfb_enchelper *h)
+{
+  int i;
+  while ((i = __atomic_fetch_add(&job->claimed, 1, __ATOMIC_RELAXED)) < job->count)
+  {
+    ENC_EncodeJobPiece(job, h, i);
+    pthread_mutex_lock(&gJobLock);
+    __atomic_store_n(&job->done[i], 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&gJobProgress);
+    pthread_mutex_unlock(&gJobLock);
+  }
+  ARENA_Reset(&h->arena);
+}
+
+
+static void *ENC_Helper(void *arg)
+{
+  rfb_enchelper *h = arg;
+  rfb_encjob *job;
+  pthread_mutex_lock(&gJobLock);
+  while (1)
+  {
+    for (job = gJobs; job; job = job->next)
+    {
+      if (__atomic_load_n(&job->claimed, __ATOMIC_RELAXED) < job->count)
+      {
+        break;
+      }
+    }
+    if (!job)
+    {
+      pthread_cond_wait(&gJobPosted, &gJobLock);
+      continue;
+    }
+    ++job->helpers;
+    pthread_mutex_unlock(&gJobLock);
+    ENC_WorkOn(job, h);
+    pthread_mutex_lock(&gJobLock);
+    if (--job->helpers == 0)
+    {
+      pthread_cond_broadcast(&gJobProgress);
+    }
+  }
+  return NULL;
+}
+
+
+// Starts 'count' helper threads. Returns how many started.
+int ENC_StartHelpers(int count)
+{
+  pthread_t thread;
+  rfb_enchelper *h;
+  while (gHelperCount < count)
+  {
+    h = malloc(sizeof(rfb_enchelper));
+    if (!h || ENC_InitHelper(h) < 0 || pthread_create(&thread, NULL, ENC_Helper, h) != 0)
+    {
+      break;
+    }
+    pthread_detach(thread);
+    ++gHelperCount;
+  }
+  return gHelperCount;
+}
+
+
+// Whether an update made of 'rects' is worth encoding in parallel. This
+// decides how it's split up, so it has to be settled before ENC_RectCount()
+// is asked about it (by setting es->parallel).
+int ENC_Parallel(const rfb_encstate *es, const rfb_rect *rects, int count)
+{
+  int type = ENC_PreferredType(es);
+  int pixels = 0;
+  int i;
+  if (!gHelperCount || type == ENC_RAW || type == ENC_TIGHT)
+  {
+    return 0;
+  }
+  for (i=0; i<count && pixels < ENC_PARALLEL_MIN_PIXELS; ++i)
+  {
+    pixels += rects[i].w * rects[i].h;
+  }
+  return pixels >= ENC_PARALLEL_MIN_PIXELS;
+}
+
+
+// Queues the pieces that are done, in order, up to the first that isn't,
+// and sends what it can of them (the worker only).
+static void ENC_QueueDone(rfb_encjob *job)
+{
+  int start = job->queued;
+  while (job->queued < job->count && __atomic_load_n(&job->done[job->queued], __ATOMIC_ACQUIRE))
+  {
+    rfb_shared *data = job->results[job->queued++];
+    if (!data || (job->result == 0 && ENC_QueueEncoded(job->es, job->out, data) < 0))
+    {
+      job->result = -1;
+    }
+    OUT_Release(data);
+  }
+  if (job->queued > start && job->result == 0 && OUT_Flush(job->out, job->sock) < 0)
+  {
+    job->result = -1;
+  }
+}
+
+
+// Encodes every piece of 'job', with whatever help is free, queueing each
+// as soon as it can go:
+static void ENC_RunJob(rfb_encjob *job)
+{
+  rfb_enchelper *h = job->es->helper;
+  rfb_encjob **pj;
+  int i;
+  pthread_mutex_lock(&gJobLock);
+  job->next = gJobs;
+  gJobs = job;
+  pthread_mutex_unlock(&gJobLock);
+  pthread_cond_broadcast(&gJobPosted);
+  while ((i = __atomic_fetch_add(&job->claimed, 1, __ATOMIC_RELAXED)) < job->count)
+  {
+    ENC_EncodeJobPiece(job, h, i);
+    __atomic_store_n(&job->done[i], 1, __ATOMIC_RELEASE);
+    ENC_QueueDone(job);
+  }
+  ARENA_Reset(&h->arena);
+  // Every piece has been claimed. Queue the rest as helpers finish them, and
+  // once they've all left, so has the job:
+  pthread_mutex_lock(&gJobLock);
+  for (pj = &gJobs; *pj; pj = &(*pj)->next)
+  {
+    if (*pj == job)
+    {
+      *pj = job->next;
+      break;
+    }
+  }
+  while (job->queued < job->count || job->helpers)
+  {
+    if (job->queued < job->count && __atomic_load_n(&job->done[job->queued], __ATOMIC_ACQUIRE))
+    {
+      pthread_mutex_unlock(&gJobLock);
+      ENC_QueueDone(job);
+      pthread_mutex_lock(&gJobLock);
+      continue;
+    }
+    pthread_cond_wait(&gJobProgress, &gJobLock);
+  }
+  pthread_mutex_unlock(&gJobLock);
+}
+
+
+// Queues 'rects' (headers and data), as ENC_RectCount() says for each, in
+// order. If es->parallel is set they're encoded in parallel, and sent to
+// 'sock' as they're done; otherwise they're only queued.
+int ENC_EncodeRects(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *rects, int count, int sock)
+{
+  rfb_encjob job;
+  rfb_rect *pieces;
+  int total = 0;
+  int i;
+  if (!es->parallel)
+  {
+    for (i=0; i<count; ++i)
+    {
+      if (ENC_EncodeRect(es, out, &rects[i]) < 0)
+      {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  for (i=0; i<count; ++i)
+  {
+    total += ENC_RectCount(es, &rects[i]);
+  }
+  memset(&job, 0, sizeof(job));
+  job.es = es;
+  job.out = out;
+  job.sock = sock;
+  job.results = ARENA_Alloc(es->arena, total * sizeof(rfb_shared*));
+  job.done = ARENA_Alloc(es->arena, total * sizeof(int));
+  pieces = ARENA_Alloc(es->arena, total * sizeof(rfb_rect));
+  if (!job.results || !job.done || !pieces)
+  {
+    return -1;
+  }
+  memset(job.done, 0, total * sizeof(int));
+  for (i=0; i<count; ++i)
+  {
+    job.count += ENC_SplitRect(es, &rects[i], pieces + job.count);
+  }
+  job.pieces = pieces;
+  ENC_RunJob(&job);
+  return job.result;
+}
@@ -0,0 +1,1108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fb.h"
+
+
+static int RECT_Area(const rfb_rect *r)
+{
+  return r->w * r->h;
+}
+
+
+int RECT_Intersect(const rfb_rect *a, const rfb_rect *b, rfb_rect *out)
+{
+  int x0 = Max(a->x, b->x);
+  int y0 = Max(a->y, b->y);
+  int x1 = Min(a->x + a->w, b->x + b->w);
+  int y1 = Min(a->y + a->h, b->y + b->h);
+  if (x1 <= x0 || y1 <= y0)
+  {
+    return 0;
+  }
+  out->x = x0;
+  out->y = y0;
+  out->w = x1 - x0;
+  out->h = y1 - y0;
+  return 1;
+}
+
+
+void RECT_Union(const rfb_rect *a, const rfb_rect *b, rfb_rect *out)
+{
+  int x0 = Min(a->x, b->x);
+  int y0 = Min(a->y, b->y);
+  int x1 = Max(a->x + a->w, b->x + b->w);
+  int y1 = Max(a->y + a->h, b->y + b->h);
+  out->x = x0;
+  out->y = y0;
+  out->w = x1 - x0;
+  out->h = y1 - y0;
+}
+
+
+// What's left of 'a' with 'b' taken out: up to four rectangles (full-width
+// bands above and below 'b', then what's either side of it). Returns how
+// many.
+int RECT_Subtract(const rfb_rect *a, const rfb_rect *b, rfb_rect out[4])
+{
+  rfb_rect i;
+  int n = 0;
+  if (!RECT_Intersect(a, b, &i))
+  {
+    out[0] = *a;
+    return 1;
+  }
+  if (i.y > a->y)
+  {
+    rfb_rect above = { a->x, a->y, a->w, i.y - a->y };
+    out[n++] = above;
+  }
+  if (i.y + i.h < a->y + a->h)
+  {
+    rfb_rect below = { a->x, i.y + i.h, a->w, a->y + a->h - (i.y + i.h) };
+    out[n++] = below;
+  }
+  if (i.x > a->x)
+  {
+    rfb_rect left = { a->x, i.y, i.x - a->x, i.h };
+    out[n++] = left;
+  }
+  if (i.x + i.w < a->x + a->w)
+  {
+    rfb_rect right = { i.x + i.w, i.y, a->x + a->w - (i.x + i.w), i.h };
+    out[n++] = right;
+  }
+  return n;
+}
+
+
+int RECT_Contains(const rfb_rect *outer, const rfb_rect *inner)
+{
+  return inner->x >= outer->x
+      && inner->y >= outer->y
+      && inner->x + inner->w <= outer->x + outer->w
+      && inner->y + inner->h <= outer->y + outer->h;
+}
+
+
+// How many pixels merging 'a' and 'b' would send that neither of them covers:
+static int RECT_MergeWaste(const rfb_rect *a, const rfb_rect *b)
+{
+  rfb_rect u, i;
+  int overlap = RECT_Intersect(a, b, &i) ? RECT_Area(&i) : 0;
+  RECT_Union(a, b, &u);
+  return RECT_Area(&u) - (RECT_Area(a) + RECT_Area(b) - overlap);
+}
+
+
+void REGION_Clear(rfb_region *rg)
+{
+  rg->count = 0;
+}
+
+
+int REGION_IsEmpty(const rfb_region *rg)
+{
+  return rg->count == 0;
+}
+
+
+int REGION_Intersects(const rfb_region *rg, const rfb_rect *r)
+{
+  rfb_rect overlap;
+  int i;
+  for (i=0; i<rg->count; ++i)
+  {
+    if (RECT_Intersect(&rg->rects[i], r, &overlap))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static void REGION_Remove(rfb_region *rg, int index)
+{
+  rg->rects[index] = rg->rects[--rg->count];
+}
+
+
+// Adds 'r' to the region, merging it with any rectangle where that costs
+// little extra area. If the region is full, the two rectangles that waste
+// the least when merged are combined to make room.
+void REGION_Add(rfb_region *rg, const rfb_rect *r)
+{
+  rfb_rect add = *r;
+  int i, j;
+  int merged;
+  if (add.w <= 0 || add.h <= 0)
+  {
+    return;
+  }
+  do
+  {
+    merged = 0;
+    for (i=0; i<rg->count; ++i)
+    {
+      rfb_rect *e = &rg->rects[i];
+      if (RECT_Contains(e, &add))
+      {
+        // Already covered:
+        return;
+      }
+      // Merge if it wastes no more than a quarter of what we'd send anyway:
+      if (RECT_MergeWaste(e, &add)*4 <= RECT_Area(e) + RECT_Area(&add))
+      {
+        RECT_Union(e, &add, &add);
+        REGION_Remove(rg, i);
+        merged = 1;
+        break;
+      }
+    }
+  } while (merged);
+  if (rg->count == REGION_MAX_RECTS)
+  {
+    int best_i = 0, best_j = 1;
+    int best_waste = -1;
+    for (i=0; i<rg->count; ++i)
+    {
+      for (j=i+1; j<rg->count; ++j)
+      {
+        int waste = RECT_MergeWaste(&rg->rects[i], &rg->rects[j]);
+        if (best_waste < 0 || waste < best_waste)
+        {
+          best_waste = waste;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    RECT_Union(&rg->rects[best_i], &rg->rects[best_j], &rg->rects[best_i]);
+    REGION_Remove(rg, best_j);
+  }
+  rg->rects[rg->count++] = add;
+}
+
+
+// The pixel format our framebuffer memory is in, i.e. what ServerInit
+// offers. Clients that keep it can be sent framebuffer memory as-is.
+void FB_NativeFormat(pixel_format *f)
+{
+  memset(f, 0, sizeof(*f));
+  f->bpp = 32;
+  f->depth = 24;
+  f->big_endian = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+  f->true_colour = 1;
+  f->r_max[1] = 255;
+  f->r_max[0] = 0;
+  f->g_max[1] = 255;
+  f->g_max[0] = 0;
+  f->b_max[1] = 255;
+  f->b_max[0] = 0;
+  f->r_shift = 16;
+  f->g_shift = 8;
+  f->b_shift = 0;
+}
+
+
+int FB_IsNativeFormat(const pixel_format *f)
+{
+  pixel_format native;
+  FB_NativeFormat(&native);
+  // Depth is only a hint, so it doesn't matter here:
+  return f->bpp == native.bpp
+      && f->true_colour
+      && !!f->big_endian == native.big_endian
+      && RFB16P(f->r_max) == 255
+      && RFB16P(f->g_max) == 255
+      && RFB16P(f->b_max) == 255
+      && f->r_shift == native.r_shift
+      && f->g_shift == native.g_shift
+      && f->b_shift == native.b_shift;
+}
+
+
+// Tile hashing is an xxHash-style round per 64 bits (two pixels), spread
+// over FB_TILE_LANES independent lanes so the multiplies can overlap:
+#define FB_PRIME1 0x9E3779B185EBCA87ULL
+#define FB_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+#define FB_Rotl(zzv,zzn) (((zzv) << (zzn)) | ((zzv) >> (64-(zzn))))
+
+static inline U64 FB_TileRound(U64 acc, U64 word)
+{
+  acc += word * FB_PRIME2;
+  return FB_Rotl(acc, 31) * FB_PRIME1;
+}
+
+
+// Hashes every tile of 'strip' in 'pixels', a pixel row at a time so memory
+// is read in order, and records any tiles that changed as damage (if
+// 'report').
+static void FB_ScanStrip(rfb_framebuffer *fb, const U32 *pixels, int strip, int report)
+{
+  U64 *lanes = fb->tile_lanes + strip * fb->tiles_x * FB_TILE_LANES;
+  U64 *hashes = fb->tile_hashes + strip * fb->tiles_x;
+  int y0 = strip * FB_TILE_SIZE;
+  int h = Min(FB_TILE_SIZE, fb->height - y0);
+  int full = fb->width / FB_TILE_SIZE; // Tiles that are FB_TILE_SIZE wide.
+  int first = -1, last = -1, runs = 0;
+  int t, x, y, k;
+  for (t=0; t<fb->tiles_x * FB_TILE_LANES; ++t)
+  {
+    lanes[t] = FB_PRIME1 + t;
+  }
+  for (y=0; y<h; ++y)
+  {
+    const U32 *row = pixels + (y0+y)*fb->stride;
+    for (t=0; t<full; ++t)
+    {
+      const U32 *p = row + t*FB_TILE_SIZE;
+      U64 *l = lanes + t*FB_TILE_LANES;
+      for (x=0; x<FB_TILE_SIZE; x+=2*FB_TILE_LANES)
+      {
+        for (k=0; k<FB_TILE_LANES; ++k)
+        {
+          U64 word;
+          memcpy(&word, p + x + 2*k, sizeof(word));
+          l[k] = FB_TileRound(l[k], word);
+        }
+      }
+    }
+    // The last tile may be narrower:
+    for (x=full*FB_TILE_SIZE; x<fb->width; ++x)
+    {
+      lanes[full*FB_TILE_LANES] = FB_TileRound(lanes[full*FB_TILE_LANES], row[x]);
+    }
+  }
+  for (t=0; t<fb->tiles_x; ++t)
+  {
+    U64 *l = lanes + t*FB_TILE_LANES;
+    U64 hash = FB_Rotl(l[0], 1) + FB_Rotl(l[1], 7) + FB_Rotl(l[2], 12) + FB_Rotl(l[3], 18);
+    if (hash == hashes[t])
+    {
+      continue;
+    }
+    hashes[t] = hash;
+    if (first >= 0 && t > last+1 && runs < FB_SCAN_MAX_RUNS-1)
+    {
+      if (report)
+      {
+        FB_Damage(fb, first*FB_TILE_SIZE, y0, (last+1 - first)*FB_TILE_SIZE, h);
+      }
+      ++runs;
+      first = -1;
+    }
+    if (first < 0)
+    {
+      first = t;
+    }
+    last = t;
+  }
+  if (report && first >= 0)
+  {
+    FB_Damage(fb, first*FB_TILE_SIZE, y0, (last+1 - first)*FB_TILE_SIZE, h);
+  }
+}
+
+
+// Works out damage nobody reported, by comparing tile hashes. Every worker
+// calls this on its update ticks with the number of the scan interval it's
+// in ('round'), and the strips of each round are shared out between
+// whichever workers get here while it lasts. A new round only starts once
+// the last one is finished, so no two threads ever scan the same strip at
+// once. Strips are read from the canvas's front buffer, which producers
+// leave alone while we do.
+void FB_ScanTiles(rfb_framebuffer *fb, unsigned int round)
+{
+  U64 state = __atomic_load_n(&fb->scan_state, __ATOMIC_ACQUIRE);
+  U64 claimed;
+  unsigned int strip;
+  if (!fb->scan)
+  {
+    return;
+  }
+  while (1)
+  {
+    unsigned int current = (unsigned int)(state >> 32);
+    unsigned int started = (unsigned int)(state >> 16) & 0xFFFF;
+    unsigned int finished = (unsigned int)state & 0xFFFF;
+    if (started < fb->tiles_y)
+    {
+      strip = started;
+      claimed = state + (1 << 16);
+    }
+    else if ((int)(round - current) > 0 && finished == fb->tiles_y)
+    {
+      strip = 0;
+      claimed = ((U64)round << 32) | (1 << 16);
+    }
+    else
+    {
+      return;
+    }
+    if (__atomic_compare_exchange_n(&fb->scan_state, &state, claimed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      int buffer = SHM_AcquireFront(fb->canvas);
+      if (buffer >= 0)
+      {
+        FB_ScanStrip(fb, SHM_BUFFER(fb->canvas, buffer), strip, 1);
+        SHM_Release(fb->canvas, buffer);
+      }
+      state = __atomic_add_fetch(&fb->scan_state, 1, __ATOMIC_ACQ_REL);
+    }
+  }
+}
+
+
+// Adds a frame (with nothing in it yet) to the framebuffer's set. Returns -1
+// if there's no room or memory for one.
+static int FB_NewFrame(rfb_framebuffer *fb)
+{
+  rfb_frame *frame = &fb->frames[fb->frame_count];
+  if (fb->frame_count == FB_MAX_FRAMES
+    || !(frame->blob = OUT_NewShared(sizeof(U32) * fb->stride * fb->height)))
+  {
+    return -1;
+  }
+  frame->width = fb->width;
+  frame->height = fb->height;
+  frame->stride = fb->stride;
+  frame->pixels = (U32*)frame->blob->data;
+  frame->generation = fb->generation;
+  return fb->frame_count++;
+}
+
+
+// Gives a frame new pixels (with nothing in them yet), leaving the old ones
+// to whichever queues still have them to send. Returns -1 if out of memory.
+static int FB_RenewFrame(rfb_framebuffer *fb, rfb_frame *frame)
+{
+  rfb_shared *blob = OUT_NewShared(sizeof(U32) * fb->stride * fb->height);
+  if (!blob)
+  {
+    return -1;
+  }
+  OUT_Release(frame->blob);
+  frame->blob = blob;
+  frame->pixels = (U32*)blob->data;
+  return 0;
+}
+
+
+// 'canvas' is what producers draw into, if they're in other processes (see
+// shm.h), or NULL to make one for our own drawing.
+int FB_Init(rfb_framebuffer *fb, int width, int height, rfb_shm_header *canvas)
+{
+  int lines = Max(width, height);
+  pixel_format format;
+  U32 *pixels;
+  int x, y, i;
+  memset(fb, 0, sizeof(*fb));
+  fb->own_canvas = !canvas;
+  if (!canvas)
+  {
+    FB_NativeFormat(&format);
+    canvas = SHM_Create(NULL, width, height, &format);
+  }
+  fb->canvas = canvas;
+  fb->tiles_x = (width + FB_TILE_SIZE-1) / FB_TILE_SIZE;
+  fb->tiles_y = (height + FB_TILE_SIZE-1) / FB_TILE_SIZE;
+  for (fb->index_size=1; fb->index_size < lines*2; fb->index_size*=2);
+  fb->shadow = malloc(sizeof(U32) * width * height);
+  fb->scroll_row = malloc(sizeof(U32) * width);
+  fb->new_hashes = malloc(sizeof(U64) * lines);
+  fb->old_hashes = malloc(sizeof(U64) * lines);
+  fb->votes = malloc(sizeof(int) * (lines*2 + 1));
+  fb->index_keys = malloc(sizeof(U64) * fb->index_size);
+  fb->index_lines = malloc(sizeof(int) * fb->index_size);
+  fb->tile_hashes = malloc(sizeof(U64) * fb->tiles_x * fb->tiles_y);
+  fb->tile_lanes = malloc(sizeof(U64) * fb->tiles_x * fb->tiles_y * FB_TILE_LANES);
+  if (!fb->canvas || !fb->shadow || !fb->scroll_row || !fb->new_hashes || !fb->old_hashes
+    || !fb->votes || !fb->index_keys || !fb->index_lines
+    || !fb->tile_hashes || !fb->tile_lanes)
+  {
+    FB_Free(fb);
+    return -1;
+  }
+  fb->width = width;
+  fb->height = height;
+  fb->stride = width;
+  pthread_mutex_init(&fb->lock, NULL);
+  pthread_mutex_init(&fb->publish_lock, NULL);
+  pthread_mutex_init(&fb->moves_lock, NULL);
+  // Start with a gradient, so there's something to look at. Every buffer
+  // starts out the same, so none has anything to catch up on:
+  pixels = SHM_BUFFER(canvas, 0);
+  for (y=0; y<height; ++y)
+  {
+    for (x=0; x<width; ++x)
+    {
+      pixels[y*fb->stride + x] = FB_RGB(x*255/width, y*255/height, 0x80);
+    }
+  }
+  for (i=1; i<SHM_BUFFERS; ++i)
+  {
+    memcpy(SHM_BUFFER(canvas, i), pixels, sizeof(U32) * width * height);
+  }
+  memcpy(fb->shadow, pixels, sizeof(U32) * width * height);
+  for (i=0; i<FB_FRAMES; ++i)
+  {
+    if (FB_NewFrame(fb) < 0)
+    {
+      FB_Free(fb);
+      return -1;
+    }
+    memcpy(fb->frames[i].pixels, pixels, sizeof(U32) * width * height);
+  }
+  for (y=0; y<fb->tiles_y; ++y)
+  {
+    FB_ScanStrip(fb, pixels, y, 0);
+  }
+  // As if round 0 had been and gone:
+  fb->scan_state = ((U64)fb->tiles_y << 16) | fb->tiles_y;
+  return 0;
+}
+
+
+void FB_Free(rfb_framebuffer *fb)
+{
+  int i;
+  if (fb->width)
+  {
+    pthread_mutex_destroy(&fb->lock);
+    pthread_mutex_destroy(&fb->publish_lock);
+    pthread_mutex_destroy(&fb->moves_lock);
+  }
+  if (fb->own_canvas && fb->canvas)
+  {
+    SHM_Destroy(NULL, fb->canvas);
+  }
+  for (i=0; i<fb->frame_count; ++i)
+  {
+    OUT_Release(fb->frames[i].blob);
+  }
+  free(fb->shadow);
+  free(fb->scroll_row);
+  free(fb->new_hashes);
+  free(fb->old_hashes);
+  free(fb->votes);
+  free(fb->index_keys);
+  free(fb->index_lines);
+  free(fb->tile_hashes);
+  free(fb->tile_lanes);
+  memset(fb, 0, sizeof(*fb));
+}
+
+
+// Caller must hold fb->lock:
+static void FB_AppendLocked(rfb_framebuffer *fb, const rfb_damage *d)
+{
+  unsigned int generation = fb->generation;
+  // As in a seqlock: the generation that says this slot is being reused is
+  // visible before anything written to it, so a reader that sees any of the
+  // new entry also sees that it was lapped (see FB_CollectDamage()):
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  fb->damage[generation % FB_DAMAGE_RING] = *d;
+  // Publish the ring entry before the generation that covers it:
+  __atomic_store_n(&fb->generation, generation+1, __ATOMIC_RELEASE);
+}
+
+
+static void FB_DamageLocked(rfb_framebuffer *fb, const rfb_rect *r)
+{
+  rfb_damage d = { *r, 0, 0, 0, 0, 0 };
+  FB_AppendLocked(fb, &d);
+}
+
+
+// Records that the given area has changed (in the canvas's front buffer):
+void FB_Damage(rfb_framebuffer *fb, int x, int y, int w, int h)
+{
+  rfb_rect r = { x, y, w, h };
+  rfb_rect screen = { 0, 0, fb->width, fb->height };
+  if (!RECT_Intersect(&r, &screen, &r))
+  {
+    return;
+  }
+  pthread_mutex_lock(&fb->lock);
+  FB_DamageLocked(fb, &r);
+  pthread_mutex_unlock(&fb->lock);
+}
+
+
+// Our own drawing is a producer like any other (see shm.h), on one thread:
+// FB_FillRect() and FB_Scroll() draw into the frame started here, which is
+// shown once it's ended. If another process is drawing a frame into a
+// shared canvas, we wait our turn.
+void FB_BeginDraw(rfb_framebuffer *fb)
+{
+  while (!(fb->back = SHM_BeginFrame(fb->canvas)))
+  {
+    SHM_WaitTurn(fb->canvas);
+  }
+}
+
+
+void FB_EndDraw(rfb_framebuffer *fb)
+{
+  // If the damage ring was full, the whole screen is sent anyway:
+  SHM_EndFrame(fb->canvas);
+  fb->back = NULL;
+}
+
+
+void FB_FillRect(rfb_framebuffer *fb, int x, int y, int w, int h, U32 color)
+{
+  rfb_rect r = { x, y, w, h };
+  rfb_rect screen = { 0, 0, fb->width, fb->height };
+  int i, j;
+  if (!RECT_Intersect(&r, &screen, &r))
+  {
+    return;
+  }
+  for (j=0; j<r.h; ++j)
+  {
+    U32 *p = fb->back + (r.y+j)*fb->stride + r.x;
+    for (i=0; i<r.w; ++i)
+    {
+      p[i] = color;
+    }
+  }
+  SHM_Post(fb->canvas, r.x, r.y, r.w, r.h);
+}
+
+
+// Scrolls the whole framebuffer up (dy > 0) or down by 'dy' rows, wrapping
+// around. It's only reported as damage: working out that it was a scroll is
+// left to FB_DetectMoves(), as it would be for any other program's drawing.
+void FB_Scroll(rfb_framebuffer *fb, int dy)
+{
+  int row_bytes = fb->width * sizeof(U32);
+  int start, i, j, cycles;
+  dy %= fb->height;
+  if (dy < 0)
+  {
+    dy += fb->height;
+  }
+  if (!dy)
+  {
+    return;
+  }
+  // Rotates the rows in place: row i takes row i+dy (wrapping), which goes
+  // round gcd(height, dy) separate cycles, each needing one row put aside:
+  for (i=fb->height, j=dy; j; )
+  {
+    int rest = i % j;
+    i = j;
+    j = rest;
+  }
+  cycles = i;
+  for (start=0; start<cycles; ++start)
+  {
+    memcpy(fb->scroll_row, fb->back + start*fb->stride, row_bytes);
+    for (i=start; (j = (i + dy) % fb->height) != start; i=j)
+    {
+      memcpy(fb->back + i*fb->stride, fb->back + j*fb->stride, row_bytes);
+    }
+    memcpy(fb->back + i*fb->stride, fb->scroll_row, row_bytes);
+  }
+  SHM_Post(fb->canvas, 0, 0, fb->width, fb->height);
+}
+
+
+static U64 FB_HashPixels(const U32 *pixels, int stride, int w, int h)
+{
+  U64 hash = 0xCBF29CE484222325ULL;
+  int x, y;
+  for (y=0; y<h; ++y)
+  {
+    const U32 *row = pixels + y*stride;
+    for (x=0; x+1<w; x+=2)
+    {
+      U64 pair;
+      memcpy(&pair, row+x, sizeof(pair));
+      hash = (hash ^ pair) * 0x100000001B3ULL;
+      hash ^= hash >> 29;
+    }
+    if (x < w)
+    {
+      hash = (hash ^ row[x]) * 0x100000001B3ULL;
+      hash ^= hash >> 29;
+    }
+  }
+  return hash;
+}
+
+
+// Hashes the pixels in 'r', two at a time. Used to spot areas that were
+// damaged but didn't actually change. The caller has to make sure 'r' is on
+// the screen.
+U64 FB_HashRect(const rfb_frame *frame, const rfb_rect *r)
+{
+  return FB_HashPixels(FB_PIXEL_PTR(frame, r->x, r->y), frame->stride, r->w, r->h);
+}
+
+
+// Hashes each column of 'r' in 'pixels', a row at a time so it's read in
+// order:
+static void FB_HashColumns(const U32 *pixels, int stride, const rfb_rect *r, U64 *hashes)
+{
+  int x, y;
+  for (x=0; x<r->w; ++x)
+  {
+    hashes[x] = 0xCBF29CE484222325ULL;
+  }
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = pixels + (r->y+y)*stride + r->x;
+    for (x=0; x<r->w; ++x)
+    {
+      U64 hash = (hashes[x] ^ row[x]) * 0x100000001B3ULL;
+      hashes[x] = hash ^ (hash >> 29);
+    }
+  }
+}
+
+
+// Given hashes of 'count' lines (rows or columns) now and before, finds the
+// longest run of lines that all moved by the same amount: new line i is old
+// line i+*offset. Returns its length (0 if there's nothing worth it), with
+// the first new line in *start.
+static int FB_FindShift(rfb_framebuffer *fb, int count, int *start, int *offset)
+{
+  const U64 *now = fb->new_hashes;
+  const U64 *old = fb->old_hashes;
+  int mask = fb->index_size - 1;
+  int best = 0;
+  int run = 0;
+  int i, slot, shift;
+  // Index the old lines by hash. Repeats (blank lines, say) keep the first:
+  for (i=0; i<fb->index_size; ++i)
+  {
+    fb->index_lines[i] = -1;
+  }
+  for (i=0; i<count; ++i)
+  {
+    for (slot=old[i] & mask; fb->index_lines[slot] >= 0 && fb->index_keys[slot] != old[i]; slot=(slot+1) & mask);
+    if (fb->index_lines[slot] < 0)
+    {
+      fb->index_keys[slot] = old[i];
+      fb->index_lines[slot] = i;
+    }
+  }
+  // Each new line that was somewhere else before votes for that shift.
+  // Runs of identical lines could have come from anywhere, so only the
+  // first of each votes:
+  memset(fb->votes, 0, sizeof(int) * (count*2 + 1));
+  for (i=0; i<count; ++i)
+  {
+    if (i && now[i] == now[i-1])
+    {
+      continue;
+    }
+    for (slot=now[i] & mask; fb->index_lines[slot] >= 0; slot=(slot+1) & mask)
+    {
+      if (fb->index_keys[slot] == now[i])
+      {
+        ++fb->votes[fb->index_lines[slot] - i + count];
+        break;
+      }
+    }
+  }
+  for (shift=-count; shift<=count; ++shift)
+  {
+    if (shift && fb->votes[shift + count] > fb->votes[best + count])
+    {
+      best = shift;
+    }
+  }
+  if (!best)
+  {
+    return 0;
+  }
+  // The longest run of lines that match with that shift:
+  *offset = best;
+  best = 0;
+  for (i=0; i<count; ++i)
+  {
+    if (i+*offset >= 0 && i+*offset < count && now[i] == old[i+*offset])
+    {
+      if (++run > best)
+      {
+        best = run;
+        *start = i+1 - run;
+      }
+    }
+    else
+    {
+      run = 0;
+    }
+  }
+  return (best >= FB_MOVE_MIN_LINES) ? best : 0;
+}
+
+
+// Checks (pixel for pixel) that 'r' of 'frame' holds what the shadow had at
+// (src_x, src_y):
+static int FB_MoveMatches(rfb_framebuffer *fb, const rfb_frame *frame, const rfb_rect *r, int src_x, int src_y)
+{
+  int y;
+  for (y=0; y<r->h; ++y)
+  {
+    if (memcmp(FB_PIXEL_PTR(frame, r->x, r->y+y), fb->shadow + (src_y+y)*fb->stride + src_x, r->w * sizeof(U32)))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// Looks for content that moved within damaged area 'r' of 'frame': a band of
+// rows that moved up or down, or of columns that moved sideways, whichever
+// is bigger. Fills in 'copy' and returns 1 if it found one.
+static int FB_DetectMove(rfb_framebuffer *fb, const rfb_frame *frame, const rfb_rect *r, rfb_damage *copy)
+{
+  int rows = 0, row_start = 0, row_offset = 0;
+  int cols = 0, col_start = 0, col_offset = 0;
+  int y;
+  if (r->w * r->h < FB_MOVE_MIN_AREA)
+  {
+    return 0;
+  }
+  for (y=0; y<r->h; ++y)
+  {
+    fb->new_hashes[y] = FB_HashPixels(FB_PIXEL_PTR(frame, r->x, r->y+y), fb->stride, r->w, 1);
+    fb->old_hashes[y] = FB_HashPixels(fb->shadow + (r->y+y)*fb->stride + r->x, fb->stride, r->w, 1);
+  }
+  rows = FB_FindShift(fb, r->h, &row_start, &row_offset);
+  FB_HashColumns(frame->pixels, fb->stride, r, fb->new_hashes);
+  FB_HashColumns(fb->shadow, fb->stride, r, fb->old_hashes);
+  cols = FB_FindShift(fb, r->w, &col_start, &col_offset);
+  if (!rows && !cols)
+  {
+    return 0;
+  }
+  copy->flags = FB_DAMAGE_COPY;
+  if (rows * r->w >= cols * r->h)
+  {
+    copy->r.x = r->x;
+    copy->r.y = r->y + row_start;
+    copy->r.w = r->w;
+    copy->r.h = rows;
+    copy->src_x = r->x;
+    copy->src_y = copy->r.y + row_offset;
+  }
+  else
+  {
+    copy->r.x = r->x + col_start;
+    copy->r.y = r->y;
+    copy->r.w = cols;
+    copy->r.h = r->h;
+    copy->src_x = copy->r.x + col_offset;
+    copy->src_y = r->y;
+  }
+  // Hashes only find candidates:
+  return FB_MoveMatches(fb, frame, &copy->r, copy->src_x, copy->src_y);
+}
+
+
+// Explains whatever damage it can since the last call as moves (see
+// rfb_damage), then brings the shadow up to date. Workers call this before
+// sending updates; if another one is at it, it's left for later. It works
+// from the latest frame, and only takes fb->lock to add the moves it found,
+// so the damage producers post never waits for it.
+void FB_DetectMoves(rfb_framebuffer *fb)
+{
+  const rfb_frame *frame = &fb->frames[__atomic_load_n(&fb->latest, __ATOMIC_ACQUIRE)];
+  rfb_damage seen[FB_DAMAGE_RING];
+  rfb_damage made[FB_DAMAGE_RING];
+  int made_count = 0;
+  unsigned int start, end, before, after, i;
+  int lost, j, y;
+  if (__atomic_load_n(&frame->generation, __ATOMIC_ACQUIRE) == __atomic_load_n(&fb->shadow_generation, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+  if (pthread_mutex_trylock(&fb->moves_lock))
+  {
+    return;
+  }
+  frame = FB_AcquireFrame(fb);
+  start = fb->shadow_generation;
+  end = frame->generation;
+  // Work from copies of the entries, which new damage may lap while we're
+  // at it (as in FB_CollectDamage()):
+  lost = (end - start > FB_DAMAGE_RING);
+  for (i=start; !lost && i!=end; ++i)
+  {
+    seen[i - start] = fb->damage[i % FB_DAMAGE_RING];
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (lost || __atomic_load_n(&fb->generation, __ATOMIC_RELAXED) - start >= FB_DAMAGE_RING)
+  {
+    // Lost track, so no moves this time:
+    memcpy(fb->shadow, frame->pixels, sizeof(U32) * fb->stride * fb->height);
+    __atomic_store_n(&fb->shadow_generation, end, __ATOMIC_RELEASE);
+    FB_ReleaseFrame(frame);
+    pthread_mutex_unlock(&fb->moves_lock);
+    return;
+  }
+  // Compare everything with the shadow as it was, and only then update it:
+  for (i=start; i!=end; ++i)
+  {
+    rfb_damage *d = &seen[i - start];
+    rfb_damage copy;
+    rfb_rect src, overlap;
+    if (d->flags || !FB_DetectMove(fb, frame, &d->r, &copy))
+    {
+      continue;
+    }
+    // A copy's source has to be what clients had before any of this pass's
+    // copies, so it can't overlap where one of those went:
+    src = copy.r;
+    src.x = copy.src_x;
+    src.y = copy.src_y;
+    for (j=0; j<made_count && !RECT_Intersect(&made[j].r, &src, &overlap); ++j);
+    if (j < made_count)
+    {
+      continue;
+    }
+    copy.replaces = i;
+    made[made_count++] = copy;
+  }
+  pthread_mutex_lock(&fb->lock);
+  before = fb->generation;
+  // Each replaced entry adds up to 3 more, which mustn't lap the ones we
+  // still need:
+  for (j=0; j<made_count && fb->generation + 3 - made[j].replaces <= FB_DAMAGE_RING; ++j)
+  {
+    const rfb_damage *copy = &made[j];
+    const rfb_rect *r = &seen[copy->replaces - start].r;
+    rfb_damage *d = &fb->damage[copy->replaces % FB_DAMAGE_RING];
+    FB_AppendLocked(fb, copy);
+    // Whatever the copy doesn't cover is still plain damage:
+    if (copy->r.w == r->w)
+    {
+      rfb_rect above = { r->x, r->y, r->w, copy->r.y - r->y };
+      rfb_rect below = { r->x, copy->r.y + copy->r.h, r->w, r->y + r->h - (copy->r.y + copy->r.h) };
+      if (above.h > 0) FB_DamageLocked(fb, &above);
+      if (below.h > 0) FB_DamageLocked(fb, &below);
+    }
+    else
+    {
+      rfb_rect left = { r->x, r->y, copy->r.x - r->x, r->h };
+      rfb_rect right = { copy->r.x + copy->r.w, r->y, r->x + r->w - (copy->r.x + copy->r.w), r->h };
+      if (left.w > 0) FB_DamageLocked(fb, &left);
+      if (right.w > 0) FB_DamageLocked(fb, &right);
+    }
+    // Readers whose frame is older than the entries that explain this one
+    // still need it as it was:
+    d->replaced_by = fb->generation;
+    __atomic_store_n(&d->flags, FB_DAMAGE_REPLACED, __ATOMIC_RELEASE);
+  }
+  after = fb->generation;
+  pthread_mutex_unlock(&fb->lock);
+  for (i=start; i!=end; ++i)
+  {
+    rfb_damage *d = &seen[i - start];
+    if (!(d->flags & FB_DAMAGE_COPY))
+    {
+      for (y=0; y<d->r.h; ++y)
+      {
+        memcpy(fb->shadow + (d->r.y+y)*fb->stride + d->r.x, FB_PIXEL_PTR(frame, d->r.x, d->r.y+y), d->r.w * sizeof(U32));
+      }
+    }
+  }
+  // Copies don't change any pixels, so if nothing else was damaged after the
+  // frame, it's up to date with them too (and so is the shadow). Nobody can
+  // be refilling it while we hold it:
+  if (before == end)
+  {
+    __atomic_store_n(&((rfb_frame *)frame)->generation, after, __ATOMIC_RELEASE);
+    end = after;
+  }
+  __atomic_store_n(&fb->shadow_generation, end, __ATOMIC_RELEASE);
+  FB_ReleaseFrame(frame);
+  pthread_mutex_unlock(&fb->moves_lock);
+}
+
+
+// Publishes what's been drawn so far as the latest frame. The thread that
+// passes on producers' damage calls this once it has. It never waits for
+// readers: the frame it fills is one nobody is reading, and if they all
+// are, it makes another. Nor does it wait for queues still sending a frame
+// by reference (which a stalled client can keep forever): once there's no
+// room for another frame, one of theirs gets new pixels. There are always
+// more frames than readers (see main()), so publishing only fails if we're
+// out of memory (or a producer has broken the canvas). Producers don't wait for it either, since it copies
+// from the canvas's front buffer, which they don't draw into, without
+// holding fb->lock.
+void FB_Publish(rfb_framebuffer *fb)
+{
+  rfb_rect screen = { 0, 0, fb->width, fb->height };
+  rfb_region changed;
+  rfb_frame *frame = NULL;
+  const U32 *pixels;
+  unsigned int now, i;
+  int latest, buffer, j, y;
+  pthread_mutex_lock(&fb->publish_lock);
+  now = __atomic_load_n(&fb->generation, __ATOMIC_ACQUIRE);
+  latest = fb->latest;
+  if (fb->frames[latest].generation == now)
+  {
+    pthread_mutex_unlock(&fb->publish_lock);
+    return;
+  }
+  // Of the frames nobody's reading, the newest has the least to catch up on:
+  for (j=0; j<fb->frame_count; ++j)
+  {
+    rfb_frame *f = &fb->frames[j];
+    if (j != latest && !__atomic_load_n(&f->readers, __ATOMIC_SEQ_CST)
+      && __atomic_load_n(&f->blob->refs, __ATOMIC_ACQUIRE) == 1
+      && (!frame || (int)(f->generation - frame->generation) > 0))
+    {
+      frame = f;
+    }
+  }
+  if (!frame && (j = FB_NewFrame(fb)) >= 0)
+  {
+    frame = &fb->frames[j];
+    frame->generation = now - FB_DAMAGE_RING - 1; // It needs everything.
+  }
+  for (j=0; !frame && j<fb->frame_count; ++j)
+  {
+    rfb_frame *f = &fb->frames[j];
+    if (j != latest && !__atomic_load_n(&f->readers, __ATOMIC_SEQ_CST) && FB_RenewFrame(fb, f) == 0)
+    {
+      frame = f;
+      frame->generation = now - FB_DAMAGE_RING - 1;
+    }
+  }
+  if (!frame)
+  {
+    pthread_mutex_unlock(&fb->publish_lock);
+    return;
+  }
+  // Bring it up to date: everything drawn in all the frames it missed. New
+  // damage may lap the entries while we read them (as in
+  // FB_CollectDamage()):
+  REGION_Clear(&changed);
+  for (i=frame->generation; i!=now && now - frame->generation <= FB_DAMAGE_RING; ++i)
+  {
+    REGION_Add(&changed, &fb->damage[i % FB_DAMAGE_RING].r);
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&fb->generation, __ATOMIC_RELAXED) - frame->generation >= FB_DAMAGE_RING)
+  {
+    REGION_Clear(&changed);
+    REGION_Add(&changed, &screen);
+  }
+  buffer = SHM_AcquireFront(fb->canvas);
+  if (buffer < 0)
+  {
+    // A producer has scribbled on the canvas's header, so there's nothing
+    // to publish until one puts it right:
+    pthread_mutex_unlock(&fb->publish_lock);
+    return;
+  }
+  pixels = SHM_BUFFER(fb->canvas, buffer);
+  for (j=0; j<changed.count; ++j)
+  {
+    rfb_rect *r = &changed.rects[j];
+    for (y=0; y<r->h; ++y)
+    {
+      memcpy(FB_PIXEL_PTR(frame, r->x, r->y+y), pixels + (r->y+y)*fb->stride + r->x, r->w * sizeof(U32));
+    }
+  }
+  SHM_Release(fb->canvas, buffer);
+  frame->generation = now;
+  // Readers check 'latest' again once they hold a reference, so one that
+  // took the old latest frame just now is either seen in its count next
+  // time, or sees this and lets it go:
+  __atomic_store_n(&fb->latest, (int)(frame - fb->frames), __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&fb->publish_lock);
+}
+
+
+// Starts reading the latest frame, for encoding from. It won't change (nor
+// will its blob) until FB_ReleaseFrame().
+const rfb_frame *FB_AcquireFrame(rfb_framebuffer *fb)
+{
+  while (1)
+  {
+    int latest = __atomic_load_n(&fb->latest, __ATOMIC_SEQ_CST);
+    rfb_frame *frame = &fb->frames[latest];
+    __atomic_add_fetch(&frame->readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fb->latest, __ATOMIC_SEQ_CST) == latest)
+    {
+      return frame;
+    }
+    // Superseded (and perhaps being filled again) before we got it:
+    FB_ReleaseFrame(frame);
+  }
+}
+
+
+void FB_ReleaseFrame(const rfb_frame *frame)
+{
+  __atomic_sub_fetch(&((rfb_frame *)frame)->readers, 1, __ATOMIC_RELEASE);
+}
+
+
+// Adds everything damaged after generation 'since', up to 'until' (that of
+// the frame being sent), to 'out', and returns 'until' for the caller to
+// remember. Moves go in 'copies' if there's room and their source is
+// something the client has up to date (i.e. isn't in 'out'), and are
+// otherwise treated as plain damage. If the client can't take copies at
+// all, 'copies' is NULL.
+unsigned int FB_CollectDamage(rfb_framebuffer *fb, unsigned int since, unsigned int until, rfb_region *out, rfb_copies *copies)
+{
+  rfb_rect screen = { 0, 0, fb->width, fb->height };
+  unsigned int i;
+  if (until - since > FB_DAMAGE_RING)
+  {
+    // Fell too far behind; the ring has been overwritten:
+    REGION_Add(out, &screen);
+    return until;
+  }
+  for (i=since; i!=until; ++i)
+  {
+    rfb_damage *d = &fb->damage[i % FB_DAMAGE_RING];
+    int flags = __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE);
+    if ((flags & FB_DAMAGE_REPLACED) && (int)(until - d->replaced_by) >= 0)
+    {
+      continue;
+    }
+    // A client that had already been given the damage a copy replaces
+    // doesn't have the copy's source any more. Nor is it safe to copy from
+    // where an earlier copy went:
+    if ((flags & FB_DAMAGE_COPY) && copies && copies->count < FB_MAX_COPIES
+      && (int)(d->replaces - since) >= 0)
+    {
+      rfb_rect src = { d->src_x, d->src_y, d->r.w, d->r.h };
+      rfb_rect overlap;
+      int j;
+      for (j=0; j<copies->count && !RECT_Intersect(&copies->copies[j].r, &src, &overlap); ++j);
+      if (j == copies->count && !REGION_Intersects(out, &src))
+      {
+        copies->copies[copies->count++] = *d;
+        continue;
+      }
+    }
+    REGION_Add(out, &d->r);
+  }
+  // A writer on another thread may have lapped us while we were reading.
+  // The slot for 'since' is rewritten while the generation is 'since' plus
+  // the ring size, so that already counts. The fence keeps the entries'
+  // reads from moving after this check:
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&fb->generation, __ATOMIC_RELAXED) - since >= FB_DAMAGE_RING)
+  {
+    REGION_Add(out, &screen);
+  }
+  return until;
+}
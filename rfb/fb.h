@@ -0,0 +1,183 @@
+#ifndef FB_H
+#define FB_H
+
+#include <pthread.h>
+
+#include "rfb.h"
+#include "outbuf.h"
+#include "shm.h"
+
+// Server-side framebuffer, and the damage tracking that lets us send only
+// what changed.
+
+#define FB_DEFAULT_WIDTH   500
+#define FB_DEFAULT_HEIGHT  500
+
+// Most rectangles a region will hold before it starts merging them:
+#define REGION_MAX_RECTS   8
+
+// How many damage rectangles the framebuffer remembers. A client that falls
+// further behind than this just gets a full-screen update:
+#define FB_DAMAGE_RING     256
+
+// Native pixels are 0x00RRGGBB in host byte order:
+#define FB_RGB(zzr,zzg,zzb) ((((U32)(zzr)&0xFF)<<16) | (((U32)(zzg)&0xFF)<<8) | ((U32)(zzb)&0xFF))
+#define FB_R(zzp) (((zzp)>>16)&0xFF)
+#define FB_G(zzp) (((zzp)>>8)&0xFF)
+#define FB_B(zzp) ((zzp)&0xFF)
+
+
+// Smallest damaged area FB_DetectMoves() looks for moves in, and the fewest
+// rows (or columns) a move has to span to be worth sending as one:
+#define FB_MOVE_MIN_AREA   (64*64)
+#define FB_MOVE_MIN_LINES  8
+
+// Most moves a client can have waiting to be sent:
+#define FB_MAX_COPIES      8
+
+// FB_ScanTiles() hashes the framebuffer in square tiles, a strip (a row of
+// tiles) at a time, and reports at most this many runs of changed tiles per
+// strip (the last one soaks up the rest):
+#define FB_TILE_SIZE       32
+#define FB_TILE_LANES      4 // Independent hash lanes per tile.
+#define FB_SCAN_MAX_RUNS   4
+
+// Encoders read from snapshots of the framebuffer (frames) rather than the
+// framebuffer itself, so what they encode can't change under them. There are
+// usually this many, but more are made (up to FB_MAX_FRAMES) while readers
+// are holding on to the spare ones. Every worker thread reads at most one
+// at a time, so there can only be FB_MAX_FRAMES - 2 of those (leaving one
+// spare besides the latest):
+#define FB_FRAMES          3
+#define FB_MAX_FRAMES      16
+
+// A small set of (possibly overlapping) rectangles:
+typedef struct {
+  int count;
+  rfb_rect rects[REGION_MAX_RECTS];
+} rfb_region;
+
+
+// Damage ring entries. Most just say an area changed. FB_DetectMoves() then
+// explains what it can of those as content that moved (e.g. scrolling), by
+// flagging them as replaced and adding copy entries (plus plain damage for
+// whatever the copies don't cover). Clients can repeat a copy with CopyRect
+// instead of being sent its pixels.
+#define FB_DAMAGE_COPY      0x01 // 'r' now holds what was at (src_x, src_y).
+#define FB_DAMAGE_REPLACED  0x02 // Explained by entries that follow it.
+
+typedef struct {
+  rfb_rect r;
+  int src_x;
+  int src_y;
+  int flags;
+  unsigned int replaces; // For copies: generation of the entry they replace.
+  unsigned int replaced_by; // For replaced entries: generation of the first entry after those that explain it.
+} rfb_damage;
+
+// Copies waiting to be sent to a client, in order:
+typedef struct {
+  int count;
+  rfb_damage copies[FB_MAX_COPIES];
+} rfb_copies;
+
+
+// A snapshot of the framebuffer, as it was at 'generation'. 'readers' counts
+// the threads encoding from it. The pixels live in 'blob', which connections
+// can queue by reference; its count (besides the framebuffer's own
+// reference) says whether they still are. The frame isn't refilled until
+// they've been sent, unless there's no room for more frames: then it's
+// given a new blob, and they keep the old one (see FB_Publish()):
+typedef struct {
+  int width;
+  int height;
+  int stride;
+  U32 *pixels;
+  unsigned int generation;
+  int readers;
+  rfb_shared *blob;
+} rfb_frame;
+
+
+// Shared by all worker threads. Producers draw into 'canvas' (see shm.h),
+// a frame at a time, either in another process (-m) or through
+// FB_BeginDraw(). The damage they post is added to the ring here, under
+// 'lock', which nothing holds for more than a few appends. Readers don't
+// take it, and instead check 'generation' to tell whether the damage they
+// read was overwritten under them. They only ever see the frames published
+// from the canvas.
+typedef struct {
+  int width;
+  int height;
+  int stride; // Pixels per row.
+  rfb_shm_header *canvas;
+  int own_canvas; // Whether we created it (or were given one shared with other processes).
+  U32 *back; // What our own drawing goes into, between FB_BeginDraw() and FB_EndDraw().
+  pthread_mutex_t lock;
+  // Server threads take turns publishing frames, and looking for moves:
+  pthread_mutex_t publish_lock;
+  pthread_mutex_t moves_lock;
+  // Incremented for every damaged rectangle. Clients remember the
+  // generation they last saw, and catch up from the ring:
+  unsigned int generation;
+  rfb_damage damage[FB_DAMAGE_RING];
+  // Snapshots, and which one is the latest (see FB_Publish()):
+  rfb_frame frames[FB_MAX_FRAMES];
+  int frame_count;
+  int latest;
+  // The latest frame as it was at 'shadow_generation', for spotting moves:
+  U32 *shadow;
+  unsigned int shadow_generation;
+  U32 *scroll_row; // FB_Scroll() working space, a row long.
+  // FB_DetectMoves() working space, for up to Max(width, height) lines:
+  U64 *new_hashes;
+  U64 *old_hashes;
+  int *votes;
+  U64 *index_keys;
+  int *index_lines;
+  int index_size; // A power of 2.
+  // For writers that don't report damage, FB_ScanTiles() works it out from
+  // tile hashes. 'scan' turns that on, and the damage producers post is
+  // then ignored:
+  int scan;
+  int tiles_x;
+  int tiles_y;
+  U64 *tile_hashes;
+  U64 *tile_lanes; // Working space: tiles_x*FB_TILE_LANES per strip.
+  // Current scan: round (high 32 bits), strips claimed (next 16) and strips
+  // finished (low 16):
+  U64 scan_state;
+} rfb_framebuffer;
+
+
+int RECT_Intersect(const rfb_rect *a, const rfb_rect *b, rfb_rect *out);
+void RECT_Union(const rfb_rect *a, const rfb_rect *b, rfb_rect *out);
+int RECT_Subtract(const rfb_rect *a, const rfb_rect *b, rfb_rect out[4]);
+int RECT_Contains(const rfb_rect *outer, const rfb_rect *inner);
+
+void REGION_Clear(rfb_region *rg);
+void REGION_Add(rfb_region *rg, const rfb_rect *r);
+int REGION_IsEmpty(const rfb_region *rg);
+int REGION_Intersects(const rfb_region *rg, const rfb_rect *r);
+
+void FB_NativeFormat(pixel_format *f);
+int FB_IsNativeFormat(const pixel_format *f);
+
+int FB_Init(rfb_framebuffer *fb, int width, int height, rfb_shm_header *canvas);
+void FB_Free(rfb_framebuffer *fb);
+void FB_Damage(rfb_framebuffer *fb, int x, int y, int w, int h);
+void FB_BeginDraw(rfb_framebuffer *fb);
+void FB_FillRect(rfb_framebuffer *fb, int x, int y, int w, int h, U32 color);
+void FB_Scroll(rfb_framebuffer *fb, int dy);
+void FB_EndDraw(rfb_framebuffer *fb);
+void FB_DetectMoves(rfb_framebuffer *fb);
+void FB_ScanTiles(rfb_framebuffer *fb, unsigned int round);
+void FB_Publish(rfb_framebuffer *fb);
+const rfb_frame *FB_AcquireFrame(rfb_framebuffer *fb);
+void FB_ReleaseFrame(const rfb_frame *frame);
+unsigned int FB_CollectDamage(rfb_framebuffer *fb, unsigned int since, unsigned int until, rfb_region *out, rfb_copies *copies);
+U64 FB_HashRect(const rfb_frame *frame, const rfb_rect *r);
+
+#define FB_PIXEL_PTR(zzfb,zzx,zzy) ((zzfb)->pixels + (zzy)*(zzfb)->stride + (zzx))
+
+#endif // FB_H
@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "encode.h"
+
+// Hextile: rectangles are split into 16x16 tiles, each sent as raw pixels or
+// as a background colour with solid subrectangles on top. Background and
+// foreground colours carry over from one tile to the next (within the same
+// rectangle), so they're only sent when they change.
+
+#define HEX_TILE 16
+
+// Tile subencoding bits:
+#define HEX_RAW         0x01
+#define HEX_BACKGROUND  0x02
+#define HEX_FOREGROUND  0x04
+#define HEX_SUBRECTS    0x08
+#define HEX_COLOURED    0x10
+
+
+// Scans a tile once, giving up at the third colour. Returns how many colours
+// it has (3 meaning "3 or more"), with the most common so far in *bg and, for
+// two colours, the other one in *fg.
+static int HEX_Analyse(const U32 *src, int stride, int w, int h, U32 *bg, U32 *fg)
+{
+  U32 c0 = src[0];
+  U32 c1 = c0;
+  int n0 = 0;
+  int n1 = 0;
+  int colours = 1;
+  int x, y;
+  for (y=0; y<h; ++y, src+=stride)
+  {
+    for (x=0; x<w; ++x)
+    {
+      U32 pixel = src[x];
+      if (pixel == c0)
+      {
+        ++n0;
+      }
+      else if (pixel == c1 || !n1)
+      {
+        c1 = pixel;
+        ++n1;
+      }
+      else
+      {
+        colours = 3;
+        goto done;
+      }
+    }
+  }
+  colours = n1 ? 2 : 1;
+done:
+  *bg = (n0 >= n1) ? c0 : c1;
+  *fg = (n0 >= n1) ? c1 : c0;
+  return colours;
+}
+
+
+// Covers every non-background pixel of a tile with solid subrectangles,
+// greedily: each starts at the first uncovered pixel in scan order, runs
+// right as far as its colour does, then down while whole rows match. Writes
+// them at 'dst' and returns how many, or -1 if they'd need more than 'limit'
+// bytes (or more than the 255 a tile can have).
+static int HEX_Subrects(rfb_encstate *es, const U32 *src, int stride, int w, int h,
+  U32 bg, int coloured, U8 *dst, int limit)
+{
+  unsigned int covered[HEX_TILE] = { 0 }; // Bit per pixel, set by earlier subrects.
+  int size = coloured ? es->translator.bytes_per_pixel + 2 : 2;
+  int count = 0;
+  int x, y, x2, y2, i;
+  for (y=0; y<h; ++y)
+  {
+    const U32 *row = src + y*stride;
+    for (x=0; x<w; ++x)
+    {
+      U32 pixel = row[x];
+      unsigned int bits;
+      if (pixel == bg || (covered[y] & (1u<<x)))
+      {
+        continue;
+      }
+      for (x2=x+1; x2<w && row[x2] == pixel && !(covered[y] & (1u<<x2)); ++x2);
+      bits = (1u<<x2) - (1u<<x);
+      for (y2=y+1; y2<h && !(covered[y2] & bits); ++y2)
+      {
+        const U32 *below = src + y2*stride;
+        for (i=x; i<x2 && below[i] == pixel; ++i);
+        if (i < x2)
+        {
+          break;
+        }
+      }
+      limit -= size;
+      if (++count > 255 || limit < 0)
+      {
+        return -1;
+      }
+      for (i=y+1; i<y2; ++i)
+      {
+        covered[i] |= bits;
+      }
+      if (coloured)
+      {
+        dst += ENC_PutPixel(es, pixel, dst);
+      }
+      *dst++ = (x << 4) | y;
+      *dst++ = ((x2-x-1) << 4) | (y2-y-1);
+      x = x2-1;
+    }
+  }
+  return count;
+}
+
+
+int ENC_EncodeHextile(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_frame *frame = es->frame;
+  int bpp = es->translator.bytes_per_pixel;
+  // Most a row of tiles can take (every tile raw):
+  int row_max = ((r->w + HEX_TILE-1) / HEX_TILE) * (1 + HEX_TILE*HEX_TILE*bpp);
+  int have_bg = 0;
+  int have_fg = 0;
+  U32 last_bg = 0;
+  U32 last_fg = 0;
+  int tx, ty;
+  for (ty=0; ty<r->h; ty+=HEX_TILE)
+  {
+    int th = Min(HEX_TILE, r->h - ty);
+    U8 *start = OUT_Reserve(out, row_max);
+    U8 *p = start;
+    if (!start)
+    {
+      return -1;
+    }
+    for (tx=0; tx<r->w; tx+=HEX_TILE)
+    {
+      int tw = Min(HEX_TILE, r->w - tx);
+      const U32 *src = FB_PIXEL_PTR(frame, r->x+tx, r->y+ty);
+      U8 *mask = p++;
+      U32 bg, fg;
+      int colours = HEX_Analyse(src, frame->stride, tw, th, &bg, &fg);
+      int count;
+      *mask = 0;
+      if (!have_bg || bg != last_bg)
+      {
+        *mask |= HEX_BACKGROUND;
+        p += ENC_PutPixel(es, bg, p);
+        last_bg = bg;
+        have_bg = 1;
+      }
+      if (colours == 1)
+      {
+        continue;
+      }
+      *mask |= HEX_SUBRECTS;
+      if (colours == 2 && (!have_fg || fg != last_fg))
+      {
+        *mask |= HEX_FOREGROUND;
+        p += ENC_PutPixel(es, fg, p);
+        last_fg = fg;
+        have_fg = 1;
+      }
+      else if (colours > 2)
+      {
+        *mask |= HEX_COLOURED;
+      }
+      // Subrects are only worth it while the tile ends up smaller than raw:
+      count = HEX_Subrects(es, src, frame->stride, tw, th, bg, colours > 2, p+1,
+        tw*th*bpp - (p - mask));
+      if (count < 0)
+      {
+        p = mask;
+        *p++ = HEX_RAW;
+        PIX_TranslateRect(&es->translator, src, frame->stride, p, tw, th);
+        p += tw*th*bpp;
+        // Colours aren't carried over a raw tile:
+        have_bg = 0;
+        have_fg = 0;
+        continue;
+      }
+      *p = count;
+      p += 1 + count * ((colours > 2) ? bpp + 2 : 2);
+      if (colours > 2)
+      {
+        // ...nor is the foreground over a tile with coloured subrects:
+        have_fg = 0;
+      }
+    }
+    OUT_Unreserve(out, row_max - (p - start));
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "input.h"
+
+// The ring is a bounded queue after Dmitry Vyukov's: each slot's 'seq' says
+// whose turn it is. A slot is free for whichever producer claims position
+// 'pos' (by moving 'tail' on with a CAS) when seq == pos, and holds an event
+// for the consumer when seq == pos + 1. Taking it sets seq to the position
+// it will next be filled at, a lap later. Producers never wait on anything
+// but each other's CAS, and the consumer never waits on producers.
+
+#define INPUT_MASK (INPUT_RING_SIZE - 1)
+
+BUILD_BUG_ON(INPUT_RING_SIZE & INPUT_MASK);
+
+
+void INPUT_Init(rfb_input_ring *q)
+{
+  unsigned int i;
+  memset(q, 0, sizeof(*q));
+  for (i=0; i<INPUT_RING_SIZE; ++i)
+  {
+    q->slots[i].seq = i;
+  }
+}
+
+
+static void INPUT_Futex(int *addr, int op, int value, const struct timespec *timeout)
+{
+  syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+
+// Adds an event, waking the consumer if it's asleep. Returns -1 (and the
+// event is lost) if the ring is full.
+int INPUT_Push(rfb_input_ring *q, const rfb_input *e)
+{
+  unsigned int pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  rfb_input_slot *slot;
+  int diff;
+  while (1)
+  {
+    slot = &q->slots[pos & INPUT_MASK];
+    diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+      // 'pos' now holds where tail had got to.
+    }
+    else if (diff < 0)
+    {
+      // The consumer hasn't taken this slot's last event yet:
+      __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    else
+    {
+      // Another producer got here first:
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->event = *e;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  if (__atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST))
+  {
+    INPUT_Futex(&q->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+  }
+  return 0;
+}
+
+
+// Takes the next event, if there is one (the consumer only):
+int INPUT_Pop(rfb_input_ring *q, rfb_input *e)
+{
+  rfb_input_slot *slot = &q->slots[q->head & INPUT_MASK];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+  {
+    return 0;
+  }
+  *e = slot->event;
+  __atomic_store_n(&slot->seq, q->head + INPUT_RING_SIZE, __ATOMIC_RELEASE);
+  ++q->head;
+  return 1;
+}
+
+
+// Takes up to 'max' events. Pointer motion is coalesced: a pointer event
+// followed straight away by another from the same client, with the same
+// buttons down, is replaced by it. So however fast the pointer moves, the
+// application only ever handles where it is now, and button presses and
+// releases are never lost. Returns how many events are in 'batch'.
+int INPUT_Take(rfb_input_ring *q, rfb_input *batch, int max)
+{
+  rfb_input e;
+  rfb_input *last;
+  int count = 0;
+  while (count < max && INPUT_Pop(q, &e))
+  {
+    last = count ? &batch[count-1] : NULL;
+    if (last && e.type == INPUT_POINTER && last->type == INPUT_POINTER
+      && e.client == last->client && e.pointer.buttons == last->pointer.buttons)
+    {
+      *last = e;
+      continue;
+    }
+    batch[count++] = e;
+  }
+  return count;
+}
+
+
+// Sleeps until there are events, or 'timeout_ms' passes (the consumer only).
+void INPUT_Wait(rfb_input_ring *q, int timeout_ms)
+{
+  struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  rfb_input_slot *slot = &q->slots[q->head & INPUT_MASK];
+  __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+  // A producer that adds an event after this sees 'sleeping' set and wakes
+  // us; one that added it before, we see here:
+  if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != q->head + 1)
+  {
+    INPUT_Futex(&q->sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout);
+  }
+  __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "rfb.h"
+
+// Keyboard and pointer events, on their way from the workers that receive
+// them to the application thread that acts on them. Workers never wait for
+// the application (or each other): they add events to a lock-free ring, and
+// the application takes them off in order, waking when there are some.
+
+// Events the ring holds (a power of two). If the application falls this far
+// behind, new events are dropped rather than hold up the workers:
+#define INPUT_RING_SIZE 4096
+
+// Most events the application takes off the ring in one go:
+#define INPUT_BATCH 64
+
+enum {
+  INPUT_KEY,
+  INPUT_POINTER,
+};
+
+typedef struct {
+  int type; // INPUT_*
+  int client; // The connection (socket) it came from.
+  union {
+    struct {
+      U32 key; // X keysym.
+      int down;
+    } key;
+    struct {
+      int x;
+      int y;
+      int buttons;
+    } pointer;
+  };
+} rfb_input;
+
+typedef struct {
+  unsigned int seq; // Whose turn the slot is (see input.c).
+  rfb_input event;
+} rfb_input_slot;
+
+// Any number of producers, one consumer:
+typedef struct {
+  rfb_input_slot slots[INPUT_RING_SIZE];
+  // Producers and the consumer each have their own cache line:
+  unsigned int tail __attribute__((aligned(64))); // Next slot to fill.
+  unsigned int dropped;
+  unsigned int head __attribute__((aligned(64))); // Next slot to take.
+  int sleeping; // Futex the consumer waits on while the ring is empty.
+} rfb_input_ring;
+
+void INPUT_Init(rfb_input_ring *q);
+int INPUT_Push(rfb_input_ring *q, const rfb_input *e);
+int INPUT_Pop(rfb_input_ring *q, rfb_input *e);
+int INPUT_Take(rfb_input_ring *q, rfb_input *batch, int max);
+void INPUT_Wait(rfb_input_ring *q, int timeout_ms);
+
+#endif // INPUT_H
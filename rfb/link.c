@@ -0,0 +1,123 @@
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "link.h"
+
+// Weight of each new sample in the smoothed estimates:
+#define LINK_SMOOTHING 0.25
+
+// Bandwidth that gets JPEG quality 0; each doubling adds one (with the same
+// sort of margin as the classes):
+#define LINK_QUALITY_0_BANDWIDTH 32768
+#define LINK_QUALITY_MARGIN      0.25
+
+
+void LINK_Init(rfb_link *l)
+{
+  memset(l, 0, sizeof(*l));
+  l->link_class = LINK_UNKNOWN;
+}
+
+
+static int LINK_Classify(const rfb_link *l)
+{
+  double up = LINK_HYSTERESIS;
+  double down = 1 / LINK_HYSTERESIS;
+  int c = l->link_class;
+  if (l->bandwidth >= LINK_LOCAL_BANDWIDTH * (c >= LINK_LOCAL ? down : up)
+    && l->rtt_us <= LINK_LOCAL_RTT_US * (c >= LINK_LOCAL ? up : down))
+  {
+    return LINK_LOCAL;
+  }
+  if (l->bandwidth >= LINK_LAN_BANDWIDTH * (c >= LINK_LAN ? down : up))
+  {
+    return LINK_LAN;
+  }
+  return LINK_WAN;
+}
+
+
+static int LINK_QualityFor(const rfb_link *l)
+{
+  double steps = log2(Max(l->bandwidth, 1) / LINK_QUALITY_0_BANDWIDTH);
+  if (steps >= l->quality + 1 + LINK_QUALITY_MARGIN || steps < l->quality - LINK_QUALITY_MARGIN)
+  {
+    return Min(Max((int)steps, 0), 9);
+  }
+  return l->quality;
+}
+
+
+// Measures the link, if it's time. Throughput is what the kernel saw
+// acknowledged while it had data to send (so gaps where we had nothing to
+// send don't count against it), or its own delivery rate if that's higher.
+// While we aren't sending enough to fill the link (the usual case, with
+// small updates), both only show how much we sent, so such samples can
+// raise the estimate but never lower it.
+// Returns 1 if the link's class or quality changed.
+int LINK_Sample(rfb_link *l, int sock, long long now)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  double rate = 0;
+  int link_class, quality;
+  if (now < l->next_sample)
+  {
+    return 0;
+  }
+  l->next_sample = now + LINK_SAMPLE_MS;
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+  {
+    return 0;
+  }
+  if (l->samples && info.tcpi_busy_time > l->busy_us + 1000)
+  {
+    rate = (double)(info.tcpi_bytes_acked - l->bytes_acked) * 1000000.0 / (info.tcpi_busy_time - l->busy_us);
+  }
+  rate = Max(rate, (double)info.tcpi_delivery_rate);
+  if (info.tcpi_bytes_acked != l->bytes_acked || (!info.tcpi_unacked && !info.tcpi_notsent_bytes))
+  {
+    l->stalled_since = 0;
+  }
+  else if (!l->stalled_since)
+  {
+    l->stalled_since = now;
+  }
+  l->bytes_acked = info.tcpi_bytes_acked;
+  l->busy_us = info.tcpi_busy_time;
+  l->rtt_us = l->samples ? l->rtt_us + (info.tcpi_rtt - l->rtt_us) * LINK_SMOOTHING : info.tcpi_rtt;
+  if (rate > 0 && (!info.tcpi_delivery_rate_app_limited || rate > l->bandwidth))
+  {
+    l->bandwidth = l->bandwidth ? l->bandwidth + (rate - l->bandwidth) * LINK_SMOOTHING : rate;
+  }
+  if (++l->samples < LINK_MIN_SAMPLES || !l->bandwidth)
+  {
+    return 0;
+  }
+  link_class = LINK_Classify(l);
+  quality = LINK_QualityFor(l);
+  if (link_class == l->link_class && quality == l->quality)
+  {
+    return 0;
+  }
+  l->link_class = link_class;
+  l->quality = quality;
+  return 1;
+}
+
+
+const char *LINK_ClassName(int link_class)
+{
+  switch (link_class)
+  {
+    case LINK_WAN: return "WAN";
+    case LINK_LAN: return "LAN";
+    case LINK_LOCAL: return "local";
+  }
+  return "unknown";
+}
@@ -0,0 +1,52 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "rfb.h"
+
+// Per-connection estimates of how fast the link to the client is, from the
+// kernel's TCP_INFO. Used to pick encodings that suit it: on a fast link
+// it's cheaper to send pixels than to compress them, and on a slow one it's
+// worth spending CPU to send fewer bytes.
+
+// How often a connection's link is measured:
+#define LINK_SAMPLE_MS 250
+
+// Fewest samples before we trust the estimates:
+#define LINK_MIN_SAMPLES 4
+
+// Links are put in classes by bandwidth (bytes/s) and round-trip time. To
+// move up a class, the estimate has to clear the threshold by a margin
+// (and fall short of it by the same margin to move down), so a link that
+// sits near one doesn't flip back and forth:
+#define LINK_LOCAL_BANDWIDTH  (100*1000*1000)
+#define LINK_LOCAL_RTT_US     1000
+#define LINK_LAN_BANDWIDTH    (5*1000*1000)
+#define LINK_HYSTERESIS       1.25
+
+enum {
+  LINK_UNKNOWN,
+  LINK_WAN,
+  LINK_LAN,
+  LINK_LOCAL
+};
+
+typedef struct {
+  double bandwidth; // Bytes per second, smoothed.
+  double rtt_us; // Smoothed.
+  int samples;
+  long long next_sample; // TIME_Ms() of the next measurement.
+  // Kernel counters at the last measurement:
+  U64 bytes_acked;
+  U64 busy_us;
+  // TIME_Ms() of the first measurement that found the kernel had data for
+  // the client and none of it acknowledged since the last, or 0:
+  long long stalled_since;
+  int link_class; // LINK_*, once there are enough samples.
+  int quality; // JPEG quality (0-9) the bandwidth can take.
+} rfb_link;
+
+void LINK_Init(rfb_link *l);
+int LINK_Sample(rfb_link *l, int sock, long long now);
+const char *LINK_ClassName(int link_class);
+
+#endif // LINK_H
@@ -4,32 +4,89 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/sockios.h>
+#include <pthread.h>
+
+#include "rfb.h"
+#include "fb.h"
+#include "outbuf.h"
+#include "pixfmt.h"
+#include "encode.h"
+#include "link.h"
+#include "input.h"
+#include "cursor.h"
+#include "shm.h"
 
 #define PORT 5905
 
-#define MAXPENDING 5
+#define MAXPENDING 128
 
-#define RFB_TCP_BUFFER_INIT   1024
+// Most events we take from epoll_wait() in one go:
+#define MAX_EVENTS 64
 
-#define U8 unsigned char
-#define U16 unsigned short
-#define U32 unsigned int
-#define S32 int
+// How often workers check for clients that are due a FramebufferUpdate
+// (clients are also sent one straight away when they ask, if they're due):
+#define TICK_MS 5
 
-#define BUILD_BUG_ON(condition) extern char _BUILD_BUG_ON_ [ sizeof(char[1 - 2*!!(condition)]) ]
+// How often changes are looked for by scanning (-s):
+#define SCAN_INTERVAL_MS 20
 
-#define Default(zzsrc,zzalt) ((zzsrc) ? (zzsrc) : (zzalt))
+// Most updates per second a client gets, unless -f says otherwise:
+#define DEFAULT_FPS 60
 
-BUILD_BUG_ON(sizeof(U8) != 1);
-BUILD_BUG_ON(sizeof(U16) != 2);
-BUILD_BUG_ON(sizeof(U32) != 4);
-BUILD_BUG_ON(sizeof(S32) != 4);
+// A client with more than this still in its socket's send queue (unsent or
+// unacknowledged) is sent nothing new until it drains. Meanwhile its damage
+// just builds up, so when it does get an update it's of the latest frame:
+#define MAX_SEND_QUEUE (256*1024)
+
+// A client that hasn't taken any of what we've sent for this long is
+// dropped. Until then, whatever it has queued (possibly by reference to a
+// frame, see fb.h) stays in memory:
+#define STALL_TIMEOUT_MS 15000
+
+// With continuous updates, a client that answers fences is also sent nothing
+// new while it has more than this many updates still to process (besides
+// those the link's round trip keeps in flight):
+#define MAX_UNFENCED_UPDATES 2
+
+// Fence flags (the Request bit, and the ones we honour):
+#define FENCE_BLOCK_BEFORE  0x00000001
+#define FENCE_BLOCK_AFTER   0x00000002
+#define FENCE_SYNC_NEXT     0x00000004
+#define FENCE_REQUEST       0x80000000
+#define FENCE_SUPPORTED     (FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER | FENCE_SYNC_NEXT)
+
+// Longest Fence payload the protocol allows:
+#define FENCE_MAX_PAYLOAD 64
+
+// Receive buffer size. Input is read in chunks of up to this much, so a
+// burst of small messages (e.g. pointer events) takes one recv():
+#define RFB_RECV_BUFFER  (16*1024)
+
+// Longest ClientCutText we'll take (it has to fit in the receive buffer,
+// which grows to hold it). A client that says it's sending more is dropped:
+#define RFB_MAX_CUT_TEXT  (1024*1024)
+
+// Closed connections each worker keeps, buffers and all, for new clients to
+// reuse:
+#define RFB_SPARE_CONNS  16
+
+// X keysyms we act on:
+#define XK_Up    0xFF52
+#define XK_Down  0xFF54
 
 enum {
   RFB_SEC_INVALID = 0,
@@ -38,62 +95,113 @@ enum {
 };
 
 
-// This is used to tell GCC that we want our structs packed exactly
-// as stated with no automatic padding/alignment:
-#define PACKED __attribute__((packed))
+// Where each connection is up to in the protocol:
+enum {
+  STATE_VERSION,        // Waiting for the client's version string.
+  STATE_CLIENTINIT,     // Waiting for ClientInit.
+  STATE_READY,          // Waiting for a command byte.
+  STATE_COMMAND,        // Waiting for the command's fixed-size body.
+  STATE_COMMAND_EXTRA,  // Waiting for variable-length data after the body.
+};
 
-#define B0(zzs) ((zzs)&0xFFL)
-#define B1(zzs) ((zzs>>8)&0xFFL)
-#define B2(zzs) ((zzs>>16)&0xFFL)
-#define B3(zzs) ((zzs>>24)&0xFFL)
 
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define RFB8(zzs) (zzs)
-#define RFB16(zzs) ((B0(zzs)<<8) | (B1(zzs)))
-#define RFB32(zzs) ((B0(zzs)<<24) | (B1(zzs)<<16) | (B2(zzs)<<8) | (B3(zzs)))
-#else
-#define RFB8(zzs) (zzs)
-#define RFB16(zzs) ((zzs)&0xFFFFL)
-#define RFB32(zzs) ((zzs)&0xFFFFFFFFL)
-#endif
-#define RFB16P(zza) RFB16(*(U16*)(zza))
-#define RFB32P(zza) RFB32(*(U32*)(zza))
+// Shared by all workers:
+static rfb_framebuffer gFramebuffer;
 
-static volatile int gServerSocket = -1; // Volatile because CTRL+C (SIGINT) handler can mess with it.
+// Input events, from the workers to the application thread:
+static rfb_input_ring gInput;
 
+// The pointer, as the application last saw it:
+static rfb_cursor gCursor;
 
-typedef struct {
-  U8 bpp;
-  U8 depth;
-  U8 big_endian;
-  U8 true_colour;
-  U8 r_max[2];
-  U8 g_max[2];
-  U8 b_max[2];
-  U8 r_shift;
-  U8 g_shift;
-  U8 b_shift;
-  U8 _padding[3];
-} PACKED pixel_format;
+// The framebuffer's canvas, shared with other processes (-m), and its name:
+static rfb_shm_header *gShm = NULL;
+static const char *gShmName = NULL;
 
 
-typedef struct {
+struct rfb_worker;
+
+typedef struct rfb_conn {
+  struct rfb_worker *worker; // The thread that owns this connection.
   int sock;
+  int state;
+  int again; // Set when a read stopped because no more data is available yet.
+  int command; // Command being parsed (STATE_COMMAND, STATE_COMMAND_EXTRA).
+  int extra; // Variable-length bytes following the command (STATE_COMMAND_EXTRA).
+  rfb_outbuf out; // Everything we've yet to send.
+  rfb_encstate enc; // Pixel format and encodings the client wants.
+  // Input received but not yet parsed: 'len' bytes at 'offset':
   char *buffer;
   int size;
   int len;
   int offset;
+  int drained; // Set when a read came up short: the socket has nothing more.
   pixel_format format;
-  struct {
-    int x;
-    int y;
-    int buttons;
-  } cursor;
+  // Pointer motion read but not yet passed on, and the buttons of the last
+  // pointer event that was:
+  rfb_input motion;
+  int moved;
+  int buttons;
+  // Outstanding FramebufferUpdateRequests ('refresh' of them, merged into
+  // one area, and incremental only if they all were):
   int refresh;
+  rfb_rect request;
+  int incremental;
+  // Earliest time (TIME_Ms()) the next update can go, and how far apart
+  // they have to be:
+  long long next_frame;
+  int frame_ms;
+  rfb_link link; // How fast the link to the client is, for picking encodings.
+  // Continuous updates: while enabled, the area is updated whenever it
+  // changes, as if there were always an incremental request for it:
+  int continuous;
+  rfb_rect continuous_area;
+  int announced; // ENC_FLAG_CONTINUOUS/FENCE, once we've told the client we have them.
+  // Fences we've sent (numbered, in their payloads), and the last one the
+  // client answered; 'fenced' is set once it has answered one:
+  unsigned int fences_sent;
+  unsigned int fences_answered;
+  int fenced;
+  U32 fence_flags; // Of a Fence whose payload we're waiting for.
+  // What has changed since we last sent an update:
+  rfb_region damage;
+  rfb_copies copies; // Moves to send as CopyRect, if the client takes them.
+  // The cursor. Clients that draw it themselves need its shape (once), and
+  // where it is when someone else moves it; for the rest, it's composited
+  // into what they're sent. So we remember where it was last put:
+  int cursor_sent;
+  U64 cursor_pos;
+  rfb_rect cursor_drawn;
+  unsigned int fb_generation;
+  // Each worker keeps its clients in a list, so it can visit them for updates:
+  struct rfb_conn *next;
+  struct rfb_conn *prev;
 } rfb_conn;
 
 
-BUILD_BUG_ON(sizeof(pixel_format) != 16);
+// Each worker thread has its own listening socket (all bound to PORT with
+// SO_REUSEPORT, so the kernel spreads new connections between them) and its
+// own epoll set. Workers share nothing but the framebuffer.
+typedef struct rfb_worker {
+  int id;
+  pthread_t thread;
+  volatile int server_socket; // Volatile because CTRL+C (SIGINT) handler can mess with it.
+  int epfd;
+  rfb_conn *clients;
+  int client_count;
+  rfb_arena arena; // Scratch space for encoding, reset after every update.
+  rfb_outbuf staging; // Where rectangles shared between clients are encoded.
+  rfb_sharedpool pool; // For what's encoded there.
+  rfb_enchelper helper; // For its share of updates encoded in parallel.
+  rfb_conn *spare; // Closed connections to reuse (linked by 'next').
+  int spare_count;
+} rfb_worker;
+
+
+static rfb_worker *gWorkers = NULL;
+static int gWorkerCount = 0;
+static int gFrameMs = 1000 / DEFAULT_FPS;
+static int gAdapt = 1; // Pick encodings to suit each client's link (-A turns it off).
 
 
 typedef struct {
@@ -165,6 +273,26 @@ typedef struct {
   char text[0]; // 'len' bytes.
 } PACKED ClientCutText_t;
 
+typedef struct {
+  U8 enable;
+  U16 x;
+  U16 y;
+  U16 w;
+  U16 h;
+} PACKED EnableContinuousUpdates_t;
+
+BUILD_BUG_ON(sizeof(EnableContinuousUpdates_t) != 9);
+
+// Variable length:
+typedef struct {
+  U8 _padding[3];
+  U32 flags;
+  U8 len;
+  U8 payload[0]; // 'len' bytes.
+} PACKED Fence_t;
+
+BUILD_BUG_ON(sizeof(Fence_t) != 8);
+
 
 typedef struct {
   U8 width[2];
@@ -175,151 +303,133 @@ typedef struct {
 } PACKED server_init;
 
 
-int Send(int sock, char *data, int len, int flags)
-{
-  int i;
-  #ifdef DEBUG
-  for (i=0; i<len; ++i) { printf("%02X ",(unsigned char)data[i]); }
-  printf("\n");
-  #endif // DEBUG
-  return send(sock, data, len, flags);
-}
-
-
-int SOCK_printf(int sock, const char *fmt, ...)
-{
-  va_list ap;
-  int size = 0;
-  char *pstr = NULL;
-  // Determine required size:
-  va_start(ap, fmt);
-  size = vsnprintf(pstr, size, fmt, ap);
-  va_end(ap);
-  if (size < 0) { return size; }
-  // Allocate buffer for string:
-  ++size; // For trailing NUL.
-  pstr = malloc(size);
-  if (!pstr) { return -1; }
-  // Generate final string:
-  va_start(ap, fmt);
-  size = vsnprintf(pstr, size, fmt, ap);
-  if (size >= 0)
-  {
-    // Send the string, if all is OK:
-    size = Send(sock, pstr, size, 0);
-  }
-  free(pstr);
-  return size;
-}
-
-
-int SOCK_SendU8(int sock, unsigned int value)
-{
-  unsigned char buffer[1];
-  buffer[0] = value & 0xFFL;
-  return Send(sock, (char*)buffer, sizeof(buffer), 0);
-}
-
-
-int SOCK_SendU16(int sock, unsigned int value)
-{
-  unsigned char buffer[2];
-  buffer[1] = value & 0xFFL; value >>= 8;
-  buffer[0] = value & 0xFFL;
-  return Send(sock, (char*)buffer, sizeof(buffer), 0);
-}
-
-
-int SOCK_SendU32(int sock, unsigned int value)
-{
-  unsigned char buffer[4];
-  buffer[3] = value & 0xFFL; value >>= 8;
-  buffer[2] = value & 0xFFL; value >>= 8;
-  buffer[1] = value & 0xFFL; value >>= 8;
-  buffer[0] = value & 0xFFL;
-  return Send(sock, (char*)buffer, sizeof(buffer), 0);
-}
-
-
+// Starts a new client on 'pconn'. Its receive buffer and output queue are
+// reused if it had them already (see RFB_RemoveClient()).
 int RFB_OpenClient(int sock, rfb_conn *pconn)
 {
+  const rfb_frame *frame;
+  char *buffer = pconn->buffer;
+  int size = pconn->size;
+  rfb_outbuf out = pconn->out;
   memset(pconn, 0, sizeof(rfb_conn));
+  pconn->state = STATE_VERSION;
   pconn->len = 0;
   pconn->offset = 0;
   pconn->sock = sock;
-  pconn->size = RFB_TCP_BUFFER_INIT;
-  pconn->buffer = malloc(pconn->size);
+  frame = FB_AcquireFrame(&gFramebuffer);
+  pconn->fb_generation = __atomic_load_n(&frame->generation, __ATOMIC_ACQUIRE);
+  FB_ReleaseFrame(frame);
+  pconn->frame_ms = gFrameMs;
+  LINK_Init(&pconn->link);
+  pconn->buffer = buffer;
+  pconn->size = size;
+  pconn->out = out;
   if (!pconn->buffer)
   {
+    pconn->size = RFB_RECV_BUFFER;
+    pconn->buffer = malloc(pconn->size);
+    if (!pconn->buffer)
+    {
+      return -1;
+    }
+  }
+  if (!pconn->out.data && OUT_Init(&pconn->out) < 0)
+  {
+    free(pconn->buffer);
+    pconn->buffer = NULL;
     return -1;
   }
   // Send protocol version:
-  SOCK_printf(sock, "RFB 003.003\n");
+  OUT_printf(&pconn->out, "RFB 003.003\n");
   return 0;
 }
 
 
+// Closes the connection, but keeps its buffers in case it's reused (a
+// receive buffer that had to grow goes back to the usual size).
 void RFB_CloseClient(rfb_conn *pc)
 {
   close(pc->sock);
-  if (pc->buffer)
+  if (pc->size > RFB_RECV_BUFFER)
   {
     free(pc->buffer);
     pc->buffer = NULL;
+    pc->size = 0;
   }
-  pc->size = 0;
+  OUT_Reset(&pc->out);
+  ENC_Free(&pc->enc);
   pc->len = 0;
   pc->offset = 0;
 }
 
 
-// 'size' specifies how many new bytes we need available in our buffer.
-int RFB_Realloc(rfb_conn *pc, int size)
+// Frees what a closed connection kept.
+void RFB_FreeClient(rfb_conn *pc)
+{
+  free(pc->buffer);
+  OUT_Free(&pc->out);
+  free(pc);
+}
+
+
+// Makes room in the receive buffer for 'bytes' of input, counting what's
+// already buffered. What's been parsed is dropped (by moving what's left to
+// the front) only when that's needed, and the buffer only grows for input
+// that wouldn't fit even then.
+int RFB_Reserve(rfb_conn *pc, int bytes)
 {
-  char *new_buffer = NULL;
-  int tail = pc->offset + pc->len;
-  int new_buffer_size;
-  if (tail + size > pc->size)
+  char *new_buffer;
+  if (pc->offset + bytes <= pc->size)
+  {
+    return 0;
+  }
+  if (pc->offset)
+  {
+    memmove(pc->buffer, pc->buffer + pc->offset, pc->len);
+    pc->offset = 0;
+  }
+  if (bytes > pc->size)
   {
-    new_buffer_size = pc->len + size;
-    new_buffer = malloc(new_buffer_size);
+    new_buffer = realloc(pc->buffer, bytes);
     if (!new_buffer)
     {
       return -1;
     }
-    memcpy(new_buffer, pc->buffer+pc->offset, new_buffer_size);
-    free(pc->buffer);
     pc->buffer = new_buffer;
-    pc->size = new_buffer_size;
-    pc->offset = 0;
-  }
-  return 0;
-}
-
-
-// 'size' specifies how many buffered bytes we expect:
-int RFB_Expecting(rfb_conn *pc, int size)
-{
-  int overflow = (pc->offset + size) - pc->size;
-  if (overflow > 0)
-  {
-    return RFB_Realloc(pc, overflow);
+    pc->size = bytes;
   }
   return 0;
 }
 
 
+// Returns the next 'bytes' of input once they have all arrived, or NULL.
+// Input is read as it comes, as much as the buffer has room for in each
+// recv(), so most messages are already buffered (complete) by the time
+// they're parsed, and parsed in place. The socket is non-blocking: if the
+// data isn't all here yet, pc->again is set and what did arrive is kept, so
+// calling again later with the same 'bytes' picks up where this left off.
+// Otherwise NULL means the connection is gone.
 char *RFB_WaitFor(rfb_conn *pc, int bytes)
 {
-  if (RFB_Expecting(pc, bytes) < 0)
-  {
-    return NULL;
-  }
-  int underrun;
   int incoming;
-  while ( (underrun = bytes - pc->len) > 0)
+  int room;
+  char *out;
+  pc->again = 0;
+  while (pc->len < bytes)
   {
-    incoming = recv(pc->sock, (void*)(pc->buffer+pc->offset+pc->len), underrun, 0);
+    if (pc->drained)
+    {
+      // The last read came up short, so there's nothing more until epoll
+      // says so:
+      pc->again = 1;
+      return NULL;
+    }
+    if (RFB_Reserve(pc, bytes) < 0)
+    {
+      return NULL;
+    }
+    room = pc->size - (pc->offset + pc->len);
+    incoming = recv(pc->sock, (void*)(pc->buffer+pc->offset+pc->len), room, 0);
     if (!incoming)
     {
       printf("Client closed the connection.\n");
@@ -327,21 +437,32 @@ char *RFB_WaitFor(rfb_conn *pc, int bytes)
     }
     if (incoming < 0)
     {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        // Nothing more for now:
+        pc->again = 1;
+        return NULL;
+      }
       // Failed:
       printf("Failed\n");
       return NULL;
     }
-    if (incoming > underrun)
-    {
-      // OK, but more bytes available than what we're waiting for:
-      incoming = underrun;
-    }
     pc->len += incoming;
+    pc->drained = (incoming < room);
   }
   // OK:
-  char *out = pc->buffer + pc->offset;
+  out = pc->buffer + pc->offset;
   pc->offset += bytes;
   pc->len -= bytes;
+  if (!pc->len)
+  {
+    // Empty, so the next read can start at the front for free:
+    pc->offset = 0;
+  }
   return out;
 }
 
@@ -356,7 +477,7 @@ int RFB_WaitForU8(rfb_conn *pc, unsigned int *value)
   {
     return -1;
   }
-  *value = (unsigned int)data[0];
+  *value = (unsigned int)(U8)data[0];
   return 0;
 }
 
@@ -366,8 +487,8 @@ int RFB_ServerInit(rfb_conn *pc, int width, int height, char *name)
   server_init *si;
   int name_length = strlen(name);
   int server_init_data_length = sizeof(server_init) + name_length;
-  // Allocate extra bytes for server name:
-  si = (server_init*)malloc(server_init_data_length);
+  // Build it straight into the output queue, with extra bytes for server name:
+  si = (server_init*)OUT_Reserve(&pc->out, server_init_data_length);
   if (!si)
   {
     return -1;
@@ -381,139 +502,241 @@ int RFB_ServerInit(rfb_conn *pc, int width, int height, char *name)
   si->name_length[2] = name_length & 0xFFL; name_length >>= 8;
   si->name_length[1] = name_length & 0xFFL; name_length >>= 8;
   si->name_length[0] = name_length & 0xFFL;
-  si->format.bpp = 32;
-  si->format.depth = 24;
-  si->format.big_endian = 1;
-  si->format.true_colour = 1;
-  si->format.r_max[1] = 255;
-  si->format.r_max[0] = 0;
-  si->format.g_max[1] = 255;
-  si->format.g_max[0] = 0;
-  si->format.b_max[1] = 255;
-  si->format.b_max[0] = 0;
-  si->format.r_shift = 16;
-  si->format.g_shift = 8;
-  si->format.b_shift = 0;
+  FB_NativeFormat(&si->format);
   memcpy(&pc->format, &si->format, sizeof(pc->format));
+  ENC_SetPixelFormat(&pc->enc, &pc->format);
   DUMP_PIXEL_FORMAT(&pc->format);
-  return Send(pc->sock, (char*)si, server_init_data_length, 0);
+  return 0;
 }
 
 
-#define S1(zza) SOCK_SendU8(s, (zza))
-#define S2(zza) SOCK_SendU16(s, (zza))
-#define S4(zza) SOCK_SendU32(s, (zza))
-// SMELL: Handle endianness change for 16 and 32 bit:
-#define SCOLOR(f,c) ((f)->bpp==32) ? S4(c) : ((f)->bpp==16) ? S2(c) : S1(c)
+// What an update needs to send for the cursor, besides pixels:
+#define CURSOR_NEEDS_SHAPE  0x01
+#define CURSOR_NEEDS_POS    0x02
 
-#define RGB_FORMAT(f,r,g,b) \
- (((((r) * (1+RFB16P((f)->r_max))) >> 8) << (f)->r_shift) \
-| ((((g) * (1+RFB16P((f)->g_max))) >> 8) << (f)->g_shift) \
-| ((((b) * (1+RFB16P((f)->b_max))) >> 8) << (f)->b_shift))
+// Works out what the client's next update needs for the cursor at 'pos'.
+// Clients that draw it themselves need its shape if they haven't had it,
+// and its position if someone else moved it. For the rest, 'cursor' gets
+// where to composite it (clipped to the screen), and whenever it moves (or
+// copies may have moved what was under it), where it was drawn last time
+// becomes damage, along with where it is now. Returns CURSOR_NEEDS_*.
+int RFB_CursorNeeds(rfb_conn *pc, U64 pos, int copies, rfb_rect *cursor)
+{
+  rfb_rect screen = { 0, 0, gFramebuffer.width, gFramebuffer.height };
+  rfb_rect *drawn = &pc->cursor_drawn;
+  int needs = 0;
+  int i;
+  if (pc->enc.flags & ENC_FLAG_CURSOR)
+  {
+    // Take down any we composited before it said it could draw its own:
+    REGION_Add(&pc->damage, drawn);
+    memset(drawn, 0, sizeof(*drawn));
+    memset(cursor, 0, sizeof(*cursor));
+    needs |= pc->cursor_sent ? 0 : CURSOR_NEEDS_SHAPE;
+  }
+  else
+  {
+    CURSOR_Bounds(&gCursor, pos, cursor);
+    if (!RECT_Intersect(cursor, &screen, cursor))
+    {
+      memset(cursor, 0, sizeof(*cursor));
+    }
+    if (copies || memcmp(cursor, drawn, sizeof(*cursor)))
+    {
+      REGION_Add(&pc->damage, drawn);
+      REGION_Add(&pc->damage, cursor);
+      // Copies go first, and may take what was drawn with them:
+      for (i=0; i<copies; ++i)
+      {
+        rfb_damage *c = &pc->copies.copies[i];
+        rfb_rect moved = { drawn->x + c->r.x - c->src_x, drawn->y + c->r.y - c->src_y, drawn->w, drawn->h };
+        if (RECT_Intersect(&moved, &c->r, &moved))
+        {
+          REGION_Add(&pc->damage, &moved);
+        }
+      }
+      *drawn = *cursor;
+    }
+  }
+  if ((pc->enc.flags & ENC_FLAG_POINTERPOS) && ((pos ^ pc->cursor_pos) >> 32))
+  {
+    if (CURSOR_MOVER(pos) == pc->sock)
+    {
+      // It knows; it put it there.
+      pc->cursor_pos = pos;
+    }
+    else
+    {
+      needs |= CURSOR_NEEDS_POS;
+    }
+  }
+  return needs;
+}
 
 
-int RFB_FramebufferUpdate(rfb_conn *pc)
+// Queues whatever part of the client's outstanding request (and its
+// continuous updates area, if enabled) has been damaged, in whichever
+// encodings suit each rectangle. If it's an incremental request and nothing
+// in it has changed, the request stays pending and nothing is queued. The
+// whole update goes out in one flush, unless it's encoded in parallel, in
+// which case its pieces start going as soon as they're ready. Returns 1 if
+// an update was queued, 0 if not, or -1 on error.
+int RFB_QueueUpdate(rfb_conn *pc, const rfb_frame *frame)
 {
-  U32 color;
-  int s = pc->sock;
-  static int step = 10;
-  fflush(stdout);
-  unsigned char raw[] = {
-    0,
-    0,
-    0,1,
-    pc->cursor.x >> 8, pc->cursor.x & 255,
-    pc->cursor.y >> 8, pc->cursor.y & 255,
-    0,20,
-    0,20,
-    0,0,0,2,
-    0,0,0,0,
-    0,0,0,0,
-  };
-  int r,g,b;
-  r = random() & 255; //0x33;
-  g = random() & 255; //0x66;
-  b = random() & 255; //0x99;
-  color = RGB_FORMAT(&(pc->format), r, g, b);
-  *(raw+sizeof(raw)-4) = color;
-  int size = sizeof(raw) - ((pc->format.bpp==32) ? 0 : (pc->format.bpp==16) ? 2 : 3);
-  return Send(s, (char*)raw, size, 0);
-
-
-  // // printf("(RFB_FramebufferUpdate)\n");
-  // S1(0); // message-type (FramebufferUpdate).
-  // S1(0); // padding.
-  // S2(1); // 1 rectangle.
-  // // Rectangle:
-  // S2(pc->cursor.x); // x
-  // S2(pc->cursor.y); // y
-  // S2(30); // width
-  // S2(40); // height
-  // S4(2); // RRE encoding.
-  // // RRE:
-  // S4(0); // Zero subrectangle(s).
-  // color = 0;
-  // int r,g,b;
-  // r = 0x33;
-  // g = 0x66;
-  // b = 0x99;
-  // color = RGB_FORMAT(&(pc->format), r, g, b);
-  // SCOLOR(&(pc->format), color); // Background.
-
-  // S4(0x00808182); // Background.
-  // // Subrectangle:
-  // S4(0x00838485); // Colour.
-  // S2(5); // x
-  // S2(6); // y
-  // S2(7); // width
-  // S2(8); // height
-
-  // static int step = 0;
-  // unsigned char raw[] = {
-  //   0,
-  //   0,
-  //   0,1,
-  //   0,10+step,
-  //   0,20+step,
-  //   0,30+step,
-  //   0,40+step,
-  //   0,0,0,2,
-  //   0,0,0,1,
-  //   0xFF,0xBB,0x66,0, // BGR0
-  //   0x33,0x55,0x77,0, // BGR0
-  //   0,5,
-  //   0,6,
-  //   0,7,
-  //   0,8,
-  // };
-  // ++step;
-  // return Send(s, (char*)raw, sizeof(raw), 0);
-  // SOCK_SendU8(s, 0); // message-type (FramebufferUpdate).
-  // SOCK_SendU8(s, 0); // padding.
-  // S2(s, 1); // 1 rectangle.
-  // // Rectangle:
-  // S2(s, 10); // x
-  // S2(s, 20); // y
-  // S2(s, 30); // width
-  // S2(s, step++); // height
-  // S4(s, 2); // RRE encoding.
-  // // RRE:
-  // S4(s, 1); // Zero subrectangle(s).
-  // S4(s, 0x00808182); // Background.
-  // // Subrectangle:
-  // S4(s, 0x00838485); // Colour.
-  // S2(s, 5); // x
-  // S2(s, 6); // y
-  // S2(s, 7); // width
-  // S2(s, 8); // height
-  return -1;
+  rfb_framebuffer *fb = &gFramebuffer;
+  rfb_rect send[REGION_MAX_RECTS*4];
+  rfb_rect screen = { 0, 0, fb->width, fb->height };
+  rfb_rect request, part;
+  rfb_rect cursor; // Where the cursor is composited, if it is.
+  rfb_rect composited[REGION_MAX_RECTS];
+  U32 pixels[CURSOR_MAX_WIDTH*CURSOR_MAX_HEIGHT];
+  U64 pos = CURSOR_Position(&gCursor);
+  rfb_region keep;
+  int count = 0;
+  int composites = 0;
+  int rects = 0;
+  int copies = 0;
+  int needs, pseudo;
+  int i;
+  U8 *p;
+  if (pc->refresh && pc->continuous)
+  {
+    RECT_Union(&pc->request, &pc->continuous_area, &request);
+  }
+  else if (pc->refresh)
+  {
+    request = pc->request;
+  }
+  else if (pc->continuous)
+  {
+    request = pc->continuous_area;
+  }
+  else
+  {
+    return 0;
+  }
+  pc->fb_generation = FB_CollectDamage(fb, pc->fb_generation,
+    __atomic_load_n(&frame->generation, __ATOMIC_ACQUIRE), &pc->damage,
+    (pc->enc.flags & ENC_FLAG_COPYRECT) ? &pc->copies : NULL);
+  // Copies go first, so they only work if everything they land on is in
+  // the request. Otherwise they're just damage:
+  for (i=0; i<pc->copies.count; ++i)
+  {
+    rfb_damage *c = &pc->copies.copies[i];
+    rfb_rect src = { c->src_x, c->src_y, c->r.w, c->r.h };
+    if (RECT_Contains(&request, &c->r) && RECT_Contains(&screen, &src) && RECT_Contains(&screen, &c->r))
+    {
+      pc->copies.copies[copies++] = *c;
+    }
+    else
+    {
+      REGION_Add(&pc->damage, &c->r);
+    }
+  }
+  pc->copies.count = copies;
+  needs = RFB_CursorNeeds(pc, pos, copies, &cursor);
+  pseudo = !!(needs & CURSOR_NEEDS_SHAPE) + !!(needs & CURSOR_NEEDS_POS);
+  // Send the damage that lies in the requested area. Anything that sticks
+  // out of it is kept (whole) for a later request. Whatever the cursor
+  // covers is composited (and sent as it is), apart from the rest:
+  REGION_Clear(&keep);
+  for (i=0; i<pc->damage.count; ++i)
+  {
+    rfb_rect *d = &pc->damage.rects[i];
+    if (RECT_Intersect(d, &request, &part))
+    {
+      if (cursor.w && RECT_Intersect(&part, &cursor, &composited[composites]))
+      {
+        ++composites;
+        count += RECT_Subtract(&part, &cursor, &send[count]);
+      }
+      else
+      {
+        send[count++] = part;
+      }
+    }
+    if (!RECT_Contains(&request, d))
+    {
+      REGION_Add(&keep, d);
+    }
+  }
+  if (!count && !copies && !composites && !pseudo)
+  {
+    return 0;
+  }
+  pc->damage = keep;
+  p = OUT_Reserve(&pc->out, 4);
+  if (!p)
+  {
+    return -1;
+  }
+  *p++ = 0; // message-type (FramebufferUpdate).
+  *p++ = 0; // padding.
+  // Big updates are split up differently to be encoded in parallel:
+  pc->enc.parallel = ENC_Parallel(&pc->enc, send, count);
+  for (i=0; i<count; ++i)
+  {
+    rects += ENC_RectCount(&pc->enc, &send[i]);
+  }
+  rects += copies + composites + pseudo;
+  PUT16(p, rects);
+  // Clients that collected the same damage can share what it encodes to:
+  pc->enc.generation = pc->fb_generation;
+  for (i=0; i<copies; ++i)
+  {
+    if (ENC_QueueCopy(&pc->out, &pc->copies.copies[i]) < 0)
+    {
+      return -1;
+    }
+  }
+  pc->copies.count = 0;
+  if (ENC_EncodeRects(&pc->enc, &pc->out, send, count, pc->sock) < 0)
+  {
+    return -1;
+  }
+  for (i=0; i<composites; ++i)
+  {
+    CURSOR_Composite(&gCursor, pos, frame, &composited[i], pixels);
+    if (ENC_QueuePixels(&pc->enc, &pc->out, &composited[i], pixels) < 0)
+    {
+      return -1;
+    }
+  }
+  if (needs & CURSOR_NEEDS_SHAPE)
+  {
+    rfb_rect shape = { gCursor.hot_x, gCursor.hot_y, gCursor.width, gCursor.height };
+    if (ENC_QueueCursor(&pc->enc, &pc->out, &shape, gCursor.pixels, gCursor.mask) < 0)
+    {
+      return -1;
+    }
+    pc->cursor_sent = 1;
+  }
+  if (needs & CURSOR_NEEDS_POS)
+  {
+    if (ENC_QueuePointerPos(&pc->out, CURSOR_X(pos), CURSOR_Y(pos)) < 0)
+    {
+      return -1;
+    }
+    pc->cursor_pos = pos;
+  }
+  pc->refresh = 0;
+  return 1;
 }
 
 
-enum {
-  STATE_HANDSHAKE,
-  STATE_READY,
-};
+// Queues an update from the latest frame, which can't change while it's
+// being encoded.
+int RFB_FramebufferUpdate(rfb_conn *pc)
+{
+  const rfb_frame *frame = FB_AcquireFrame(&gFramebuffer);
+  int result;
+  pc->enc.frame = frame;
+  result = RFB_QueueUpdate(pc, frame);
+  pc->enc.frame = NULL;
+  FB_ReleaseFrame(frame);
+  ARENA_Reset(&pc->worker->arena);
+  return result;
+}
 
 
 enum {
@@ -523,9 +746,99 @@ enum {
   kKeyEvent = 4,
   kPointerEvent = 5,
   kClientCutText = 6,
+  kEnableContinuousUpdates = 150,
+  kFence = 248,
+};
+
+// Server messages besides FramebufferUpdate:
+enum {
+  kEndOfContinuousUpdates = 150,
+  kServerFence = 248,
 };
 
 
+int RFB_Fence(rfb_conn *pc, U32 flags, const U8 *payload, int len)
+{
+  U8 *p = OUT_Reserve(&pc->out, 9 + len);
+  if (!p)
+  {
+    return -1;
+  }
+  *p++ = kServerFence;
+  *p++ = 0; // padding.
+  *p++ = 0;
+  *p++ = 0;
+  PUT32(p, flags);
+  *p++ = len;
+  memcpy(p, payload, len);
+  return 0;
+}
+
+
+// Asks the client to answer a fence once it has dealt with everything
+// before it. Each carries its number, so we know how far behind it is:
+int RFB_RequestFence(rfb_conn *pc)
+{
+  U8 payload[4];
+  U8 *p = payload;
+  unsigned int number = ++pc->fences_sent;
+  PUT32(p, number);
+  return RFB_Fence(pc, FENCE_REQUEST, payload, sizeof(payload));
+}
+
+
+// Updates a client with continuous updates has been sent but not yet
+// processed (if it answers fences, so we can tell):
+int RFB_UnfencedUpdates(const rfb_conn *pc)
+{
+  return pc->fenced ? (int)(pc->fences_sent - pc->fences_answered) : 0;
+}
+
+
+// Once a client says it supports continuous updates or fences, we say we do
+// too: with an EndOfContinuousUpdates, or a fence of our own.
+int RFB_Announce(rfb_conn *pc)
+{
+  int fresh = pc->enc.flags & ~pc->announced;
+  if (fresh & ENC_FLAG_CONTINUOUS)
+  {
+    if (OUT_U8(&pc->out, kEndOfContinuousUpdates) < 0)
+    {
+      return -1;
+    }
+    pc->announced |= ENC_FLAG_CONTINUOUS;
+  }
+  if (fresh & ENC_FLAG_FENCE)
+  {
+    if (RFB_RequestFence(pc) < 0)
+    {
+      return -1;
+    }
+    pc->announced |= ENC_FLAG_FENCE;
+  }
+  return 0;
+}
+
+
+// A fence the client asked for is answered straight away, with its payload
+// and whichever of its flags we honour. We handle messages in order and
+// queue our replies in order, so they all hold already. A client's answer
+// to one of ours says it's done with the updates before it.
+int RFB_HandleFence(rfb_conn *pc, U32 flags, const U8 *payload, int len)
+{
+  if (flags & FENCE_REQUEST)
+  {
+    return RFB_Fence(pc, flags & FENCE_SUPPORTED, payload, len);
+  }
+  if (len == 4)
+  {
+    pc->fences_answered = RFB32P(payload);
+    pc->fenced = 1;
+  }
+  return 0;
+}
+
+
 #define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
 #define BYTE_TO_BINARY(byte)  \
   (byte & 0x80 ? '1' : '0'), \
@@ -539,15 +852,7 @@ enum {
 
 int nprint(char *prefix, char *str, int len, char *suffix)
 {
-  char *buffer = calloc(len+1, 0);
-  if (!buffer)
-  {
-    return -1;
-  }
-  memcpy(buffer, str, len);
-  int result = printf("%s%s%s", Default(prefix,""), buffer, Default(suffix,""));
-  free(buffer);
-  return result;
+  return printf("%s%.*s%s", Default(prefix,""), len, str, Default(suffix,""));
 }
 
 
@@ -584,35 +889,50 @@ void DEBUG_HexDump(char *data, int len, char *heading)
 #define CASE_PRINT(zzconst) case zzconst: { printf("%s", (#zzconst)); break; }
 
 
+// Steps through the handshake as its data arrives: version string, then
+// ClientInit (share flag). Returns -1 if we can't go further yet (check
+// pc->again) or the client failed the handshake.
 int RFB_Handshake(rfb_conn *pc)
 {
-  pixel_format current_format = {0};
   char *client_ver;
   unsigned int value;
-  client_ver = RFB_WaitFor(pc, 12);
-  if (!client_ver)
-  {
-    printf("Didn't get client version string\n");
-    return -1;
-  }
-  nprint("Client version: ", client_ver, 12, "\n");
-  // Send our required security type:
-  SOCK_SendU32(pc->sock, RFB_SEC_NONE);
-  // Expect ClientInit (share flag byte):
-  if (RFB_WaitForU8(pc, &value) < 0)
+  switch (pc->state)
   {
-    printf("Didn't get ClientInit\n");
-    return -1;
-  }
-  printf("ClientInit share flag: %d\n", value);
-  // Send ServerInit:
-  if (RFB_ServerInit(pc, 500, 500, "Anton's Test Server") < 0)
-  {
-    printf("ServerInit failed\n");
-    return -1;
+    case STATE_VERSION:
+    {
+      client_ver = RFB_WaitFor(pc, 12);
+      if (!client_ver)
+      {
+        if (!pc->again) printf("Didn't get client version string\n");
+        return -1;
+      }
+      nprint("Client version: ", client_ver, 12, "\n");
+      // Send our required security type:
+      OUT_U32(&pc->out, RFB_SEC_NONE);
+      pc->state = STATE_CLIENTINIT;
+      return 0;
+    }
+    case STATE_CLIENTINIT:
+    {
+      // Expect ClientInit (share flag byte):
+      if (RFB_WaitForU8(pc, &value) < 0)
+      {
+        if (!pc->again) printf("Didn't get ClientInit\n");
+        return -1;
+      }
+      printf("ClientInit share flag: %d\n", value);
+      // Send ServerInit:
+      if (RFB_ServerInit(pc, gFramebuffer.width, gFramebuffer.height, "Anton's Test Server") < 0)
+      {
+        printf("ServerInit failed\n");
+        return -1;
+      }
+      printf("ServerInit sent; ready for Client commands\n");
+      pc->state = STATE_READY;
+      return 0;
+    }
   }
-  printf("ServerInit sent; ready for Client commands\n");
-  return 0;
+  return -1;
 }
 
 
@@ -621,186 +941,406 @@ int RFB_Handshake(rfb_conn *pc)
 
 // }
 
+// Passes on the pointer motion held back from the last PointerEvents read:
+void RFB_PassMotion(rfb_conn *pc)
+{
+  if (pc->moved)
+  {
+    INPUT_Push(&gInput, &pc->motion);
+    pc->moved = 0;
+  }
+}
+
+
+// Each command's fixed-size body is only handled once all of it has arrived;
+// until then we return (with pc->again set) and resume on the next read.
+// Handlers that need variable-length data after the body set pc->extra and
+// move to STATE_COMMAND_EXTRA; see RFB_HandleCommandExtra().
 #define BEGIN_CLIENT_COMMAND_SET() {
 #define CLIENT_COMMAND_2(zzcmd,zzvar,zzprint) \
   } case k##zzcmd: { \
     zzcmd##_t *zzvar; \
-    zzprint(#zzcmd); \
     zzvar = RFB_WaitForStruct(pc, zzcmd##_t); \
     if (!zzvar) { \
-      printf(" - Failed!\n"); \
+      if (!pc->again) printf("%s - Failed!\n", #zzcmd); \
       return -1; \
     } \
-    else
+    zzprint(#zzcmd); \
+    pc->state = STATE_READY;
 #define END_CLIENT_COMMAND_SET()  }
 #define CLIENT_COMMAND(zzcmd,zzvar) CLIENT_COMMAND_2(zzcmd,zzvar,printf)
 
-int RFB_WaitForClientCommand(rfb_conn *pc)
+int RFB_HandleCommand(rfb_conn *pc)
 {
-  // Wait for command [byte] from client:
-  int size;
-  unsigned int value;
-  char ver_string[13] = {0};
-  char *tmp;
-  // printf("(RFB_WaitForClientCommand)\n");
-  if (RFB_WaitForU8(pc, &value) < 0)
-  {
-    printf("Failed while waiting for client command: Disconnected?\n");
-    return -1;
-  }
-  // printf("Client command: ");
-  switch (value)
+  switch (pc->command)
   {
     BEGIN_CLIENT_COMMAND_SET();
     CLIENT_COMMAND(SetPixelFormat,m)
     {
+      if (ENC_SetPixelFormat(&pc->enc, &m->format) < 0)
+      {
+        printf(" - Unsupported: %d bpp, shifts %d/%d/%d\n", m->format.bpp, m->format.r_shift, m->format.g_shift, m->format.b_shift);
+        return -1;
+      }
       memcpy(&pc->format, &m->format, sizeof(pc->format));
-      printf(" - Done\n");
+      printf(" - Done (%s)\n", pc->enc.translator.name);
       DUMP_PIXEL_FORMAT(&pc->format);
       break;
     }
     CLIENT_COMMAND(SetEncodings,m)
     {
       int count;
-      S32 *encoding_types;
       HEXDUMP("", m, 1, 0);
       count = RFB16(m->count);
-      if (count > 0)
-      {
-        // Get extra data:
-        printf(" x %d", count);
-        encoding_types = (S32*)RFB_WaitFor(pc, sizeof(S32)*count);
-        if (!encoding_types)
-        {
-          printf(" - Failed getting %d encoding types!\n", count);
-          return -1;
-        }
-      }
-      printf(" - Not implemented\n");
-      HEXDUMP("", encoding_types, count, 0);
+      // Get extra data. An empty list still goes through there, and leaves
+      // the client with just Raw:
+      printf(" x %d", count);
+      pc->extra = sizeof(S32)*count;
+      pc->state = STATE_COMMAND_EXTRA;
       break;
     }
     CLIENT_COMMAND_2(FramebufferUpdateRequest,m,{})
     {
-      pc->refresh = 1;
-      // static int tick = 0;
-      // if (tick++ >= 2)
-      // {
-      //   printf("_");
-      //   tick = 0;
-      // }
-      // else
-      // {
-      //   printf(".");
-      // }
-      // printf(" - Done\n");
+      rfb_rect screen = { 0, 0, gFramebuffer.width, gFramebuffer.height };
+      rfb_rect r = { RFB16(m->x), RFB16(m->y), RFB16(m->w), RFB16(m->h) };
+      if (!RECT_Intersect(&r, &screen, &r))
+      {
+        break;
+      }
+      // Continuous updates take the place of incremental requests:
+      if (pc->continuous && m->incremental)
+      {
+        break;
+      }
+      if (!m->incremental)
+      {
+        // Client wants the whole area, whether it changed or not:
+        REGION_Add(&pc->damage, &r);
+      }
+      // Requests that arrive before we've answered the last one don't queue
+      // up more updates; one update answers them all:
+      if (pc->refresh++)
+      {
+        RECT_Union(&pc->request, &r, &pc->request);
+        pc->incremental = pc->incremental && m->incremental;
+      }
+      else
+      {
+        pc->request = r;
+        pc->incremental = m->incremental;
+      }
       // HEXDUMP("", m, 1, 0);
       break;
     }
     CLIENT_COMMAND(KeyEvent,m)
     {
-      printf(" - Not implemented\n");
-      printf("Key '%c' %s", (char)RFB32(m->key), m->down ? "down" : "up");
+      rfb_input e = { INPUT_KEY, pc->sock };
+      printf(" - Key '%c' %s\n", (char)RFB32(m->key), m->down ? "down" : "up");
+      e.key.key = RFB32(m->key);
+      e.key.down = m->down;
+      RFB_PassMotion(pc);
+      INPUT_Push(&gInput, &e);
       // HEXDUMP("", m, 1, 0);
       break;
     }
     CLIENT_COMMAND_2(PointerEvent,m,{})
     {
-      pc->cursor.x = (int)RFB16(m->x);
-      pc->cursor.y = (int)RFB16(m->y);
-      pc->cursor.buttons = m->button_mask;
-      //printf(" - Pos: (%d,%d) - Buttons: "BYTE_TO_BINARY_PATTERN"\n", pc->cursor.x, pc->cursor.y, BYTE_TO_BINARY(pc->cursor.buttons));
-      printf("P");
-      fflush(stdout);
+      // No printing here: pointers send these as fast as they move.
+      rfb_input e = { INPUT_POINTER, pc->sock };
+      e.pointer.x = (int)RFB16(m->x);
+      e.pointer.y = (int)RFB16(m->y);
+      e.pointer.buttons = m->button_mask;
+      if (e.pointer.buttons == pc->buttons)
+      {
+        // Just a move: only the last of those we read in one go is passed on.
+        pc->motion = e;
+        pc->moved = 1;
+        break;
+      }
+      RFB_PassMotion(pc);
+      INPUT_Push(&gInput, &e);
+      pc->buttons = e.pointer.buttons;
+      //printf(" - Pos: (%d,%d) - Buttons: "BYTE_TO_BINARY_PATTERN"\n", e.pointer.x, e.pointer.y, BYTE_TO_BINARY(e.pointer.buttons));
       // HEXDUMP("", m, 1, 0);
       break;
     }
     CLIENT_COMMAND(ClientCutText,m)
     {
-      int len;
-      char *text;
-      len = m->len;
+      U32 len;
+      len = RFB32(m->len);
+      if (len > RFB_MAX_CUT_TEXT)
+      {
+        printf(" - Too long: %u bytes\n", len);
+        return -1;
+      }
       if (len > 0)
       {
         // Get extra data:
-        text = RFB_WaitFor(pc, sizeof(U8)*len);
-        if (!text)
-        {
-          printf(" - Failed getting %d bytes!\n", len);
-          return -1;
-        }
         printf(" x %d byte(s)", len);
+        pc->extra = sizeof(U8)*len;
+        pc->state = STATE_COMMAND_EXTRA;
+        break;
       }
       printf(" - Not implemented\n");
       break;
     }
+    CLIENT_COMMAND(EnableContinuousUpdates,m)
+    {
+      rfb_rect screen = { 0, 0, gFramebuffer.width, gFramebuffer.height };
+      rfb_rect r = { RFB16(m->x), RFB16(m->y), RFB16(m->w), RFB16(m->h) };
+      if (!(pc->announced & ENC_FLAG_CONTINUOUS))
+      {
+        printf(" - Not announced; ignored\n");
+        break;
+      }
+      if (m->enable && RECT_Intersect(&r, &screen, &r))
+      {
+        printf(" - (%d,%d) %dx%d\n", r.x, r.y, r.w, r.h);
+        pc->continuous = 1;
+        pc->continuous_area = r;
+        break;
+      }
+      printf(" - Off\n");
+      pc->continuous = 0;
+      // Says there'll be no more updates that weren't asked for:
+      if (OUT_U8(&pc->out, kEndOfContinuousUpdates) < 0)
+      {
+        return -1;
+      }
+      break;
+    }
+    CLIENT_COMMAND_2(Fence,m,{})
+    {
+      pc->fence_flags = RFB32(m->flags);
+      if (m->len > FENCE_MAX_PAYLOAD)
+      {
+        printf("Fence - Payload too long (%d)\n", m->len);
+        return -1;
+      }
+      if (m->len > 0)
+      {
+        // Get extra data:
+        pc->extra = m->len;
+        pc->state = STATE_COMMAND_EXTRA;
+        break;
+      }
+      if (RFB_HandleFence(pc, pc->fence_flags, NULL, 0) < 0)
+      {
+        return -1;
+      }
+      break;
+    }
     END_CLIENT_COMMAND_SET();
     default:
     {
-      printf("Unknown (0x%02X)\n", (U8)value);
-      // SMELL: Should probably terminate here because now we're out of sync.
-      break;
+      // We can't tell how long this command is, so we're now out of sync:
+      printf("Unknown (0x%02X)\n", (U8)pc->command);
+      return -1;
     }
   }
-  return value;
+  return 0;
 }
 
 
-void RFB_HandleClient(int sock)
+// Picks what suits the client's link from the encodings it supports: Raw
+// when it's local (compressing costs more than it saves), ZRLE on a LAN, and
+// Tight on anything slower, with JPEG quality to match the bandwidth. Clients
+// that support none of them get what they asked for.
+void RFB_Adapt(rfb_conn *pc)
 {
-  rfb_conn conn = {0};
-  printf("Accepted connection %d\n", sock);
-  if (RFB_OpenClient(sock, &conn) < 0)
+  static const S32 choices[][3] = {
+    { ENC_TIGHT, ENC_ZRLE, ENC_HEXTILE }, // LINK_WAN
+    { ENC_ZRLE, ENC_HEXTILE, ENC_TIGHT }, // LINK_LAN
+    { ENC_RAW, ENC_RAW, ENC_RAW }, // LINK_LOCAL
+  };
+  rfb_encstate *es = &pc->enc;
+  rfb_link *l = &pc->link;
+  S32 type = es->encoder_count ? es->encoders[0]->type : ENC_RAW;
+  int quality = (l->link_class == LINK_WAN) ? l->quality : -1;
+  int i;
+  if (!gAdapt || l->link_class == LINK_UNKNOWN)
   {
-    printf("RFB_OpenClient failed\n");
     return;
   }
-  int state = STATE_HANDSHAKE;
-  int abort = 0;
+  for (i=0; i<3; ++i)
+  {
+    S32 choice = choices[l->link_class - LINK_WAN][i];
+    if (choice == ENC_RAW || ENC_Supports(es, choice))
+    {
+      type = choice;
+      break;
+    }
+  }
+  if (ENC_Adapt(es, type, quality))
+  {
+    printf("Connection %d: %s link (%.1f MB/s, RTT %.1f ms): using %s, quality %d\n",
+      pc->sock, LINK_ClassName(l->link_class), l->bandwidth / 1e6, l->rtt_us / 1e3,
+      ENC_Name(ENC_PreferredType(es)), ENC_Quality(es));
+  }
+}
 
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-  int last_time = 0;
 
-  // RFB message loop:
-  while (!abort)
+// Handles the variable-length data that follows some commands' bodies:
+int RFB_HandleCommandExtra(rfb_conn *pc)
+{
+  char *data = RFB_WaitFor(pc, pc->extra);
+  if (!data)
+  {
+    if (!pc->again) printf(" - Failed getting %d bytes!\n", pc->extra);
+    return -1;
+  }
+  switch (pc->command)
   {
-    gettimeofday(&tv, 0);
-    switch (state)
+    case kSetEncodings:
     {
-      case STATE_HANDSHAKE:
+      S32 *encoding_types = (S32*)data;
+      int count = pc->extra / sizeof(S32);
+      int i;
+      HEXDUMP("", encoding_types, count, 0);
+      ENC_SetEncodings(&pc->enc, encoding_types, count);
+      printf(" - Using:");
+      for (i=0; i<pc->enc.encoder_count; ++i)
       {
-        // Expecting version string from client, then ClientInit (share flag)...
-        if (RFB_Handshake(&conn) < 0)
-        {
-          abort = 1;
-          break;
-        }
-        state = STATE_READY;
+        printf(" %s", pc->enc.encoders[i]->name);
+      }
+      printf("%s (flags 0x%02X)\n", pc->enc.encoder_count ? "" : " Raw", pc->enc.flags);
+      RFB_Adapt(pc);
+      // Its cursor shape goes out again, in case its pixel format changed:
+      pc->cursor_sent = 0;
+      if (RFB_Announce(pc) < 0)
+      {
+        return -1;
+      }
+      break;
+    }
+    case kFence:
+    {
+      if (RFB_HandleFence(pc, pc->fence_flags, (U8*)data, pc->extra) < 0)
+      {
+        return -1;
+      }
+      break;
+    }
+    case kClientCutText:
+    {
+      printf(" - Not implemented\n");
+      break;
+    }
+  }
+  pc->extra = 0;
+  pc->state = STATE_READY;
+  return 0;
+}
+
+
+// Handles everything the client has sent so far. Returns 0 once it runs out
+// of data, or -1 if the connection should be closed.
+int RFB_Process(rfb_conn *pc)
+{
+  int result;
+  unsigned int value;
+  while (1)
+  {
+    switch (pc->state)
+    {
+      case STATE_VERSION:
+      case STATE_CLIENTINIT:
+      {
+        result = RFB_Handshake(pc);
         break;
       }
       case STATE_READY:
       {
-        if (RFB_WaitForClientCommand(&conn) < 0)
+        // Wait for command [byte] from client:
+        result = RFB_WaitForU8(pc, &value);
+        if (result == 0)
         {
-          abort = 1;
-          break;
+          pc->command = value;
+          pc->state = STATE_COMMAND;
         }
         break;
       }
-    }
-    if ((tv.tv_usec-last_time+1000000)%1000000 > 20000) // 50Hz.
-    {
-      if (conn.refresh)
+      case STATE_COMMAND:
       {
-        RFB_FramebufferUpdate(&conn);
-        conn.refresh = 0;
+        result = RFB_HandleCommand(pc);
+        break;
+      }
+      case STATE_COMMAND_EXTRA:
+      {
+        result = RFB_HandleCommandExtra(pc);
+        break;
       }
-      last_time = tv.tv_usec;
+      default:
+      {
+        result = -1;
+        break;
+      }
+    }
+    if (result < 0)
+    {
+      RFB_PassMotion(pc);
+      return pc->again ? 0 : -1;
     }
   }
-  printf("Closing connection %d\n", sock);
-  RFB_CloseClient(&conn);
+}
+
+
+rfb_conn *RFB_AddClient(rfb_worker *w, int sock)
+{
+  rfb_conn *pc = w->spare;
+  if (pc)
+  {
+    w->spare = pc->next;
+    --w->spare_count;
+  }
+  else if (!(pc = calloc(1, sizeof(rfb_conn))))
+  {
+    return NULL;
+  }
+  if (RFB_OpenClient(sock, pc) < 0)
+  {
+    RFB_FreeClient(pc);
+    return NULL;
+  }
+  pc->worker = w;
+  ENC_Init(&pc->enc, &w->arena, &w->staging, &w->helper);
+  pc->next = w->clients;
+  if (w->clients)
+  {
+    w->clients->prev = pc;
+  }
+  w->clients = pc;
+  ++w->client_count;
+  return pc;
+}
+
+
+void RFB_RemoveClient(rfb_conn *pc)
+{
+  printf("Closing connection %d\n", pc->sock);
+  if (pc->prev)
+  {
+    pc->prev->next = pc->next;
+  }
+  else
+  {
+    pc->worker->clients = pc->next;
+  }
+  if (pc->next)
+  {
+    pc->next->prev = pc->prev;
+  }
+  --pc->worker->client_count;
+  // Closing the socket also takes it out of the epoll set:
+  RFB_CloseClient(pc);
+  if (pc->worker->spare_count < RFB_SPARE_CONNS)
+  {
+    pc->next = pc->worker->spare;
+    pc->worker->spare = pc;
+    ++pc->worker->spare_count;
+    return;
+  }
+  RFB_FreeClient(pc);
 }
 
 
@@ -815,14 +1355,22 @@ void SIG_Handle(int sig)
   {
     case SIGINT:
     {
-      int sock = gServerSocket;
-      gServerSocket = -1;
+      int i;
       write(STDERR_FILENO, SIGINT_MSG_1, sizeof(SIGINT_MSG_1)-1);
-      if (sock != -1)
+      for (i=0; i<gWorkerCount; ++i)
+      {
+        int sock = gWorkers[i].server_socket;
+        gWorkers[i].server_socket = -1;
+        if (sock != -1)
+        {
+          // SMELL: Also need to kill all client sockets.
+          close(sock);
+          write(STDERR_FILENO, SIGINT_MSG_2, sizeof(SIGINT_MSG_2)-1);
+        }
+      }
+      if (gShmName)
       {
-        // SMELL: Also need to kill all client sockets.
-        close(sock);
-        write(STDERR_FILENO, SIGINT_MSG_2, sizeof(SIGINT_MSG_2)-1);
+        shm_unlink(gShmName);
       }
       exit(0);
       break;
@@ -845,52 +1393,568 @@ int SOCK_NoLinger(int sock)
 }
 
 
-int main(int argc, char **argv)
+// We batch our own output, so don't let Nagle hold the last bit of it back:
+int SOCK_NoDelay(int sock)
+{
+  int one = 1;
+  return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&one, sizeof(one));
+}
+
+
+int SOCK_NonBlocking(int sock)
+{
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags < 0)
+  {
+    return flags;
+  }
+  return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+// Monotonic milliseconds, for scheduling updates:
+long long TIME_Ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+// Accepts every pending connection (the listener is edge-triggered, so we
+// must drain it):
+void RFB_AcceptClients(rfb_worker *w)
 {
-  int result;
   int client_socket;
-  struct sockaddr_in server_host, client_host;
+  struct sockaddr_in client_host;
+  struct epoll_event ev;
+  rfb_conn *pc;
+  while (1)
+  {
+    socklen_t client_host_len = sizeof(client_host);
+    client_socket = accept(w->server_socket, (struct sockaddr*)&client_host, &client_host_len);
+    if (client_socket < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        printf("Failed to accept client on socket %d. Error: %d\n", w->server_socket, errno);
+      }
+      return;
+    }
+    SOCK_NoLinger(client_socket);
+    SOCK_NoDelay(client_socket);
+    SOCK_NonBlocking(client_socket);
+    printf("Worker %d accepted connection %d\n", w->id, client_socket);
+    pc = RFB_AddClient(w, client_socket);
+    if (!pc)
+    {
+      printf("RFB_OpenClient failed\n");
+      close(client_socket);
+      continue;
+    }
+    OUT_EnableZeroCopy(&pc->out, client_socket);
+    // Being edge-triggered, EPOLLOUT only fires when a full socket drains:
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = pc;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, client_socket, &ev) < 0)
+    {
+      printf("Failed to add connection %d to epoll set\n", client_socket);
+      RFB_RemoveClient(pc);
+    }
+  }
+}
 
-  signal(SIGINT, SIG_Handle);
 
-  gServerSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (gServerSocket < 0)
+// Sends as much queued output as the client will take right now. Anything
+// left over goes when epoll next reports the socket writable.
+int RFB_Flush(rfb_conn *pc)
+{
+  if (OUT_Flush(&pc->out, pc->sock) < 0)
   {
-    printf("Failed to create server socket. Result: %d\n", gServerSocket);
-    exit(1);
+    printf("Failed sending to connection %d\n", pc->sock);
+    return -1;
+  }
+  return 0;
+}
+
+
+// Bytes in the socket's send queue (not sent yet, or not acknowledged):
+int SOCK_Queued(int sock)
+{
+  int queued = 0;
+  if (ioctl(sock, SIOCOUTQ, &queued) < 0)
+  {
+    return 0;
+  }
+  return queued;
+}
+
+
+// Sends the client an update if it has asked for one (or has continuous
+// updates on), isn't over its frame rate, and isn't still working through
+// the last one (in our queue or the kernel's, or, if it answers fences, its
+// own). Otherwise its damage keeps building up, so a slow client skips
+// frames instead of falling behind. Returns -1 if the client has to go.
+int RFB_ScheduleUpdate(rfb_conn *pc, long long now)
+{
+  int in_flight;
+  int result;
+  if (LINK_Sample(&pc->link, pc->sock, now))
+  {
+    RFB_Adapt(pc);
+  }
+  if (pc->link.stalled_since && now - pc->link.stalled_since >= STALL_TIMEOUT_MS)
+  {
+    printf("Connection %d has stopped taking updates\n", pc->sock);
+    return -1;
+  }
+  // Enough fenced updates to cover the link's round trip, and then some:
+  in_flight = MAX_UNFENCED_UPDATES + (int)(pc->link.rtt_us / 1000) / pc->frame_ms;
+  if ((!pc->refresh && !pc->continuous)
+    || now < pc->next_frame
+    || OUT_Pending(&pc->out)
+    || SOCK_Queued(pc->sock) > MAX_SEND_QUEUE
+    || (!pc->refresh && RFB_UnfencedUpdates(pc) >= in_flight))
+  {
+    return 0;
+  }
+  result = RFB_FramebufferUpdate(pc);
+  if (result < 0)
+  {
+    return -1;
+  }
+  if (result)
+  {
+    pc->next_frame = now + pc->frame_ms;
+    // Continuous updates are followed by a fence, to tell when it's done:
+    if (pc->continuous && (pc->announced & ENC_FLAG_FENCE) && RFB_RequestFence(pc) < 0)
+    {
+      return -1;
+    }
+  }
+  return RFB_Flush(pc);
+}
+
+
+// Sends updates to every client that's due one.
+void RFB_UpdateClients(rfb_worker *w, long long now)
+{
+  rfb_conn *pc, *next;
+  FB_ScanTiles(&gFramebuffer, (unsigned int)(now / SCAN_INTERVAL_MS));
+  if (gFramebuffer.scan)
+  {
+    // Nobody else knows when anything was drawn:
+    FB_Publish(&gFramebuffer);
+  }
+  FB_DetectMoves(&gFramebuffer);
+  for (pc = w->clients; pc; pc = next)
+  {
+    next = pc->next;
+    if (RFB_ScheduleUpdate(pc, now) < 0)
+    {
+      RFB_RemoveClient(pc);
+    }
+  }
+}
+
+
+// Runs all of a worker's client connections. Every socket is non-blocking
+// and edge-triggered, and each connection's parser picks up where it left
+// off, so a slow client never holds up the others.
+void *RFB_EventLoop(void *arg)
+{
+  rfb_worker *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  long long now, next_update;
+  int n, i, timeout;
+  // Ticks fall on multiples of the interval, so all workers tick together
+  // and can share the work of FB_ScanTiles():
+  next_update = (TIME_Ms() / TICK_MS + 1) * TICK_MS;
+  while (1)
+  {
+    timeout = (int)(next_update - TIME_Ms());
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, Max(timeout, 0));
+    if (n < 0 && errno != EINTR)
+    {
+      printf("Worker %d: epoll_wait failed. Error: %d\n", w->id, errno);
+      exit(1);
+    }
+    for (i=0; i<n; ++i)
+    {
+      rfb_conn *pc = events[i].data.ptr;
+      if (!pc)
+      {
+        RFB_AcceptClients(w);
+        continue;
+      }
+      // EPOLLERR can just mean MSG_ZEROCOPY completions are waiting:
+      if ((events[i].events & EPOLLERR) && OUT_ReapZeroCopy(&pc->out, pc->sock) < 0)
+      {
+        RFB_RemoveClient(pc);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        pc->drained = 0;
+      }
+      // Read whatever's there first, even if the client has hung up, then
+      // send any replies (and anything left over from before). A client
+      // that just asked for an update, or finished taking the last one,
+      // may be due another already:
+      if (RFB_Process(pc) < 0
+        || (events[i].events & EPOLLHUP)
+        || RFB_Flush(pc) < 0
+        || RFB_ScheduleUpdate(pc, TIME_Ms()) < 0)
+      {
+        RFB_RemoveClient(pc);
+      }
+    }
+    now = TIME_Ms();
+    if (now >= next_update)
+    {
+      RFB_UpdateClients(w, now);
+      next_update = (now / TICK_MS + 1) * TICK_MS;
+    }
+  }
+  return NULL;
+}
+
+
+// The application: acts on input from all clients, drawing a frame into the
+// framebuffer for each batch of it. It has a thread of its own, so drawing never waits on the
+// network and the workers never wait on drawing.
+void APP_HandleInput(const rfb_input *e)
+{
+  switch (e->type)
+  {
+    case INPUT_KEY:
+    {
+      // Up and down arrows scroll the framebuffer, as a demo of CopyRect:
+      if (e->key.down && (e->key.key == XK_Up || e->key.key == XK_Down))
+      {
+        FB_Scroll(&gFramebuffer, (e->key.key == XK_Up) ? 16 : -16);
+      }
+      break;
+    }
+    case INPUT_POINTER:
+    {
+      // Moving the pointer only moves the cursor. While a button is held,
+      // paint a randomly-coloured square where it is:
+      CURSOR_Move(&gCursor, e->pointer.x, e->pointer.y, e->client);
+      if (e->pointer.buttons)
+      {
+        FB_FillRect(&gFramebuffer, e->pointer.x, e->pointer.y, 20, 20,
+          FB_RGB(random(), random(), random()));
+      }
+      break;
+    }
+  }
+}
+
+
+// Passes on the damage producers (the application, and other processes with
+// -m) post as they finish frames, and publishes what they drew. When
+// scanning, their damage is left for FB_ScanTiles() to find instead.
+void *RFB_WatchProducers(void *arg)
+{
+  rfb_shm_header *h = arg;
+  rfb_rect r;
+  while (1)
+  {
+    SHM_Wait(h, 1000);
+    if (SHM_Overflowed(h) && !gFramebuffer.scan)
+    {
+      FB_Damage(&gFramebuffer, 0, 0, gFramebuffer.width, gFramebuffer.height);
+    }
+    while (SHM_Take(h, &r))
+    {
+      if (!gFramebuffer.scan)
+      {
+        FB_Damage(&gFramebuffer, r.x, r.y, r.w, r.h);
+      }
+    }
+    if (!gFramebuffer.scan)
+    {
+      FB_Publish(&gFramebuffer);
+    }
   }
+  return NULL;
+}
+
+
+void *APP_Run(void *arg)
+{
+  rfb_input batch[INPUT_BATCH];
+  unsigned int dropped = 0;
+  int count, i;
+  while (1)
+  {
+    INPUT_Wait(&gInput, 1000);
+    while ((count = INPUT_Take(&gInput, batch, INPUT_BATCH)) > 0)
+    {
+      FB_BeginDraw(&gFramebuffer);
+      for (i=0; i<count; ++i)
+      {
+        APP_HandleInput(&batch[i]);
+      }
+      FB_EndDraw(&gFramebuffer);
+    }
+    if (gInput.dropped != dropped)
+    {
+      dropped = gInput.dropped;
+      printf("Input: %u event(s) dropped so far\n", dropped);
+    }
+  }
+  return NULL;
+}
+
+
+// Creates a non-blocking socket listening on 'port'. SO_REUSEPORT lets every
+// worker have its own.
+int SOCK_Listen(int port)
+{
+  int sock;
+  int result;
+  int one = 1;
+  struct sockaddr_in server_host;
+  sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0)
+  {
+    printf("Failed to create server socket. Result: %d\n", sock);
+    return -1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*)&one, sizeof(one));
   memset(&server_host, 0, sizeof(server_host));
   server_host.sin_family = AF_INET;
   server_host.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_host.sin_port = htons(PORT);
-  result = bind(gServerSocket, (struct sockaddr*)&server_host, sizeof(server_host));
+  server_host.sin_port = htons(port);
+  result = bind(sock, (struct sockaddr*)&server_host, sizeof(server_host));
   if (result < 0)
   {
-    printf("Failed to bind to socket %d. Result: %d\n", gServerSocket, result);
-    close(gServerSocket);
-    exit(1);
+    printf("Failed to bind to socket %d. Result: %d\n", sock, result);
+    close(sock);
+    return -1;
   }
-  result = listen(gServerSocket, MAXPENDING);  // Last arg is our connection queue limit.
+  result = listen(sock, MAXPENDING);  // Last arg is our connection queue limit.
   if (result < 0)
   {
-    printf("Failed to listen to socket %d. Result: %d\n", gServerSocket, result);
-    close(gServerSocket);
+    printf("Failed to listen to socket %d. Result: %d\n", sock, result);
+    close(sock);
+    return -1;
+  }
+  SOCK_NoLinger(sock);
+  SOCK_NonBlocking(sock);
+  return sock;
+}
+
+
+int RFB_InitWorker(rfb_worker *w, int id)
+{
+  struct epoll_event ev;
+  memset(w, 0, sizeof(*w));
+  w->id = id;
+  if (OUT_Init(&w->staging) < 0 || ARENA_Init(&w->arena, ARENA_INIT_SIZE) < 0 || ENC_InitHelper(&w->helper) < 0)
+  {
+    return -1;
+  }
+  w->pool.max_free = ENC_POOL_MAX_FREE;
+  w->staging.pool = &w->pool;
+  w->server_socket = SOCK_Listen(PORT);
+  if (w->server_socket < 0)
+  {
+    return -1;
+  }
+  w->epfd = epoll_create1(0);
+  if (w->epfd < 0)
+  {
+    printf("Failed to create epoll set\n");
+    return -1;
+  }
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; // NULL marks the listening socket.
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->server_socket, &ev) < 0)
+  {
+    printf("Failed to add server socket to epoll set\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+void Usage(char *name)
+{
+  printf(
+    "Usage: %s [-g WIDTHxHEIGHT] [-t THREADS] [-e THREADS] [-z LEVEL] [-f FPS] [-s] [-A] [-m NAME]\n"
+    "  -g  Framebuffer size (default: %dx%d)\n"
+    "  -t  Worker threads (default: one per core; at most 14)\n"
+    "  -e  Extra threads to help encode big updates (default: 1; 0 for none)\n"
+    "  -z  zlib compression level, 0-9 (default: %d)\n"
+    "  -f  Most updates per second for each client (default: %d)\n"
+    "  -s  Find changes by scanning, as if nothing reported damage\n"
+    "  -A  Always use the client's preferred encoding, whatever the link\n"
+    "  -m  Keep the framebuffer in shared memory NAME (e.g. /rfb) for other\n"
+    "      processes to draw into (see shm.h)\n",
+    name, FB_DEFAULT_WIDTH, FB_DEFAULT_HEIGHT, ENC_DEFAULT_COMPRESS, DEFAULT_FPS);
+}
+
+
+int main(int argc, char **argv)
+{
+  int i;
+  int opt;
+  int width = FB_DEFAULT_WIDTH;
+  int height = FB_DEFAULT_HEIGHT;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int helpers = 1;
+  int scan = 0;
+  pthread_t app;
+  pthread_t producers;
+
+  while ((opt = getopt(argc, argv, "g:t:e:z:f:sAm:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'g':
+      {
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2
+          || width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF)
+        {
+          printf("Invalid geometry: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      }
+      case 't':
+      {
+        threads = atoi(optarg);
+        if (threads <= 0)
+        {
+          printf("Invalid thread count: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      }
+      case 'e':
+      {
+        if (sscanf(optarg, "%d", &helpers) != 1 || helpers < 0)
+        {
+          printf("Invalid helper thread count: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      }
+      case 'z':
+      {
+        if (sscanf(optarg, "%d", &gCompressLevel) != 1 || gCompressLevel < 0 || gCompressLevel > 9)
+        {
+          printf("Invalid compression level: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      }
+      case 'f':
+      {
+        int fps;
+        if (sscanf(optarg, "%d", &fps) != 1 || fps <= 0 || fps > 1000)
+        {
+          printf("Invalid frame rate: %s\n", optarg);
+          exit(1);
+        }
+        gFrameMs = 1000 / fps;
+        break;
+      }
+      case 's':
+      {
+        scan = 1;
+        break;
+      }
+      case 'A':
+      {
+        gAdapt = 0;
+        break;
+      }
+      case 'm':
+      {
+        gShmName = optarg;
+        break;
+      }
+      default:
+      {
+        Usage(argv[0]);
+        exit(1);
+      }
+    }
+  }
+  // Each worker reads one frame at a time, and there can't be more of
+  // those than FB_Publish() can work around:
+  threads = Min(Max(threads, 1), FB_MAX_FRAMES - 2);
+
+  if (gShmName)
+  {
+    pixel_format format;
+    FB_NativeFormat(&format);
+    gShm = SHM_Create(gShmName, width, height, &format);
+    if (!gShm)
+    {
+      printf("Failed to create shared memory %s. Error: %d\n", gShmName, errno);
+      exit(1);
+    }
+  }
+  if (FB_Init(&gFramebuffer, width, height, gShm) < 0)
+  {
+    printf("Failed to allocate %dx%d framebuffer\n", width, height);
     exit(1);
   }
-  SOCK_NoLinger(gServerSocket);
-  while (1)
+  gFramebuffer.scan = scan;
+  CURSOR_Init(&gCursor, width / 2, height / 2);
+  printf("Framebuffer: %dx%d%s\n", width, height, scan ? " (scanning for changes)" : "");
+  if (gShm)
   {
-    unsigned int client_host_len = sizeof(client_host);
-    // Block, waiting to accept a new connection:
-    printf("Awaiting connection...\n");
-    client_socket = accept(gServerSocket, (struct sockaddr*)&client_host, &client_host_len);
-    if (client_socket < 0)
+    printf("Shared as %s\n", gShmName);
+  }
+  if (pthread_create(&producers, NULL, RFB_WatchProducers, gFramebuffer.canvas) != 0)
+  {
+    printf("Failed to start watching for producers\n");
+    exit(1);
+  }
+
+  gWorkers = calloc(threads, sizeof(rfb_worker));
+  if (!gWorkers)
+  {
+    exit(1);
+  }
+  signal(SIGINT, SIG_Handle);
+  INPUT_Init(&gInput);
+  if (pthread_create(&app, NULL, APP_Run, NULL) != 0)
+  {
+    printf("Failed to start the application thread\n");
+    exit(1);
+  }
+  for (i=0; i<threads; ++i)
+  {
+    if (RFB_InitWorker(&gWorkers[i], i) < 0)
     {
-      printf("Failed to accept client on socket %d. Result: %d\n", gServerSocket, client_socket);
-      close(gServerSocket);
       exit(1);
     }
-    SOCK_NoLinger(client_socket);
-    RFB_HandleClient(client_socket);
+    gWorkerCount = i+1;
+  }
+  helpers = ENC_StartHelpers(helpers);
+  printf("Awaiting connections on port %d with %d worker(s) and %d encoding helper(s)...\n", PORT, threads, helpers);
+  for (i=0; i<threads; ++i)
+  {
+    if (pthread_create(&gWorkers[i].thread, NULL, RFB_EventLoop, &gWorkers[i]) != 0)
+    {
+      printf("Failed to start worker %d\n", i);
+      exit(1);
+    }
   }
+  for (i=0; i<threads; ++i)
+  {
+    pthread_join(gWorkers[i].thread, NULL);
+  }
+  return 0;
 }
@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "outbuf.h"
+
+// Only memory that outlives the send can go with MSG_ZEROCOPY. Shared blocks
+// do, because we hold on to them until the kernel says it's finished:
+#define OUT_ZEROCOPY_OK(zzc) ((zzc)->ref != NULL)
+
+
+int OUT_Init(rfb_outbuf *ob)
+{
+  memset(ob, 0, sizeof(*ob));
+  ob->data = malloc(OUT_INIT_SIZE);
+  ob->chunks = malloc(sizeof(rfb_outchunk) * OUT_INIT_CHUNKS);
+  if (!ob->data || !ob->chunks)
+  {
+    OUT_Free(ob);
+    return -1;
+  }
+  ob->size = OUT_INIT_SIZE;
+  ob->chunk_max = OUT_INIT_CHUNKS;
+  return 0;
+}
+
+
+void OUT_Free(rfb_outbuf *ob)
+{
+  if (ob->chunks)
+  {
+    OUT_Reset(ob);
+  }
+  free(ob->data);
+  free(ob->chunks);
+  free(ob->held);
+  memset(ob, 0, sizeof(*ob));
+}
+
+
+static rfb_outchunk *OUT_NewChunk(rfb_outbuf *ob)
+{
+  if (ob->chunk_count == ob->chunk_max)
+  {
+    int new_max = ob->chunk_max * 2;
+    rfb_outchunk *chunks = realloc(ob->chunks, sizeof(rfb_outchunk) * new_max);
+    if (!chunks)
+    {
+      return NULL;
+    }
+    ob->chunks = chunks;
+    ob->chunk_max = new_max;
+  }
+  return &ob->chunks[ob->chunk_count++];
+}
+
+
+// Makes room for 'bytes' more bytes at the end of the queue, and returns
+// where to write them. The caller must fill all of them before the next
+// call on this buffer.
+U8 *OUT_Reserve(rfb_outbuf *ob, int bytes)
+{
+  rfb_outchunk *last = ob->chunk_count ? &ob->chunks[ob->chunk_count-1] : NULL;
+  U8 *out;
+  if (ob->len + bytes > ob->size)
+  {
+    int new_size = Max(ob->size * 2, ob->len + bytes);
+    U8 *data = realloc(ob->data, new_size);
+    if (!data)
+    {
+      return NULL;
+    }
+    ob->data = data;
+    ob->size = new_size;
+  }
+  // Extend the last chunk if it's ours, otherwise start a new one:
+  if (!last || last->ref || last->offset + last->len != ob->len)
+  {
+    last = OUT_NewChunk(ob);
+    if (!last)
+    {
+      return NULL;
+    }
+    last->ref = NULL;
+    last->offset = ob->len;
+    last->len = 0;
+    last->shared = NULL;
+  }
+  out = ob->data + ob->len;
+  last->len += bytes;
+  ob->len += bytes;
+  return out;
+}
+
+
+// Gives back the unused end of the last OUT_Reserve(), for when we reserved
+// the most a message could need before knowing how much it would take.
+void OUT_Unreserve(rfb_outbuf *ob, int bytes)
+{
+  rfb_outchunk *last = &ob->chunks[ob->chunk_count-1];
+  last->len -= bytes;
+  ob->len -= bytes;
+}
+
+
+// Queues 'data' without copying it. It has to stay valid until sent.
+int OUT_Ref(rfb_outbuf *ob, const void *data, int len)
+{
+  rfb_outchunk *chunk;
+  if (len <= 0)
+  {
+    return 0;
+  }
+  chunk = OUT_NewChunk(ob);
+  if (!chunk)
+  {
+    return -1;
+  }
+  chunk->ref = data;
+  chunk->offset = 0;
+  chunk->len = len;
+  chunk->shared = NULL;
+  return 0;
+}
+
+
+// Queues 'len' bytes of 's' from 'offset', holding a reference on it until
+// they've been sent.
+int OUT_RefShared(rfb_outbuf *ob, rfb_shared *s, int offset, int len)
+{
+  if (OUT_Ref(ob, s->data + offset, len) < 0)
+  {
+    return -1;
+  }
+  if (len > 0)
+  {
+    ob->chunks[ob->chunk_count-1].shared = s;
+    OUT_Hold(s);
+  }
+  return 0;
+}
+
+
+rfb_shared *OUT_NewShared(int len)
+{
+  rfb_shared *s = malloc(sizeof(rfb_shared) + len);
+  if (s)
+  {
+    s->refs = 1;
+    s->len = len;
+    s->pool = NULL;
+  }
+  return s;
+}
+
+
+// A block for 'len' bytes from 'pool' (its owner only), reusing one that's
+// been given back if there is one.
+static rfb_shared *OUT_PoolShared(rfb_sharedpool *pool, int len)
+{
+  int size_class = 0;
+  rfb_shared *s;
+  while (size_class < OUT_POOL_SIZES && len > (1 << (OUT_POOL_MIN_SHIFT + size_class)))
+  {
+    ++size_class;
+  }
+  if (size_class == OUT_POOL_SIZES)
+  {
+    return OUT_NewShared(len);
+  }
+  s = __atomic_load_n(&pool->free[size_class], __ATOMIC_ACQUIRE);
+  while (s && !__atomic_compare_exchange_n(&pool->free[size_class], &s, s->next_free,
+    1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  if (s)
+  {
+    __atomic_sub_fetch(&pool->free_count[size_class], 1, __ATOMIC_RELAXED);
+  }
+  else if (!(s = malloc(sizeof(rfb_shared) + (1 << (OUT_POOL_MIN_SHIFT + size_class)))))
+  {
+    return NULL;
+  }
+  s->refs = 1;
+  s->len = len;
+  s->pool = pool;
+  s->size_class = size_class;
+  return s;
+}
+
+
+void OUT_Hold(rfb_shared *s)
+{
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void OUT_Release(rfb_shared *s)
+{
+  rfb_sharedpool *pool;
+  if (!s || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0)
+  {
+    return;
+  }
+  pool = s->pool;
+  if (!pool || __atomic_add_fetch(&pool->free_count[s->size_class], 1, __ATOMIC_RELAXED) > pool->max_free)
+  {
+    if (pool)
+    {
+      __atomic_sub_fetch(&pool->free_count[s->size_class], 1, __ATOMIC_RELAXED);
+    }
+    free(s);
+    return;
+  }
+  s->next_free = __atomic_load_n(&pool->free[s->size_class], __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&pool->free[s->size_class], &s->next_free, s,
+    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+int OUT_Bytes(rfb_outbuf *ob, const void *data, int len)
+{
+  U8 *p = OUT_Reserve(ob, len);
+  if (!p)
+  {
+    return -1;
+  }
+  memcpy(p, data, len);
+  return 0;
+}
+
+
+int OUT_U8(rfb_outbuf *ob, unsigned int value)
+{
+  U8 *p = OUT_Reserve(ob, 1);
+  if (!p)
+  {
+    return -1;
+  }
+  p[0] = value & 0xFFL;
+  return 0;
+}
+
+
+int OUT_U16(rfb_outbuf *ob, unsigned int value)
+{
+  U8 *p = OUT_Reserve(ob, 2);
+  if (!p)
+  {
+    return -1;
+  }
+  p[1] = value & 0xFFL; value >>= 8;
+  p[0] = value & 0xFFL;
+  return 0;
+}
+
+
+int OUT_U32(rfb_outbuf *ob, unsigned int value)
+{
+  U8 *p = OUT_Reserve(ob, 4);
+  if (!p)
+  {
+    return -1;
+  }
+  p[3] = value & 0xFFL; value >>= 8;
+  p[2] = value & 0xFFL; value >>= 8;
+  p[1] = value & 0xFFL; value >>= 8;
+  p[0] = value & 0xFFL;
+  return 0;
+}
+
+
+int OUT_printf(rfb_outbuf *ob, const char *fmt, ...)
+{
+  va_list ap;
+  int size;
+  U8 *p;
+  // Determine required size:
+  va_start(ap, fmt);
+  size = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (size < 0) { return size; }
+  // Reserve one more for vsnprintf()'s trailing NUL, then drop it again:
+  p = OUT_Reserve(ob, size+1);
+  if (!p) { return -1; }
+  va_start(ap, fmt);
+  vsnprintf((char*)p, size+1, fmt, ap);
+  va_end(ap);
+  --ob->len;
+  --ob->chunks[ob->chunk_count-1].len;
+  return size;
+}
+
+
+int OUT_Pending(const rfb_outbuf *ob)
+{
+  return ob->first < ob->chunk_count;
+}
+
+
+// Drops everything queued and not yet sent.
+void OUT_Clear(rfb_outbuf *ob)
+{
+  int i;
+  for (i=ob->first; i<ob->chunk_count; ++i)
+  {
+    OUT_Release(ob->chunks[i].shared);
+  }
+  ob->len = 0;
+  ob->chunk_count = 0;
+  ob->first = 0;
+  ob->sent = 0;
+}
+
+
+// Empties the queue once its socket is closed, so it can be used for another:
+// what's queued is dropped, and so is anything held for zero-copy sends.
+void OUT_Reset(rfb_outbuf *ob)
+{
+  int i;
+  OUT_Clear(ob);
+  for (i=0; i<ob->held_count; ++i)
+  {
+    OUT_Release(ob->held[i].shared);
+  }
+  ob->held_count = 0;
+  ob->zerocopy = 0;
+  ob->zerocopy_sends = 0;
+}
+
+
+// Copies everything queued (which must not have been partly sent) into one
+// new shared block (from the queue's pool, if it has one), and clears the
+// queue. Returns NULL if out of memory.
+rfb_shared *OUT_Share(rfb_outbuf *ob)
+{
+  rfb_shared *s;
+  U8 *p;
+  int i, len = 0;
+  for (i=0; i<ob->chunk_count; ++i)
+  {
+    len += ob->chunks[i].len;
+  }
+  s = ob->pool ? OUT_PoolShared(ob->pool, len) : OUT_NewShared(len);
+  if (s)
+  {
+    p = s->data;
+    for (i=0; i<ob->chunk_count; ++i)
+    {
+      rfb_outchunk *c = &ob->chunks[i];
+      memcpy(p, c->ref ? c->ref : ob->data + c->offset, c->len);
+      p += c->len;
+    }
+  }
+  OUT_Clear(ob);
+  return s;
+}
+
+
+// Keeps a reference on every shared block in the next 'bytes' to be sent,
+// which have just gone with MSG_ZEROCOPY, until OUT_ReapZeroCopy() hears
+// that send is complete.
+static int OUT_HoldSent(rfb_outbuf *ob, long bytes)
+{
+  int i = ob->first;
+  long skip = ob->sent;
+  for (; bytes > 0 && i < ob->chunk_count; bytes -= ob->chunks[i].len - skip, skip = 0, ++i)
+  {
+    rfb_outheld *h;
+    if (!ob->chunks[i].shared)
+    {
+      continue;
+    }
+    if (ob->held_count == ob->held_max)
+    {
+      int new_max = ob->held_max ? ob->held_max * 2 : OUT_INIT_CHUNKS;
+      rfb_outheld *held = realloc(ob->held, sizeof(rfb_outheld) * new_max);
+      if (!held)
+      {
+        return -1;
+      }
+      ob->held = held;
+      ob->held_max = new_max;
+    }
+    h = &ob->held[ob->held_count++];
+    h->send = ob->zerocopy_sends;
+    h->shared = ob->chunks[i].shared;
+    OUT_Hold(h->shared);
+  }
+  ++ob->zerocopy_sends;
+  return 0;
+}
+
+
+// Sends as much of the queue as the socket will take. Returns 1 if it's all
+// gone, 0 if some is still queued (try again when the socket is writable),
+// or -1 on error.
+//
+// With zero-copy on, our own bytes and referenced data go in separate
+// sendmsg() calls, so that only referenced memory (which outlives the send)
+// is ever handed to the kernel with MSG_ZEROCOPY; our own buffer gets reused
+// as soon as we return.
+int OUT_Flush(rfb_outbuf *ob, int sock)
+{
+  struct iovec iov[OUT_MAX_IOV];
+  struct msghdr msg;
+  int i, n, result, flags;
+  long bytes;
+  while (ob->first < ob->chunk_count)
+  {
+    int is_ref = OUT_ZEROCOPY_OK(&ob->chunks[ob->first]);
+    bytes = 0;
+    for (i=ob->first, n=0; i<ob->chunk_count && n<OUT_MAX_IOV; ++i, ++n)
+    {
+      rfb_outchunk *c = &ob->chunks[i];
+      int skip = (i == ob->first) ? ob->sent : 0;
+      const U8 *base = c->ref ? c->ref : ob->data + c->offset;
+      if (ob->zerocopy && OUT_ZEROCOPY_OK(c) != is_ref)
+      {
+        break;
+      }
+      iov[n].iov_base = (void*)(base + skip);
+      iov[n].iov_len = c->len - skip;
+      bytes += iov[n].iov_len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    // If there's more than fits in one call, tell TCP not to push a partial
+    // segment yet:
+    flags = MSG_NOSIGNAL | ((i < ob->chunk_count) ? MSG_MORE : 0);
+    #ifdef MSG_ZEROCOPY
+    if (ob->zerocopy && is_ref && bytes >= OUT_ZEROCOPY_MIN)
+    {
+      flags |= MSG_ZEROCOPY;
+    }
+    #endif // MSG_ZEROCOPY
+    result = sendmsg(sock, &msg, flags);
+    #ifdef MSG_ZEROCOPY
+    if (result < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+    {
+      // Out of room to track zero-copy sends; do this one the usual way:
+      flags &= ~MSG_ZEROCOPY;
+      result = sendmsg(sock, &msg, flags);
+    }
+    if (result > 0 && (flags & MSG_ZEROCOPY) && OUT_HoldSent(ob, result) < 0)
+    {
+      return -1;
+    }
+    #endif // MSG_ZEROCOPY
+    if (result < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      return -1;
+    }
+    #ifdef DEBUG
+    printf("OUT_Flush: Sent %d byte(s) in %d chunk(s)\n", result, n);
+    #endif // DEBUG
+    // Skip past whatever got sent:
+    while (result > 0)
+    {
+      int remaining = ob->chunks[ob->first].len - ob->sent;
+      if (result < remaining)
+      {
+        ob->sent += result;
+        break;
+      }
+      result -= remaining;
+      OUT_Release(ob->chunks[ob->first].shared);
+      ++ob->first;
+      ob->sent = 0;
+    }
+  }
+  // All sent; start again from the top:
+  ob->len = 0;
+  ob->chunk_count = 0;
+  ob->first = 0;
+  ob->sent = 0;
+  return 1;
+}
+
+
+// Turns on SO_ZEROCOPY for the socket, if the kernel has it:
+int OUT_EnableZeroCopy(rfb_outbuf *ob, int sock)
+{
+  #ifdef SO_ZEROCOPY
+  int one = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, (void*)&one, sizeof(one)) == 0)
+  {
+    ob->zerocopy = 1;
+    return 0;
+  }
+  #endif // SO_ZEROCOPY
+  ob->zerocopy = 0;
+  return -1;
+}
+
+
+// Drains MSG_ZEROCOPY completions from the socket's error queue (which is
+// what raises EPOLLERR for them), and lets go of the shared blocks those
+// sends were holding on to. If the kernel reports it had to copy anyway
+// (e.g. over loopback), we stop asking. Returns -1 if there's a real socket
+// error instead.
+int OUT_ReapZeroCopy(rfb_outbuf *ob, int sock)
+{
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  #ifdef SO_EE_ORIGIN_ZEROCOPY
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  while (ob->zerocopy || ob->held_count)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    {
+      break;
+    }
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+      struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+      int done = 0;
+      if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+      {
+        continue;
+      }
+      if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+      {
+        ob->zerocopy = 0;
+      }
+      // Sends ee_info to ee_data are complete (and they complete in order):
+      while (done < ob->held_count && (int)(ob->held[done].send - ee->ee_data) <= 0)
+      {
+        OUT_Release(ob->held[done++].shared);
+      }
+      ob->held_count -= done;
+      memmove(ob->held, ob->held + done, sizeof(rfb_outheld) * ob->held_count);
+    }
+  }
+  #endif // SO_EE_ORIGIN_ZEROCOPY
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (void*)&error, &error_len) < 0 || error)
+  {
+    return -1;
+  }
+  return 0;
+}
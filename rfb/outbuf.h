@@ -0,0 +1,105 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include "rfb.h"
+
+// Per-connection output queue. Messages are built up with the big-endian
+// append helpers, then OUT_Flush() sends everything queued with as few
+// sendmsg() calls as it can. Whatever the socket won't take yet stays queued
+// until the next flush (i.e. when epoll says the socket is writable again).
+
+#define OUT_INIT_SIZE    4096
+#define OUT_INIT_CHUNKS  64
+#define OUT_MAX_IOV      1024 // Most iovecs we pass to one sendmsg().
+
+// Smallest run of referenced (not copied) data we send with MSG_ZEROCOPY.
+// Below this, pinning pages and reaping completions costs more than the copy:
+#define OUT_ZEROCOPY_MIN (128*1024)
+
+// Shared blocks can come from a pool, in power-of-two sizes from
+// 1 << OUT_POOL_MIN_SHIFT up. Once they're finished with, it keeps up to
+// its 'max_free' of each size (which should cover as many as can be in use
+// at once, or it will keep freeing blocks only to allocate them again).
+// OUT_POOL_MAX_FREE is slack for those still in queues:
+#define OUT_POOL_MIN_SHIFT 8
+#define OUT_POOL_SIZES     16
+#define OUT_POOL_MAX_FREE  32
+
+// Reference-counted bytes that several queues can send at once (e.g. an
+// encoded rectangle shared between connections). Freed (or returned to
+// their pool) when the last reference goes.
+typedef struct rfb_shared {
+  int refs;
+  int len;
+  struct rfb_sharedpool *pool; // NULL if it's from malloc().
+  int size_class; // Its size, in the pool.
+  struct rfb_shared *next_free; // While it's in the pool.
+  U8 data[0];
+} rfb_shared;
+
+// Finished-with blocks of each size. Anyone can give blocks back, but only
+// the owner (one thread) takes them out again, so a lock-free stack is
+// safe from the ABA problem:
+typedef struct rfb_sharedpool {
+  rfb_shared *free[OUT_POOL_SIZES];
+  int free_count[OUT_POOL_SIZES];
+  int max_free;
+} rfb_sharedpool;
+
+// A run of queued bytes. Chunks either point into our own buffer (by offset,
+// because the buffer can move when it grows), or reference memory owned by
+// someone else that must stay put until it has been sent.
+typedef struct {
+  const U8 *ref; // NULL: 'offset' is into the buffer's own data.
+  int offset;
+  int len;
+  rfb_shared *shared; // If 'ref' is in one, the reference we hold on it.
+} rfb_outchunk;
+
+// A shared block the kernel may still be reading, after a MSG_ZEROCOPY send:
+typedef struct {
+  U32 send; // Which zero-copy send (the kernel numbers them from 0).
+  rfb_shared *shared;
+} rfb_outheld;
+
+typedef struct {
+  U8 *data;
+  int size;
+  int len;
+  rfb_outchunk *chunks;
+  int chunk_count;
+  int chunk_max;
+  int first; // First chunk not completely sent yet.
+  int sent; // Bytes of chunks[first] already sent.
+  int zerocopy; // Socket has SO_ZEROCOPY, so big referenced runs can use it.
+  rfb_sharedpool *pool; // Where OUT_Share() gets blocks, if anywhere.
+  U32 zerocopy_sends; // MSG_ZEROCOPY sends so far.
+  // References kept until the kernel says it's done with them, in order:
+  rfb_outheld *held;
+  int held_count;
+  int held_max;
+} rfb_outbuf;
+
+int OUT_Init(rfb_outbuf *ob);
+void OUT_Free(rfb_outbuf *ob);
+U8 *OUT_Reserve(rfb_outbuf *ob, int bytes);
+void OUT_Unreserve(rfb_outbuf *ob, int bytes);
+int OUT_Ref(rfb_outbuf *ob, const void *data, int len);
+int OUT_RefShared(rfb_outbuf *ob, rfb_shared *s, int offset, int len);
+int OUT_Bytes(rfb_outbuf *ob, const void *data, int len);
+int OUT_U8(rfb_outbuf *ob, unsigned int value);
+int OUT_U16(rfb_outbuf *ob, unsigned int value);
+int OUT_U32(rfb_outbuf *ob, unsigned int value);
+int OUT_printf(rfb_outbuf *ob, const char *fmt, ...);
+int OUT_Pending(const rfb_outbuf *ob);
+void OUT_Clear(rfb_outbuf *ob);
+void OUT_Reset(rfb_outbuf *ob);
+rfb_shared *OUT_Share(rfb_outbuf *ob);
+rfb_shared *OUT_NewShared(int len);
+void OUT_Hold(rfb_shared *s);
+void OUT_Release(rfb_shared *s);
+int OUT_Flush(rfb_outbuf *ob, int sock);
+int OUT_EnableZeroCopy(rfb_outbuf *ob, int sock);
+int OUT_ReapZeroCopy(rfb_outbuf *ob, int sock);
+
+#endif // OUTBUF_H
@@ -0,0 +1,501 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIX_X86
+#endif
+
+#include "pixfmt.h"
+#include "fb.h"
+
+
+// Scales an 8-bit channel to 0..max, the same way for every kernel:
+#define PIX_SCALE(zzc,zzmax) ((((U32)(zzc)) * ((zzmax)+1)) >> 8)
+
+static inline U32 PIX_Pixel(const rfb_translator *t, U32 p)
+{
+  return (PIX_SCALE(FB_R(p), t->r_max) << t->r_shift)
+       | (PIX_SCALE(FB_G(p), t->g_max) << t->g_shift)
+       | (PIX_SCALE(FB_B(p), t->b_max) << t->b_shift);
+}
+
+
+// Client uses our own format:
+static void PIX_RowNative(const rfb_translator *t, const U32 *src, U8 *dst, int count)
+{
+  memcpy(dst, src, count * sizeof(U32));
+}
+
+
+// Works for anything, one pixel at a time:
+static void PIX_RowScalar(const rfb_translator *t, const U32 *src, U8 *dst, int count)
+{
+  int i;
+  U32 c;
+  switch (t->bytes_per_pixel)
+  {
+    case 4:
+    {
+      for (i=0; i<count; ++i, dst+=4)
+      {
+        c = PIX_Pixel(t, src[i]);
+        if (t->format.big_endian)
+        {
+          dst[0] = B3(c); dst[1] = B2(c); dst[2] = B1(c); dst[3] = B0(c);
+        }
+        else
+        {
+          dst[0] = B0(c); dst[1] = B1(c); dst[2] = B2(c); dst[3] = B3(c);
+        }
+      }
+      break;
+    }
+    case 2:
+    {
+      for (i=0; i<count; ++i, dst+=2)
+      {
+        c = PIX_Pixel(t, src[i]);
+        if (t->format.big_endian)
+        {
+          dst[0] = B1(c); dst[1] = B0(c);
+        }
+        else
+        {
+          dst[0] = B0(c); dst[1] = B1(c);
+        }
+      }
+      break;
+    }
+    default:
+    {
+      for (i=0; i<count; ++i)
+      {
+        dst[i] = PIX_Pixel(t, src[i]);
+      }
+      break;
+    }
+  }
+}
+
+
+// Three table lookups per pixel, for whatever SIMD can't do:
+static void PIX_RowLUT(const rfb_translator *t, const U32 *src, U8 *dst, int count)
+{
+  const rfb_lut *l = t->lut;
+  int i;
+  U32 p;
+  switch (t->bytes_per_pixel)
+  {
+    case 4:
+    {
+      for (i=0; i<count; ++i, dst+=4)
+      {
+        U32 c;
+        p = src[i];
+        c = l->r[FB_R(p)] | l->g[FB_G(p)] | l->b[FB_B(p)];
+        memcpy(dst, &c, 4);
+      }
+      break;
+    }
+    case 2:
+    {
+      for (i=0; i<count; ++i, dst+=2)
+      {
+        U16 c;
+        p = src[i];
+        c = l->r[FB_R(p)] | l->g[FB_G(p)] | l->b[FB_B(p)];
+        memcpy(dst, &c, 2);
+      }
+      break;
+    }
+    default:
+    {
+      for (i=0; i<count; ++i)
+      {
+        p = src[i];
+        dst[i] = l->r[FB_R(p)] | l->g[FB_G(p)] | l->b[FB_B(p)];
+      }
+      break;
+    }
+  }
+}
+
+
+// Cache of lookup tables, shared by all threads:
+static rfb_lut *gLUTs = NULL;
+static pthread_mutex_t gLUTLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// FNV-1a, over the (normalised) format:
+static U32 PIX_Hash(const pixel_format *f)
+{
+  const U8 *p = (const U8*)f;
+  U32 hash = 2166136261U;
+  int i;
+  for (i=0; i<sizeof(*f); ++i)
+  {
+    hash = (hash ^ p[i]) * 16777619U;
+  }
+  return hash;
+}
+
+
+// Table entry for one channel value, in the client's byte order:
+static U32 PIX_LUTEntry(const rfb_translator *t, U32 value)
+{
+  int swap = (t->format.big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__));
+  if (!swap)
+  {
+    return value;
+  }
+  switch (t->bytes_per_pixel)
+  {
+    case 4: return __builtin_bswap32(value);
+    case 2: return __builtin_bswap16((U16)value);
+    default: return value;
+  }
+}
+
+
+// Finds (or builds) the tables for t->format, and takes a reference:
+static rfb_lut *PIX_GetLUT(const rfb_translator *t)
+{
+  U32 hash = PIX_Hash(&t->format);
+  rfb_lut *l;
+  int i;
+  pthread_mutex_lock(&gLUTLock);
+  for (l = gLUTs; l; l = l->next)
+  {
+    if (l->hash == hash && !memcmp(&l->format, &t->format, sizeof(l->format)))
+    {
+      ++l->refs;
+      pthread_mutex_unlock(&gLUTLock);
+      return l;
+    }
+  }
+  l = malloc(sizeof(rfb_lut));
+  if (l)
+  {
+    memcpy(&l->format, &t->format, sizeof(l->format));
+    l->hash = hash;
+    l->refs = 1;
+    for (i=0; i<256; ++i)
+    {
+      l->r[i] = PIX_LUTEntry(t, PIX_SCALE(i, t->r_max) << t->r_shift);
+      l->g[i] = PIX_LUTEntry(t, PIX_SCALE(i, t->g_max) << t->g_shift);
+      l->b[i] = PIX_LUTEntry(t, PIX_SCALE(i, t->b_max) << t->b_shift);
+    }
+    l->next = gLUTs;
+    gLUTs = l;
+  }
+  pthread_mutex_unlock(&gLUTLock);
+  return l;
+}
+
+
+static void PIX_PutLUT(rfb_lut *lut)
+{
+  rfb_lut **pl;
+  pthread_mutex_lock(&gLUTLock);
+  if (--lut->refs == 0)
+  {
+    for (pl = &gLUTs; *pl; pl = &(*pl)->next)
+    {
+      if (*pl == lut)
+      {
+        *pl = lut->next;
+        break;
+      }
+    }
+    free(lut);
+  }
+  pthread_mutex_unlock(&gLUTLock);
+}
+
+
+#ifdef PIX_X86
+
+// The SIMD kernels need every channel max to be 2^n - 1 (n <= 8), so that
+// scaling is just taking the channel's top n bits:
+//   ((p >> in) & max) << shift
+// They only ever run on little-endian hosts, so "little endian" output is
+// the register contents as they are.
+
+__attribute__((target("sse2")))
+static inline __m128i PIX_SSE2_Pixels(const __m128i p, const __m128i in[3], const __m128i out[3], const __m128i max[3])
+{
+  __m128i r = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, in[0]), max[0]), out[0]);
+  __m128i g = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, in[1]), max[1]), out[1]);
+  __m128i b = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, in[2]), max[2]), out[2]);
+  return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+
+// Values are < 0x10000; sign-extend the low halves so that the signed
+// saturating pack keeps them exactly:
+__attribute__((target("sse2")))
+static inline __m128i PIX_SSE2_Pack16(__m128i a, __m128i b)
+{
+  a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+  b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+  return _mm_packs_epi32(a, b);
+}
+
+
+__attribute__((target("sse2")))
+static void PIX_RowSSE2(const rfb_translator *t, const U32 *src, U8 *dst, int count)
+{
+  const __m128i in[3] = { _mm_cvtsi32_si128(t->r_in), _mm_cvtsi32_si128(t->g_in), _mm_cvtsi32_si128(t->b_in) };
+  const __m128i out[3] = { _mm_cvtsi32_si128(t->r_shift), _mm_cvtsi32_si128(t->g_shift), _mm_cvtsi32_si128(t->b_shift) };
+  const __m128i max[3] = { _mm_set1_epi32(t->r_max), _mm_set1_epi32(t->g_max), _mm_set1_epi32(t->b_max) };
+  int i = 0;
+  __m128i a, b, c, d;
+  switch (t->bytes_per_pixel)
+  {
+    case 4:
+    {
+      for (; i+4<=count; i+=4, dst+=16)
+      {
+        a = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i)), in, out, max);
+        if (t->format.big_endian)
+        {
+          // No byte shuffle in SSE2: swap 16-bit halves, then bytes in each:
+          a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xB1), 0xB1);
+          a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        }
+        _mm_storeu_si128((__m128i*)dst, a);
+      }
+      break;
+    }
+    case 2:
+    {
+      for (; i+8<=count; i+=8, dst+=16)
+      {
+        a = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i)), in, out, max);
+        b = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i+4)), in, out, max);
+        a = PIX_SSE2_Pack16(a, b);
+        if (t->format.big_endian)
+        {
+          a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        }
+        _mm_storeu_si128((__m128i*)dst, a);
+      }
+      break;
+    }
+    default:
+    {
+      for (; i+16<=count; i+=16, dst+=16)
+      {
+        a = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i)), in, out, max);
+        b = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i+4)), in, out, max);
+        c = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i+8)), in, out, max);
+        d = PIX_SSE2_Pixels(_mm_loadu_si128((const __m128i*)(src+i+12)), in, out, max);
+        // Everything's < 0x100, so neither pack can saturate:
+        a = _mm_packs_epi32(a, b);
+        c = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(a, c));
+      }
+      break;
+    }
+  }
+  PIX_RowScalar(t, src+i, dst, count-i);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i PIX_AVX2_Pixels(const __m256i p, const __m128i in[3], const __m128i out[3], const __m256i max[3])
+{
+  __m256i r = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, in[0]), max[0]), out[0]);
+  __m256i g = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, in[1]), max[1]), out[1]);
+  __m256i b = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, in[2]), max[2]), out[2]);
+  return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+
+__attribute__((target("avx2")))
+static void PIX_RowAVX2(const rfb_translator *t, const U32 *src, U8 *dst, int count)
+{
+  const __m128i in[3] = { _mm_cvtsi32_si128(t->r_in), _mm_cvtsi32_si128(t->g_in), _mm_cvtsi32_si128(t->b_in) };
+  const __m128i out[3] = { _mm_cvtsi32_si128(t->r_shift), _mm_cvtsi32_si128(t->g_shift), _mm_cvtsi32_si128(t->b_shift) };
+  const __m256i max[3] = { _mm256_set1_epi32(t->r_max), _mm256_set1_epi32(t->g_max), _mm256_set1_epi32(t->b_max) };
+  const __m256i swap32 = _mm256_setr_epi8(
+    3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+    3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+  const __m256i swap16 = _mm256_setr_epi8(
+    1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14,
+    1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+  int i = 0;
+  __m256i a, b, c, d;
+  switch (t->bytes_per_pixel)
+  {
+    case 4:
+    {
+      for (; i+8<=count; i+=8, dst+=32)
+      {
+        a = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i)), in, out, max);
+        if (t->format.big_endian)
+        {
+          a = _mm256_shuffle_epi8(a, swap32);
+        }
+        _mm256_storeu_si256((__m256i*)dst, a);
+      }
+      break;
+    }
+    case 2:
+    {
+      for (; i+16<=count; i+=16, dst+=32)
+      {
+        a = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i)), in, out, max);
+        b = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i+8)), in, out, max);
+        // Values are < 0x10000, so the unsigned saturating pack keeps them.
+        // It works within 128-bit lanes, so put the lanes back in order:
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        if (t->format.big_endian)
+        {
+          a = _mm256_shuffle_epi8(a, swap16);
+        }
+        _mm256_storeu_si256((__m256i*)dst, a);
+      }
+      break;
+    }
+    default:
+    {
+      const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+      for (; i+32<=count; i+=32, dst+=32)
+      {
+        a = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i)), in, out, max);
+        b = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i+8)), in, out, max);
+        c = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i+16)), in, out, max);
+        d = PIX_AVX2_Pixels(_mm256_loadu_si256((const __m256i*)(src+i+24)), in, out, max);
+        // Two in-lane packs leave the 4-pixel groups interleaved by lane:
+        a = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));
+        _mm256_storeu_si256((__m256i*)dst, _mm256_permutevar8x32_epi32(a, order));
+      }
+      break;
+    }
+  }
+  PIX_RowScalar(t, src+i, dst, count-i);
+}
+
+#endif // PIX_X86
+
+
+// Returns n if max is 2^n - 1 with 1 <= n <= 8, otherwise 0:
+static int PIX_Bits(U32 max)
+{
+  int n;
+  for (n=1; n<=8; ++n)
+  {
+    if (max == (1U<<n)-1)
+    {
+      return n;
+    }
+  }
+  return 0;
+}
+
+
+// Sets up 't' to translate into 'f', replacing whatever it did before.
+// Returns -1 if 'f' isn't a format RFB allows.
+int PIX_Init(rfb_translator *t, const pixel_format *f)
+{
+  int r_bits, g_bits, b_bits;
+  PIX_Free(t);
+  memset(t, 0, sizeof(*t));
+  memcpy(&t->format, f, sizeof(t->format));
+  // Normalise, so equal formats hash the same:
+  t->format.big_endian = !!f->big_endian;
+  t->format.true_colour = !!f->true_colour;
+  memset(t->format._padding, 0, sizeof(t->format._padding));
+  t->bytes_per_pixel = f->bpp / 8;
+  t->r_max = RFB16P(f->r_max);
+  t->g_max = RFB16P(f->g_max);
+  t->b_max = RFB16P(f->b_max);
+  t->r_shift = f->r_shift;
+  t->g_shift = f->g_shift;
+  t->b_shift = f->b_shift;
+  if (f->bpp != 8 && f->bpp != 16 && f->bpp != 32)
+  {
+    return -1;
+  }
+  // Every kernel shifts channels by these, which must stay inside a pixel:
+  if (f->r_shift >= f->bpp || f->g_shift >= f->bpp || f->b_shift >= f->bpp)
+  {
+    return -1;
+  }
+  if (FB_IsNativeFormat(f))
+  {
+    t->row = PIX_RowNative;
+    t->name = "native";
+    return 0;
+  }
+  t->row = PIX_RowScalar;
+  t->name = "scalar";
+  r_bits = PIX_Bits(t->r_max);
+  g_bits = PIX_Bits(t->g_max);
+  b_bits = PIX_Bits(t->b_max);
+  t->r_in = 16 + 8 - r_bits;
+  t->g_in = 8 + 8 - g_bits;
+  t->b_in = 0 + 8 - b_bits;
+  #ifdef PIX_X86
+  if (r_bits && g_bits && b_bits && f->true_colour
+    && t->r_shift < 32 && t->g_shift < 32 && t->b_shift < 32)
+  {
+    // The 16 and 8bpp packs assume the result fits:
+    int fits = (f->bpp == 32)
+      || ((t->r_max << t->r_shift | t->g_max << t->g_shift | t->b_max << t->b_shift) >> f->bpp) == 0;
+    if (fits && __builtin_cpu_supports("avx2"))
+    {
+      t->row = PIX_RowAVX2;
+      t->name = "AVX2";
+    }
+    else if (fits && __builtin_cpu_supports("sse2"))
+    {
+      t->row = PIX_RowSSE2;
+      t->name = "SSE2";
+    }
+  }
+  #endif // PIX_X86
+  if (t->row == PIX_RowScalar)
+  {
+    // Trade the multiplies for table lookups, if we can get tables:
+    t->lut = PIX_GetLUT(t);
+    if (t->lut)
+    {
+      t->row = PIX_RowLUT;
+      t->name = "LUT";
+    }
+  }
+  return 0;
+}
+
+
+void PIX_Free(rfb_translator *t)
+{
+  if (t->lut)
+  {
+    PIX_PutLUT(t->lut);
+    t->lut = NULL;
+  }
+}
+
+
+// Translates a w*h block of native pixels (rows 'stride' pixels apart) into
+// 'dst', packed tightly:
+void PIX_TranslateRect(const rfb_translator *t, const U32 *src, int stride, U8 *dst, int w, int h)
+{
+  int y;
+  int row_bytes = w * t->bytes_per_pixel;
+  if (w == stride)
+  {
+    // Contiguous, so do it as one long row:
+    t->row(t, src, dst, w*h);
+    return;
+  }
+  for (y=0; y<h; ++y)
+  {
+    t->row(t, src + y*stride, dst + y*row_bytes, w);
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef PIXFMT_H
+#define PIXFMT_H
+
+#include "rfb.h"
+
+// Translates native framebuffer pixels (0x00RRGGBB, host order) into a
+// client's pixel_format. PIX_Init() picks the fastest kernel that can handle
+// the format once, when the format is set, so the per-pixel work is just
+// running it.
+
+struct rfb_translator;
+
+// Lookup tables for one pixel_format: a pixel is R[r] | G[g] | B[b], with
+// the entries already scaled, shifted and in the client's byte order. Tables
+// are cached by format and shared by every connection using it.
+typedef struct rfb_lut {
+  pixel_format format;
+  U32 hash;
+  int refs;
+  U32 r[256];
+  U32 g[256];
+  U32 b[256];
+  struct rfb_lut *next;
+} rfb_lut;
+
+typedef void (*pix_row_fn)(const struct rfb_translator *t, const U32 *src, U8 *dst, int count);
+
+typedef struct rfb_translator {
+  pixel_format format;
+  int bytes_per_pixel;
+  // Channel maxima and destination shifts, in host order:
+  U32 r_max, g_max, b_max;
+  int r_shift, g_shift, b_shift;
+  // For maxima of the form 2^n - 1, how far right each channel's top bits
+  // sit in a native pixel (which is what the SIMD kernels use):
+  int r_in, g_in, b_in;
+  rfb_lut *lut; // If the LUT kernel was picked.
+  pix_row_fn row;
+  const char *name;
+} rfb_translator;
+
+int PIX_Init(rfb_translator *t, const pixel_format *f);
+void PIX_Free(rfb_translator *t);
+void PIX_TranslateRect(const rfb_translator *t, const U32 *src, int stride, U8 *dst, int w, int h);
+
+#define PIX_TranslateRow(zzt,zzsrc,zzdst,zzcount) ((zzt)->row((zzt), (zzsrc), (zzdst), (zzcount)))
+
+#endif // PIXFMT_H
@@ -0,0 +1,78 @@
+#ifndef RFB_H
+#define RFB_H
+
+// Types, byte-order helpers and wire structures shared by all of the RFB
+// server's modules.
+
+#define U8 unsigned char
+#define U16 unsigned short
+#define U32 unsigned int
+#define S32 int
+#define U64 unsigned long long
+
+#define BUILD_BUG_ON(condition) extern char _BUILD_BUG_ON_ [ sizeof(char[1 - 2*!!(condition)]) ]
+
+#define Default(zzsrc,zzalt) ((zzsrc) ? (zzsrc) : (zzalt))
+
+#define Min(zza,zzb) (((zza) < (zzb)) ? (zza) : (zzb))
+#define Max(zza,zzb) (((zza) > (zzb)) ? (zza) : (zzb))
+
+BUILD_BUG_ON(sizeof(U8) != 1);
+BUILD_BUG_ON(sizeof(U16) != 2);
+BUILD_BUG_ON(sizeof(U32) != 4);
+BUILD_BUG_ON(sizeof(S32) != 4);
+BUILD_BUG_ON(sizeof(U64) != 8);
+
+
+// This is used to tell GCC that we want our structs packed exactly
+// as stated with no automatic padding/alignment:
+#define PACKED __attribute__((packed))
+
+#define B0(zzs) ((zzs)&0xFFL)
+#define B1(zzs) ((zzs>>8)&0xFFL)
+#define B2(zzs) ((zzs>>16)&0xFFL)
+#define B3(zzs) ((zzs>>24)&0xFFL)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define RFB8(zzs) (zzs)
+#define RFB16(zzs) ((B0(zzs)<<8) | (B1(zzs)))
+#define RFB32(zzs) ((B0(zzs)<<24) | (B1(zzs)<<16) | (B2(zzs)<<8) | (B3(zzs)))
+#else
+#define RFB8(zzs) (zzs)
+#define RFB16(zzs) ((zzs)&0xFFFFL)
+#define RFB32(zzs) ((zzs)&0xFFFFFFFFL)
+#endif
+#define RFB16P(zza) RFB16(*(U16*)(zza))
+#define RFB32P(zza) RFB32(*(U32*)(zza))
+
+// Write big-endian values at 'zzp', advancing it:
+#define PUT16(zzp,zzv) do { (zzp)[0] = B1(zzv); (zzp)[1] = B0(zzv); (zzp) += 2; } while (0)
+#define PUT32(zzp,zzv) do { (zzp)[0] = B3(zzv); (zzp)[1] = B2(zzv); (zzp)[2] = B1(zzv); (zzp)[3] = B0(zzv); (zzp) += 4; } while (0)
+
+
+typedef struct {
+  U8 bpp;
+  U8 depth;
+  U8 big_endian;
+  U8 true_colour;
+  U8 r_max[2];
+  U8 g_max[2];
+  U8 b_max[2];
+  U8 r_shift;
+  U8 g_shift;
+  U8 b_shift;
+  U8 _padding[3];
+} PACKED pixel_format;
+
+BUILD_BUG_ON(sizeof(pixel_format) != 16);
+
+
+// A rectangle in framebuffer coordinates:
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} rfb_rect;
+
+#endif // RFB_H
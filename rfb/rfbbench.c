@@ -0,0 +1,951 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "rfb.h"
+#include "encode.h"
+
+// A load generator and benchmark for the server, run on the same machine.
+// It opens a number of connections, does the RFB 3.3 handshake on each, and
+// then for a while keeps asking for updates and moving the pointer (with a
+// button held, so it paints) at the given rates. Everything the server sends
+// is parsed far enough to check it's well formed and to find where the next
+// message starts, but pixels aren't decoded. At the end it reports updates
+// and bytes per second, and update latency: from the request going out to
+// the last byte of the update coming in.
+//
+// Each connection starts with a full (non-incremental) request, whose
+// update isn't counted. After that, requests are incremental (unless -f is
+// given), so one is only answered once something has changed in the
+// framebuffer, and at most at the server's frame rate (its -f).
+//
+// -s adds connections that stall: once the run is under way, they're opened
+// one at a time, each asks for a full update in Raw, and then never reads
+// any of it. Each has its own compression level and quality, so the server
+// can't share what it sends them. Meanwhile, the others should carry on
+// as before, so an error is counted if one has to wait more than
+// BENCH_STARVED_S for an update, or is sent the whole screen in answer to
+// an incremental request. That's what happens once the server stops
+// publishing new frames: the damage they would have covered piles up until
+// it's more than the server keeps track of.
+//
+// Usage: rfbbench.elf [-c CONNECTIONS] [-d SECONDS] [-r RATE] [-p RATE]
+//                     [-b BUTTONS] [-e ENCODINGS] [-f] [-s STALLED] [-P PORT]
+
+#define BENCH_PORT          5905
+#define BENCH_BUFFER        (256*1024)
+#define BENCH_TIMEOUT_S     5 // For connecting, the handshake and sending.
+#define BENCH_MAX_EVENTS    64
+#define BENCH_POINTER_STEP  7 // Pixels the pointer moves each event.
+#define BENCH_STALL_MS      100 // Between opening stalled connections.
+#define BENCH_STALL_RCVBUF  4096 // Their receive buffers.
+#define BENCH_STARVED_S     2 // Longest wait for an update, with -s.
+
+// What the parser expects next:
+enum {
+  BENCH_MESSAGE,
+  BENCH_RECT,
+  BENCH_RECT_DONE,
+  BENCH_RRE,
+  BENCH_ZRLE,
+  BENCH_HEXTILE,
+  BENCH_TIGHT,
+  BENCH_TIGHT_DATA,
+  BENCH_TIGHT_LENGTH,
+};
+
+typedef struct {
+  int sock;
+  int width;
+  int height;
+  int bpp; // Bytes per pixel.
+  int tpixel; // Bytes per pixel in Tight's fills and palettes.
+  U8 buffer[BENCH_BUFFER];
+  int len;
+  int pos;
+  // Parser state:
+  int state;
+  int skip; // Bytes to pass over before going on in 'state'.
+  int rects; // Left in the update being read.
+  rfb_rect r; // The rectangle being read.
+  int tile; // Hextile's next tile.
+  int tight_size; // Tight data after the filter, before compression.
+  long long area; // Pixels sent in the update so far.
+  // Timing:
+  long long requested; // When the outstanding request went out (0: none).
+  long long next_request;
+  long long next_pointer;
+  int warm; // Its first update (the full one) is in.
+  int x, y, dx, dy;
+  int closed;
+} bench_conn;
+
+
+// Settings:
+static int gConnCount = 1;
+static int gSeconds = 10;
+static int gRequestRate = 0; // Per second, per connection; 0 as each update arrives.
+static int gPointerRate = 60;
+static int gButtons = 1;
+static int gIncremental = 1;
+static int gStalled = 0;
+static int gPort = BENCH_PORT;
+static S32 gEncodings[ENC_MAX_PREFS] = { ENC_ZRLE, ENC_COPYRECT, ENC_RAW };
+static int gEncodingCount = 3;
+
+// Results:
+static long long gUpdates = 0;
+static long long gBytes = 0;
+static int gErrors = 0;
+static int *gLatencies = NULL; // Microseconds, one per update.
+static int gLatencySize = 0;
+
+
+// Monotonic microseconds:
+static long long BENCH_Now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+static int BENCH_Fail(bench_conn *c, const char *why)
+{
+  printf("Connection %d: %s\n", c->sock, why);
+  ++gErrors;
+  return -1;
+}
+
+
+// For the handshake, while the socket is still blocking:
+static int BENCH_ReadAll(int sock, U8 *p, int len)
+{
+  int got;
+  while (len > 0)
+  {
+    got = recv(sock, p, len, 0);
+    if (got <= 0)
+    {
+      return -1;
+    }
+    p += got;
+    len -= got;
+  }
+  return 0;
+}
+
+
+// Sends all of a message, waiting for room if the server is slow to read
+// (which holds up the other connections, but only for as long as it's
+// backed up):
+static int BENCH_Send(bench_conn *c, const U8 *p, int len)
+{
+  struct pollfd pfd = { c->sock, POLLOUT, 0 };
+  while (len > 0)
+  {
+    int sent = send(c->sock, p, len, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      p += sent;
+      len -= sent;
+    }
+    else if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if (poll(&pfd, 1, BENCH_TIMEOUT_S * 1000) <= 0)
+      {
+        return BENCH_Fail(c, "Send timed out");
+      }
+    }
+    else
+    {
+      return BENCH_Fail(c, "Send failed");
+    }
+  }
+  return 0;
+}
+
+
+static int BENCH_Request(bench_conn *c, int incremental, long long now)
+{
+  U8 msg[10];
+  U8 *p = msg;
+  *p++ = 3; // FramebufferUpdateRequest.
+  *p++ = incremental;
+  PUT16(p, 0);
+  PUT16(p, 0);
+  PUT16(p, c->width);
+  PUT16(p, c->height);
+  if (BENCH_Send(c, msg, sizeof(msg)) < 0)
+  {
+    return -1;
+  }
+  c->requested = now;
+  return 0;
+}
+
+
+// Moves the pointer on (bouncing off the edges), with the buttons held:
+static int BENCH_Pointer(bench_conn *c)
+{
+  U8 msg[6];
+  U8 *p = msg;
+  c->x += c->dx;
+  c->y += c->dy;
+  if (c->x < 0 || c->x >= c->width)
+  {
+    c->dx = -c->dx;
+    c->x += 2*c->dx;
+  }
+  if (c->y < 0 || c->y >= c->height)
+  {
+    c->dy = -c->dy;
+    c->y += 2*c->dy;
+  }
+  *p++ = 5; // PointerEvent.
+  *p++ = gButtons;
+  PUT16(p, c->x);
+  PUT16(p, c->y);
+  return BENCH_Send(c, msg, sizeof(msg));
+}
+
+
+// Opens a connection (the 'index'th of its kind) and asks for a full update.
+// A stalled one is set up as -s describes.
+static int BENCH_Connect(bench_conn *c, int index, int stalled)
+{
+  struct sockaddr_in addr;
+  struct timeval timeout = { BENCH_TIMEOUT_S, 0 };
+  U8 msg[4 + 2*ENC_MAX_PREFS*2];
+  U8 init[24];
+  U8 *p;
+  U32 security, name_len;
+  S32 stalled_encodings[3] = { ENC_RAW, ENC_PSEUDO_COMPRESS_0 + index % 10, ENC_PSEUDO_QUALITY_0 + index / 10 % 10 };
+  const S32 *encodings = stalled ? stalled_encodings : gEncodings;
+  int encoding_count = stalled ? 3 : gEncodingCount;
+  int rcvbuf = BENCH_STALL_RCVBUF;
+  int one = 1;
+  int i;
+  memset(c, 0, sizeof(*c));
+  c->sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->sock < 0)
+  {
+    printf("Failed to create socket\n");
+    return -1;
+  }
+  setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (stalled)
+  {
+    // Before connecting, so the window it offers is small too:
+    setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(gPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(c->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    printf("Failed to connect to port %d. Error: %d\n", gPort, errno);
+    return -1;
+  }
+  // ProtocolVersion, then the server's security type (which has to be None):
+  if (BENCH_ReadAll(c->sock, c->buffer, 12) < 0 || memcmp(c->buffer, "RFB 003.", 8))
+  {
+    return BENCH_Fail(c, "Didn't get a version string");
+  }
+  if (send(c->sock, "RFB 003.003\n", 12, 0) != 12 || BENCH_ReadAll(c->sock, c->buffer, 4) < 0)
+  {
+    return BENCH_Fail(c, "Didn't get a security type");
+  }
+  security = RFB32P(c->buffer);
+  if (security != 1)
+  {
+    return BENCH_Fail(c, "Security type isn't None");
+  }
+  // ClientInit (shared), then ServerInit:
+  if (send(c->sock, "\1", 1, 0) != 1 || BENCH_ReadAll(c->sock, init, sizeof(init)) < 0)
+  {
+    return BENCH_Fail(c, "Didn't get ServerInit");
+  }
+  c->width = RFB16P(init);
+  c->height = RFB16P(init + 2);
+  c->bpp = init[4] / 8;
+  c->tpixel = (c->bpp == 4 && init[5] == 24 && init[7]) ? 3 : c->bpp;
+  name_len = RFB32P(init + 20);
+  if (!c->width || !c->height || !c->bpp || name_len > BENCH_BUFFER
+    || BENCH_ReadAll(c->sock, c->buffer, name_len) < 0)
+  {
+    return BENCH_Fail(c, "Bad ServerInit");
+  }
+  // SetEncodings:
+  p = msg;
+  *p++ = 2;
+  *p++ = 0;
+  PUT16(p, encoding_count);
+  for (i=0; i<encoding_count; ++i)
+  {
+    PUT32(p, encodings[i]);
+  }
+  if (send(c->sock, msg, p - msg, 0) != p - msg)
+  {
+    return BENCH_Fail(c, "SetEncodings failed");
+  }
+  // Everyone starts somewhere different, heading a different way:
+  c->x = (index * 37) % c->width;
+  c->y = (index * 53) % c->height;
+  c->dx = (index & 1) ? BENCH_POINTER_STEP : -BENCH_POINTER_STEP;
+  c->dy = (index & 2) ? BENCH_POINTER_STEP : -BENCH_POINTER_STEP;
+  fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL, 0) | O_NONBLOCK);
+  return BENCH_Request(c, 0, BENCH_Now());
+}
+
+
+static void BENCH_Record(int latency)
+{
+  if (gUpdates >= gLatencySize)
+  {
+    int size = Max(gLatencySize * 2, 4096);
+    int *grown = realloc(gLatencies, size * sizeof(int));
+    if (!grown)
+    {
+      return;
+    }
+    gLatencies = grown;
+    gLatencySize = size;
+  }
+  gLatencies[gUpdates++] = latency;
+}
+
+
+// A whole update is in:
+static int BENCH_UpdateDone(bench_conn *c)
+{
+  long long now = BENCH_Now();
+  if (!c->requested)
+  {
+    return BENCH_Fail(c, "Update without a request");
+  }
+  if (gStalled && gIncremental && c->warm && c->area >= (long long)c->width * c->height)
+  {
+    return BENCH_Fail(c, "Sent the whole screen");
+  }
+  c->area = 0;
+  if (c->warm)
+  {
+    BENCH_Record((int)(now - c->requested));
+  }
+  c->warm = 1;
+  c->requested = 0;
+  if (!gRequestRate)
+  {
+    return BENCH_Request(c, gIncremental, now) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+
+// Reads a Tight compact length (1-3 bytes) at 'p', if it's all there.
+// Returns how many bytes it took, or 0 if it isn't.
+static int BENCH_CompactLength(const U8 *p, int avail, int *len)
+{
+  int i;
+  *len = 0;
+  for (i=0; i<3; ++i)
+  {
+    if (i >= avail)
+    {
+      return 0;
+    }
+    *len |= (p[i] & (i < 2 ? 0x7F : 0xFF)) << (7*i);
+    if (i == 2 || !(p[i] & 0x80))
+    {
+      return i+1;
+    }
+  }
+  return 0;
+}
+
+
+// Starts on a rectangle whose 12-byte header is at 'p':
+static int BENCH_StartRect(bench_conn *c, const U8 *p)
+{
+  S32 encoding = (S32)RFB32P(p + 8);
+  rfb_rect *r = &c->r;
+  r->x = RFB16P(p);
+  r->y = RFB16P(p + 2);
+  r->w = RFB16P(p + 4);
+  r->h = RFB16P(p + 6);
+  c->state = BENCH_RECT_DONE;
+  if (encoding >= 0 && (r->x + r->w > c->width || r->y + r->h > c->height))
+  {
+    return BENCH_Fail(c, "Rectangle outside the framebuffer");
+  }
+  if (encoding >= 0 && encoding != ENC_COPYRECT)
+  {
+    c->area += (long long)r->w * r->h;
+  }
+  switch (encoding)
+  {
+    case ENC_RAW:
+      c->skip = r->w * r->h * c->bpp;
+      break;
+    case ENC_COPYRECT:
+      c->skip = 4;
+      break;
+    case ENC_RRE:
+      c->state = BENCH_RRE;
+      break;
+    case ENC_ZRLE:
+      c->state = BENCH_ZRLE;
+      break;
+    case ENC_HEXTILE:
+      c->tile = 0;
+      c->state = BENCH_HEXTILE;
+      break;
+    case ENC_TIGHT:
+      c->state = BENCH_TIGHT;
+      break;
+    case ENC_PSEUDO_CURSOR:
+      c->skip = r->w * r->h * c->bpp + (r->w + 7) / 8 * r->h;
+      break;
+    case ENC_PSEUDO_POINTERPOS:
+      break;
+    case ENC_PSEUDO_DESKTOPSIZE:
+      c->width = r->w;
+      c->height = r->h;
+      break;
+    case ENC_PSEUDO_LASTRECT:
+      c->rects = 1;
+      break;
+    default:
+      return BENCH_Fail(c, "Unknown encoding");
+  }
+  return 0;
+}
+
+
+// Works through what's been received, as far as it can. Returns -1 if the
+// server sent something it shouldn't have.
+static int BENCH_Parse(bench_conn *c)
+{
+  while (1)
+  {
+    int avail = c->len - c->pos;
+    U8 *p = c->buffer + c->pos;
+    int need, n;
+    if (c->skip)
+    {
+      n = Min(c->skip, avail);
+      c->pos += n;
+      c->skip -= n;
+      if (c->skip)
+      {
+        return 0;
+      }
+      continue;
+    }
+    if (c->state == BENCH_RECT_DONE)
+    {
+      c->state = BENCH_RECT;
+      if (--c->rects == 0)
+      {
+        c->state = BENCH_MESSAGE;
+        if (BENCH_UpdateDone(c) < 0)
+        {
+          return -1;
+        }
+      }
+      continue;
+    }
+    if (!avail)
+    {
+      return 0;
+    }
+    switch (c->state)
+    {
+      case BENCH_MESSAGE:
+      {
+        switch (p[0])
+        {
+          case 0: // FramebufferUpdate.
+          {
+            if (avail < 4)
+            {
+              return 0;
+            }
+            c->rects = RFB16P(p + 2);
+            c->pos += 4;
+            c->state = c->rects ? BENCH_RECT : BENCH_RECT_DONE;
+            if (!c->rects)
+            {
+              c->rects = 1;
+            }
+            break;
+          }
+          case 1: // SetColourMapEntries.
+          {
+            if (avail < 6)
+            {
+              return 0;
+            }
+            c->skip = 6 * RFB16P(p + 4);
+            c->pos += 6;
+            break;
+          }
+          case 2: // Bell.
+          case 150: // EndOfContinuousUpdates.
+          {
+            c->pos += 1;
+            break;
+          }
+          case 3: // ServerCutText.
+          {
+            if (avail < 8)
+            {
+              return 0;
+            }
+            c->skip = RFB32P(p + 4);
+            c->pos += 8;
+            break;
+          }
+          case 248: // ServerFence.
+          {
+            if (avail < 9)
+            {
+              return 0;
+            }
+            c->skip = p[8];
+            c->pos += 9;
+            break;
+          }
+          default:
+          {
+            return BENCH_Fail(c, "Unknown message type");
+          }
+        }
+        break;
+      }
+      case BENCH_RECT:
+      {
+        if (avail < 12)
+        {
+          return 0;
+        }
+        c->pos += 12;
+        if (BENCH_StartRect(c, p) < 0)
+        {
+          return -1;
+        }
+        break;
+      }
+      case BENCH_RRE:
+      {
+        if (avail < 4 + c->bpp)
+        {
+          return 0;
+        }
+        c->skip = RFB32P(p) * (c->bpp + 8);
+        c->pos += 4 + c->bpp;
+        c->state = BENCH_RECT_DONE;
+        break;
+      }
+      case BENCH_ZRLE:
+      {
+        if (avail < 4)
+        {
+          return 0;
+        }
+        c->skip = RFB32P(p);
+        if (c->skip < 0 || c->skip > c->r.w * c->r.h * 4 + 1024*1024)
+        {
+          return BENCH_Fail(c, "Bad ZRLE length");
+        }
+        c->pos += 4;
+        c->state = BENCH_RECT_DONE;
+        break;
+      }
+      case BENCH_HEXTILE:
+      {
+        int across = (c->r.w + 15) / 16;
+        int tw = Min(16, c->r.w - (c->tile % across) * 16);
+        int th = Min(16, c->r.h - (c->tile / across) * 16);
+        U8 sub = p[0];
+        if (sub & ~0x1F)
+        {
+          return BENCH_Fail(c, "Bad Hextile subencoding");
+        }
+        if (sub & 1) // Raw.
+        {
+          c->skip = tw * th * c->bpp;
+          need = 1;
+        }
+        else
+        {
+          need = 1 + ((sub & 2) ? c->bpp : 0) + ((sub & 4) ? c->bpp : 0) + ((sub & 8) ? 1 : 0);
+          if (avail < need)
+          {
+            return 0;
+          }
+          if (sub & 8)
+          {
+            c->skip = p[need-1] * (2 + ((sub & 16) ? c->bpp : 0));
+          }
+        }
+        c->pos += need;
+        if (++c->tile == across * ((c->r.h + 15) / 16))
+        {
+          c->state = BENCH_RECT_DONE;
+        }
+        break;
+      }
+      case BENCH_TIGHT:
+      {
+        int comp = p[0] >> 4;
+        int colours = 0;
+        if (comp == 8) // Fill.
+        {
+          c->skip = c->tpixel;
+          c->pos += 1;
+          c->state = BENCH_RECT_DONE;
+          break;
+        }
+        if (comp == 9) // JPEG.
+        {
+          c->pos += 1;
+          c->state = BENCH_TIGHT_LENGTH;
+          break;
+        }
+        if (comp > 9)
+        {
+          return BENCH_Fail(c, "Bad Tight compression control");
+        }
+        // Basic, maybe with a filter (and the palette filter's palette):
+        need = (comp & 4) ? 2 : 1;
+        if (avail < need)
+        {
+          return 0;
+        }
+        c->tight_size = c->r.w * c->r.h * c->tpixel;
+        if (need == 2 && p[1] == 1)
+        {
+          if (avail < 3)
+          {
+            return 0;
+          }
+          colours = p[2] + 1;
+          c->skip = colours * c->tpixel;
+          c->tight_size = (colours == 2) ? (c->r.w + 7) / 8 * c->r.h : c->r.w * c->r.h;
+          need = 3;
+        }
+        else if (need == 2 && p[1] > 2)
+        {
+          return BENCH_Fail(c, "Bad Tight filter");
+        }
+        c->pos += need;
+        c->state = BENCH_TIGHT_DATA;
+        break;
+      }
+      case BENCH_TIGHT_DATA:
+      {
+        // Too little to be worth compressing is sent as it is:
+        if (c->tight_size < 12)
+        {
+          c->skip = c->tight_size;
+          c->state = BENCH_RECT_DONE;
+        }
+        else
+        {
+          c->state = BENCH_TIGHT_LENGTH;
+        }
+        break;
+      }
+      case BENCH_TIGHT_LENGTH:
+      {
+        n = BENCH_CompactLength(p, avail, &c->skip);
+        if (!n)
+        {
+          return 0;
+        }
+        c->pos += n;
+        c->state = BENCH_RECT_DONE;
+        break;
+      }
+    }
+  }
+}
+
+
+// Reads all there is, and parses it:
+static int BENCH_Read(bench_conn *c)
+{
+  int got;
+  while (1)
+  {
+    if (c->pos)
+    {
+      memmove(c->buffer, c->buffer + c->pos, c->len - c->pos);
+      c->len -= c->pos;
+      c->pos = 0;
+    }
+    got = recv(c->sock, c->buffer + c->len, BENCH_BUFFER - c->len, 0);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return 0;
+    }
+    if (got <= 0)
+    {
+      return BENCH_Fail(c, "Server closed the connection");
+    }
+    c->len += got;
+    gBytes += got;
+    if (BENCH_Parse(c) < 0)
+    {
+      return -1;
+    }
+  }
+}
+
+
+static int BENCH_CompareInts(const void *a, const void *b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+
+// Nearest-rank percentile of the (sorted) latencies, in milliseconds:
+static double BENCH_Percentile(double q)
+{
+  long long rank = (long long)(q * gUpdates + 0.999999);
+  return gLatencies[Max(rank, 1) - 1] / 1000.0;
+}
+
+
+static void Usage(char *name)
+{
+  printf(
+    "Usage: %s [-c CONNECTIONS] [-d SECONDS] [-r RATE] [-p RATE] [-b BUTTONS] [-e ENCODINGS] [-f] [-s STALLED] [-P PORT]\n"
+    "  -c  Connections to open (default: %d)\n"
+    "  -d  How long to run for, in seconds (default: %d)\n"
+    "  -r  Update requests per second on each connection (default: 0, which\n"
+    "      asks again as soon as each update has arrived)\n"
+    "  -p  Pointer events per second on each connection (default: %d; 0 for none)\n"
+    "  -b  Buttons held while the pointer moves (default: %d, which paints)\n"
+    "  -e  Encodings to ask for, in order of preference (default: 16,1,0)\n"
+    "  -f  Ask for full updates rather than incremental ones\n"
+    "  -s  Connections to open that stall (default: 0; see rfbbench.c)\n"
+    "  -P  Server port on this machine (default: %d)\n",
+    name, gConnCount, gSeconds, gPointerRate, gButtons, BENCH_PORT);
+}
+
+
+static void BENCH_ParseEncodings(const char *list)
+{
+  char *end;
+  gEncodingCount = 0;
+  while (*list && gEncodingCount < ENC_MAX_PREFS)
+  {
+    gEncodings[gEncodingCount++] = strtol(list, &end, 10);
+    if (end == list || (*end && *end != ','))
+    {
+      printf("Invalid encoding list: %s\n", list);
+      exit(1);
+    }
+    list = *end ? end + 1 : end;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  struct epoll_event ev, events[BENCH_MAX_EVENTS];
+  bench_conn *conns;
+  bench_conn *stalled;
+  long long start, now, end, next_report, next_stall;
+  long long last_updates = 0, last_bytes = 0;
+  int open = 0, stalled_count = 0;
+  int epfd, opt, i, n, wait_ms;
+
+  while ((opt = getopt(argc, argv, "c:d:r:p:b:e:fs:P:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': gConnCount = atoi(optarg); break;
+      case 'd': gSeconds = atoi(optarg); break;
+      case 'r': gRequestRate = atoi(optarg); break;
+      case 'p': gPointerRate = atoi(optarg); break;
+      case 'b': gButtons = atoi(optarg); break;
+      case 'e': BENCH_ParseEncodings(optarg); break;
+      case 'f': gIncremental = 0; break;
+      case 's': gStalled = atoi(optarg); break;
+      case 'P': gPort = atoi(optarg); break;
+      default:
+      {
+        Usage(argv[0]);
+        exit(1);
+      }
+    }
+  }
+  if (gConnCount <= 0 || gSeconds <= 0 || gStalled < 0 || gRequestRate < 0 || gRequestRate > 1000000
+    || gPointerRate < 0 || gPointerRate > 1000000 || gPort <= 0 || gPort > 0xFFFF)
+  {
+    Usage(argv[0]);
+    exit(1);
+  }
+
+  conns = calloc(gConnCount, sizeof(bench_conn));
+  stalled = calloc(Max(gStalled, 1), sizeof(bench_conn));
+  epfd = epoll_create1(0);
+  if (!conns || !stalled || epfd < 0)
+  {
+    exit(1);
+  }
+  for (i=0; i<gConnCount; ++i)
+  {
+    if (BENCH_Connect(&conns[i], i, 0) < 0)
+    {
+      exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &conns[i];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].sock, &ev) < 0)
+    {
+      printf("Failed to add socket to epoll set\n");
+      exit(1);
+    }
+  }
+  open = gConnCount;
+  printf("%d connection(s) to port %d, %dx%d at %d bytes per pixel\n",
+    gConnCount, gPort, conns[0].width, conns[0].height, conns[0].bpp);
+
+  start = BENCH_Now();
+  end = start + gSeconds * 1000000LL;
+  next_report = start + 1000000;
+  next_stall = start + BENCH_STALL_MS * 1000;
+  for (i=0; i<gConnCount; ++i)
+  {
+    conns[i].next_request = start;
+    conns[i].next_pointer = start;
+  }
+  while (open && (now = BENCH_Now()) < end)
+  {
+    long long next = Min(end, next_report);
+    if (now >= next_report)
+    {
+      printf("%3d s: %lld updates/s, %.1f MB/s\n", (int)((now - start) / 1000000),
+        gUpdates - last_updates, (gBytes - last_bytes) / 1e6);
+      last_updates = gUpdates;
+      last_bytes = gBytes;
+      next_report += 1000000;
+    }
+    // Stalled connections, while the others are busy painting (so that
+    // each is sent a different frame):
+    if (stalled_count < gStalled && now >= next_stall)
+    {
+      if (BENCH_Connect(&stalled[stalled_count], stalled_count, 1) < 0)
+      {
+        exit(1);
+      }
+      ++stalled_count;
+      next_stall += BENCH_STALL_MS * 1000;
+    }
+    if (stalled_count < gStalled)
+    {
+      next = Min(next, next_stall);
+    }
+    // Whatever is due: requests (at most one outstanding) and pointer moves.
+    // If we've fallen behind, we skip ahead rather than catch up:
+    for (i=0; i<gConnCount; ++i)
+    {
+      bench_conn *c = &conns[i];
+      if (c->closed)
+      {
+        continue;
+      }
+      if (gStalled && c->requested && now - c->requested > BENCH_STARVED_S * 1000000LL)
+      {
+        BENCH_Fail(c, "Waited too long for an update");
+        c->closed = 1;
+      }
+      if (gRequestRate && now >= c->next_request && !c->closed)
+      {
+        if (!c->requested && BENCH_Request(c, gIncremental, now) < 0)
+        {
+          c->closed = 1;
+        }
+        c->next_request = Max(c->next_request + 1000000 / gRequestRate, now);
+      }
+      if (gPointerRate && now >= c->next_pointer && c->warm && !c->closed)
+      {
+        if (BENCH_Pointer(c) < 0)
+        {
+          c->closed = 1;
+        }
+        c->next_pointer = Max(c->next_pointer + 1000000 / gPointerRate, now);
+      }
+      if (gRequestRate)
+      {
+        next = Min(next, c->next_request);
+      }
+      if (gPointerRate)
+      {
+        next = Min(next, c->next_pointer);
+      }
+      if (c->closed)
+      {
+        close(c->sock);
+        --open;
+      }
+    }
+    if (gStalled)
+    {
+      next = Min(next, now + 100000); // To notice waits that go on too long.
+    }
+    wait_ms = (int)Max((next - BENCH_Now() + 999) / 1000, 0);
+    n = epoll_wait(epfd, events, BENCH_MAX_EVENTS, wait_ms);
+    for (i=0; i<n; ++i)
+    {
+      bench_conn *c = events[i].data.ptr;
+      if (!c->closed && BENCH_Read(c) < 0)
+      {
+        c->closed = 1;
+        close(c->sock);
+        --open;
+      }
+    }
+  }
+  now = BENCH_Now();
+  for (i=0; i<stalled_count; ++i)
+  {
+    close(stalled[i].sock);
+  }
+
+  printf("Updates:  %lld (%.1f/s)\n", gUpdates, gUpdates * 1e6 / (now - start));
+  printf("Bytes:    %lld (%.2f MB/s)\n", gBytes, gBytes / (double)(now - start));
+  if (gUpdates)
+  {
+    qsort(gLatencies, gUpdates, sizeof(int), BENCH_CompareInts);
+    printf("Latency:  p50 %.2f ms, p99 %.2f ms, p999 %.2f ms (max %.2f ms)\n",
+      BENCH_Percentile(0.5), BENCH_Percentile(0.99), BENCH_Percentile(0.999),
+      gLatencies[gUpdates-1] / 1000.0);
+  }
+  if (gErrors)
+  {
+    printf("Errors:   %d\n", gErrors);
+  }
+  return (gErrors || !gUpdates) ? 1 : 0;
+}
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm.h"
+
+// The damage ring works like the input ring (see input.c), except that
+// producers are in other processes, so its futex isn't private.
+
+#define SHM_MASK (SHM_DAMAGE_RING - 1)
+
+BUILD_BUG_ON(SHM_DAMAGE_RING & SHM_MASK);
+
+
+static size_t SHM_Size(const rfb_shm_header *h)
+{
+  return h->pixels_offset + (size_t)SHM_BUFFERS * h->buffer_size;
+}
+
+
+static void SHM_Futex(U32 *addr, int op, U32 value, const struct timespec *timeout)
+{
+  syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+
+// Creates the segment (replacing any left over from before) with the
+// framebuffer's geometry, for the framebuffer to keep its pixels in. If
+// 'name' is NULL, it's just mapped for this process.
+rfb_shm_header *SHM_Create(const char *name, int width, int height, const pixel_format *format)
+{
+  size_t offset = (sizeof(rfb_shm_header) + 4095) & ~(size_t)4095;
+  size_t buffer_size = ((size_t)width * height * sizeof(U32) + 4095) & ~(size_t)4095;
+  size_t size = offset + SHM_BUFFERS * buffer_size;
+  rfb_shm_header *h;
+  U32 i;
+  int fd = -1;
+  if (name)
+  {
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+      return NULL;
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+    }
+  }
+  h = mmap(NULL, size, PROT_READ | PROT_WRITE, name ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+  if (name)
+  {
+    close(fd);
+  }
+  if (h == MAP_FAILED)
+  {
+    if (name)
+    {
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+  h->version = SHM_VERSION;
+  h->width = width;
+  h->height = height;
+  h->stride = width;
+  h->pixels_offset = offset;
+  h->buffer_size = buffer_size;
+  h->format = *format;
+  for (i=0; i<SHM_DAMAGE_RING; ++i)
+  {
+    h->damage[i].seq = i;
+  }
+  // Last, so producers don't use it half set up:
+  __atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  return h;
+}
+
+
+void SHM_Destroy(const char *name, rfb_shm_header *h)
+{
+  munmap(h, SHM_Size(h));
+  if (name)
+  {
+    shm_unlink(name);
+  }
+}
+
+
+// Maps a segment the server created, for drawing into:
+rfb_shm_header *SHM_Open(const char *name)
+{
+  rfb_shm_header *h;
+  struct stat st;
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(rfb_shm_header))
+  {
+    close(fd);
+    return NULL;
+  }
+  h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED)
+  {
+    return NULL;
+  }
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+    || h->version != SHM_VERSION || SHM_Size(h) > (size_t)st.st_size)
+  {
+    munmap(h, st.st_size);
+    return NULL;
+  }
+  return h;
+}
+
+
+void SHM_Close(rfb_shm_header *h)
+{
+  munmap(h, SHM_Size(h));
+}
+
+
+// Adds a rectangle to 'list', or if it's full, makes its first rectangle
+// cover everything:
+static void SHM_AddRect(rfb_shm_rects *list, int x, int y, int x1, int y1)
+{
+  U32 i;
+  if (list->count < SHM_FRAME_RECTS)
+  {
+    i = list->count++;
+  }
+  else
+  {
+    for (i=0; i<list->count; ++i)
+    {
+      x = Min(x, list->rects[i].x);
+      y = Min(y, list->rects[i].y);
+      x1 = Max(x1, list->rects[i].x + list->rects[i].w);
+      y1 = Max(y1, list->rects[i].y + list->rects[i].h);
+    }
+    i = 0;
+    list->count = 1;
+  }
+  list->rects[i].x = x;
+  list->rects[i].y = y;
+  list->rects[i].w = x1 - x;
+  list->rects[i].h = y1 - y;
+}
+
+
+// Tidies up after a producer that died drawing a frame, which may have
+// left any buffer but the front one half drawn, their lists of what they've
+// missed half updated, or its frame the front one without posting its
+// damage. So they all catch up in full, and the server is told to treat the
+// whole screen as changed.
+static void SHM_Recover(rfb_shm_header *h, U32 front)
+{
+  U32 b;
+  for (b=0; b<SHM_BUFFERS; ++b)
+  {
+    h->stale[b].count = 0;
+    if (b != front)
+    {
+      SHM_AddRect(&h->stale[b], 0, 0, h->width, h->height);
+    }
+  }
+  h->drawn.count = 0;
+  __atomic_store_n(&h->overflow, 1, __ATOMIC_RELAXED);
+}
+
+
+// Starts drawing a frame, returning the buffer to draw it into. That's
+// already up to date with the front buffer, so only what changes has to be
+// drawn. Returns NULL if another producer is drawing a frame (or, briefly,
+// if the server is still reading both older frames).
+U32 *SHM_BeginFrame(rfb_shm_header *h)
+{
+  U32 self = (U32)getpid();
+  U32 owner = 0;
+  U32 front, back, count, i;
+  const U32 *src;
+  U32 *dst;
+  int y;
+  if (!__atomic_compare_exchange_n(&h->drawing, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    // Unless it has died since it started:
+    if (((pid_t)owner > 0 && (kill((pid_t)owner, 0) == 0 || errno != ESRCH))
+      || !__atomic_compare_exchange_n(&h->drawing, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      return NULL;
+    }
+    SHM_Recover(h, __atomic_load_n(&h->front, __ATOMIC_SEQ_CST));
+  }
+  // The server marks a buffer as read before checking it's still the front
+  // one, and we changed the front before checking what's read, so we can't
+  // both miss each other. Whoever else maps the segment can write anything
+  // to it, though:
+  front = __atomic_load_n(&h->front, __ATOMIC_SEQ_CST);
+  if (front >= SHM_BUFFERS)
+  {
+    __atomic_store_n(&h->drawing, 0, __ATOMIC_RELEASE);
+    return NULL;
+  }
+  for (back=0; back<SHM_BUFFERS; ++back)
+  {
+    if (back != front && !__atomic_load_n(&h->readers[back], __ATOMIC_SEQ_CST))
+    {
+      break;
+    }
+  }
+  if (back == SHM_BUFFERS)
+  {
+    __atomic_store_n(&h->drawing, 0, __ATOMIC_RELEASE);
+    return NULL;
+  }
+  // Catch up with the frames drawn since this buffer last was:
+  src = SHM_BUFFER(h, front);
+  dst = SHM_BUFFER(h, back);
+  count = Min(h->stale[back].count, SHM_FRAME_RECTS);
+  for (i=0; i<count; ++i)
+  {
+    int x = h->stale[back].rects[i].x;
+    int w = h->stale[back].rects[i].w;
+    int y0 = h->stale[back].rects[i].y;
+    int y1 = Min(y0 + h->stale[back].rects[i].h, (int)h->height);
+    if (x + w > (int)h->width)
+    {
+      continue;
+    }
+    for (y=y0; y<y1; ++y)
+    {
+      memcpy(dst + y*h->stride + x, src + y*h->stride + x, w * sizeof(U32));
+    }
+  }
+  h->stale[back].count = 0;
+  h->drawn.count = 0;
+  h->back = back;
+  return dst;
+}
+
+
+// Says a rectangle of the frame was drawn (clipped to the screen):
+void SHM_Post(rfb_shm_header *h, int x, int y, int w, int hh)
+{
+  int x1 = Min(x + w, (int)h->width);
+  int y1 = Min(y + hh, (int)h->height);
+  x = Max(x, 0);
+  y = Max(y, 0);
+  if (x1 > x && y1 > y)
+  {
+    SHM_AddRect(&h->drawn, x, y, x1, y1);
+  }
+}
+
+
+// Puts a rectangle in the damage ring. Returns -1 if it was full, in which
+// case the server is told to treat the whole screen as changed instead.
+static int SHM_Push(rfb_shm_header *h, int x, int y, int w, int hh)
+{
+  U32 pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+  rfb_shm_damage *slot;
+  int diff;
+  while (1)
+  {
+    slot = &h->damage[pos & SHM_MASK];
+    diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&h->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+    }
+    else if (diff < 0)
+    {
+      __atomic_store_n(&h->overflow, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    else
+    {
+      pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->x = x;
+  slot->y = y;
+  slot->w = w;
+  slot->h = hh;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+// Finishes the frame: makes it the front buffer, then posts what was drawn
+// to the damage ring, waking the server if it's asleep. Returns -1 if the
+// ring was full (see SHM_Push()).
+int SHM_EndFrame(rfb_shm_header *h)
+{
+  rfb_shm_rects *drawn = &h->drawn;
+  int result = 0;
+  U32 i, b;
+  if (drawn->count)
+  {
+    for (b=0; b<SHM_BUFFERS; ++b)
+    {
+      for (i=0; b != h->back && i<drawn->count; ++i)
+      {
+        SHM_AddRect(&h->stale[b], drawn->rects[i].x, drawn->rects[i].y,
+          drawn->rects[i].x + drawn->rects[i].w, drawn->rects[i].y + drawn->rects[i].h);
+      }
+    }
+    // Damage is only posted once what it refers to is there to be read:
+    __atomic_store_n(&h->front, h->back, __ATOMIC_SEQ_CST);
+    for (i=0; i<drawn->count; ++i)
+    {
+      if (SHM_Push(h, drawn->rects[i].x, drawn->rects[i].y, drawn->rects[i].w, drawn->rects[i].h) < 0)
+      {
+        result = -1;
+        break;
+      }
+    }
+    __atomic_add_fetch(&h->generation, 1, __ATOMIC_RELAXED);
+    drawn->count = 0;
+  }
+  __atomic_store_n(&h->drawing, 0, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h->turn_waiters, __ATOMIC_SEQ_CST))
+  {
+    SHM_Futex(&h->drawing, FUTEX_WAKE, 0x7FFFFFFF, NULL);
+  }
+  if (__atomic_exchange_n(&h->waiting, 0, __ATOMIC_SEQ_CST))
+  {
+    SHM_Futex(&h->waiting, FUTEX_WAKE, 1, NULL);
+  }
+  return result;
+}
+
+
+// Waits for another go at SHM_BeginFrame(), after it returned NULL: until
+// the producer drawing a frame finishes it (or might have died, see
+// SHM_OWNER_CHECK_MS), or if nobody is, for a moment while the server
+// reads.
+void SHM_WaitTurn(rfb_shm_header *h)
+{
+  struct timespec timeout = { SHM_OWNER_CHECK_MS / 1000, (SHM_OWNER_CHECK_MS % 1000) * 1000000L };
+  struct timespec pause = { 0, SHM_READ_PAUSE_US * 1000L };
+  U32 owner;
+  __atomic_add_fetch(&h->turn_waiters, 1, __ATOMIC_SEQ_CST);
+  owner = __atomic_load_n(&h->drawing, __ATOMIC_SEQ_CST);
+  if (owner)
+  {
+    SHM_Futex(&h->drawing, FUTEX_WAIT, owner, &timeout);
+  }
+  else
+  {
+    nanosleep(&pause, NULL);
+  }
+  __atomic_sub_fetch(&h->turn_waiters, 1, __ATOMIC_RELAXED);
+}
+
+
+// Takes a reference on the front buffer, for reading the latest frame from
+// (the server only). Producers leave it alone until SHM_Release(). Returns
+// -1 if the segment says the front buffer is one that doesn't exist.
+int SHM_AcquireFront(rfb_shm_header *h)
+{
+  U32 front = __atomic_load_n(&h->front, __ATOMIC_SEQ_CST);
+  while (1)
+  {
+    U32 now;
+    if (front >= SHM_BUFFERS)
+    {
+      return -1;
+    }
+    __atomic_add_fetch(&h->readers[front], 1, __ATOMIC_SEQ_CST);
+    now = __atomic_load_n(&h->front, __ATOMIC_SEQ_CST);
+    if (now == front)
+    {
+      return front;
+    }
+    // A producer may have started drawing into it before it saw our count:
+    __atomic_sub_fetch(&h->readers[front], 1, __ATOMIC_RELEASE);
+    front = now;
+  }
+}
+
+
+void SHM_Release(rfb_shm_header *h, int buffer)
+{
+  __atomic_sub_fetch(&h->readers[buffer], 1, __ATOMIC_RELEASE);
+}
+
+
+// Takes the next posted rectangle, if there is one (the server only):
+int SHM_Take(rfb_shm_header *h, rfb_rect *r)
+{
+  rfb_shm_damage *slot = &h->damage[h->head & SHM_MASK];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != h->head + 1)
+  {
+    return 0;
+  }
+  r->x = slot->x;
+  r->y = slot->y;
+  r->w = slot->w;
+  r->h = slot->h;
+  __atomic_store_n(&slot->seq, h->head + SHM_DAMAGE_RING, __ATOMIC_RELEASE);
+  ++h->head;
+  return 1;
+}
+
+
+// Whether a producer found the ring full since we last asked:
+int SHM_Overflowed(rfb_shm_header *h)
+{
+  return __atomic_exchange_n(&h->overflow, 0, __ATOMIC_RELAXED);
+}
+
+
+// Sleeps until something is posted, or 'timeout_ms' passes (the server only).
+void SHM_Wait(rfb_shm_header *h, int timeout_ms)
+{
+  struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  rfb_shm_damage *slot = &h->damage[h->head & SHM_MASK];
+  __atomic_store_n(&h->waiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != h->head + 1
+    && !__atomic_load_n(&h->overflow, __ATOMIC_SEQ_CST))
+  {
+    SHM_Futex(&h->waiting, FUTEX_WAIT, 1, &timeout);
+  }
+  __atomic_store_n(&h->waiting, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,130 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+
+#include "rfb.h"
+
+// The framebuffer, shared with other processes (POSIX shared memory, -m) so
+// they can draw into it directly. The segment starts with a header, then
+// the pixels. A producer maps it, draws a frame, and posts the rectangles it
+// drew. That takes no locks and no system calls, unless the server is asleep
+// waiting for damage, in which case it takes one futex wake-up. The server
+// then sends what changed like anything else drawn into the framebuffer.
+//
+// Producers never draw where the server reads. There are SHM_BUFFERS
+// copies of the pixels: the front buffer is the latest complete frame, and
+// the server only ever copies from that. A producer draws into a back
+// buffer (first brought up to date with the front one), and when it's done,
+// makes it the front buffer by storing its index. The server counts its
+// readers of each buffer, and with three there's always one that's neither
+// the front nor being read, so neither side waits for the other. Producers
+// do take turns: one frame is drawn at a time.
+//
+// Producers only need this header and shm.c:
+//
+//   rfb_shm_header *h = SHM_Open("/rfb");
+//   U32 *pixels = SHM_BeginFrame(h);
+//   ... draw into pixels[y*h->stride + x] ...
+//   SHM_Post(h, x, y, w, h);
+//   SHM_EndFrame(h);
+//
+// SHM_BeginFrame() returns NULL (try again later) if another producer is
+// drawing a frame; SHM_WaitTurn() waits for it to finish. A producer that
+// dies part way through a frame doesn't hold the others up for good: the
+// next to try checks whether it's still running, and if not, takes over.
+
+#define SHM_MAGIC    0x53424652 // "RFBS"
+#define SHM_VERSION  3
+
+// How often SHM_WaitTurn() wakes to check the producer it's waiting for is
+// still alive, and how long it pauses when it's the server that's in the
+// way (which only reads for as long as a copy takes):
+#define SHM_OWNER_CHECK_MS  100
+#define SHM_READ_PAUSE_US   50
+
+// Damage rectangles the ring holds (a power of two). If producers get this
+// far ahead of the server, the whole screen is treated as changed:
+#define SHM_DAMAGE_RING 1024
+
+#define SHM_BUFFERS 3
+
+// Rectangles a frame (or what a buffer is missing) can list before they're
+// merged into one that covers them all:
+#define SHM_FRAME_RECTS 64
+
+typedef struct {
+  U32 seq; // Whose turn the slot is (as in input.c's ring).
+  U16 x;
+  U16 y;
+  U16 w;
+  U16 h;
+} rfb_shm_damage;
+
+typedef struct {
+  U32 count;
+  struct {
+    U16 x;
+    U16 y;
+    U16 w;
+    U16 h;
+  } rects[SHM_FRAME_RECTS];
+} rfb_shm_rects;
+
+typedef struct {
+  // Set by the server when it creates the segment; read-only after that:
+  U32 magic;
+  U32 version;
+  U32 width;
+  U32 height;
+  U32 stride; // Pixels per row.
+  U32 pixels_offset; // Bytes from the start of the segment to the first buffer.
+  U32 buffer_size; // Bytes from one buffer to the next.
+  pixel_format format; // Always 32bpp 0x00RRGGBB, in host byte order.
+  // Bumped by every frame, so anyone can cheaply tell whether anything has
+  // been drawn since they last looked:
+  U32 generation;
+  // Set by a producer that found the ring full:
+  U32 overflow;
+  // Producers claim slots at 'tail'; the server takes them at 'head':
+  U32 tail __attribute__((aligned(64)));
+  U32 head __attribute__((aligned(64)));
+  U32 waiting; // Futex the server sleeps on while there's no damage.
+  // The latest complete frame, and how many server threads are reading each
+  // buffer:
+  U32 front __attribute__((aligned(64)));
+  U32 readers[SHM_BUFFERS];
+  // The process ID of the producer drawing a frame (0 if none is), and how
+  // many others are waiting for it to finish:
+  U32 drawing __attribute__((aligned(64)));
+  U32 turn_waiters;
+  // Only touched by the producer drawing a frame: the buffer it's drawing
+  // into, what it's drawn so far, and what each buffer has missed since it
+  // was last drawn into:
+  U32 back;
+  rfb_shm_rects drawn;
+  rfb_shm_rects stale[SHM_BUFFERS];
+  rfb_shm_damage damage[SHM_DAMAGE_RING] __attribute__((aligned(64)));
+} rfb_shm_header;
+
+#define SHM_BUFFER(zzh,zzi) ((U32*)((U8*)(zzh) + (zzh)->pixels_offset + (size_t)(zzi) * (zzh)->buffer_size))
+
+// Producers:
+rfb_shm_header *SHM_Open(const char *name);
+U32 *SHM_BeginFrame(rfb_shm_header *h);
+void SHM_WaitTurn(rfb_shm_header *h);
+void SHM_Post(rfb_shm_header *h, int x, int y, int w, int hh);
+int SHM_EndFrame(rfb_shm_header *h);
+void SHM_Close(rfb_shm_header *h);
+
+// The server. A segment with no name is private to the process (for the
+// server's own drawing, when the framebuffer isn't shared):
+rfb_shm_header *SHM_Create(const char *name, int width, int height, const pixel_format *format);
+void SHM_Destroy(const char *name, rfb_shm_header *h);
+int SHM_AcquireFront(rfb_shm_header *h);
+void SHM_Release(rfb_shm_header *h, int buffer);
+int SHM_Take(rfb_shm_header *h, rfb_rect *r);
+int SHM_Overflowed(rfb_shm_header *h);
+void SHM_Wait(rfb_shm_header *h, int timeout_ms);
+
+#endif // SHM_H
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+// A sample producer for the shared framebuffer (see shm.h): bounces a
+// square around the screen, a frame at a time, drawing straight into the
+// server's back buffer and posting what it changed. With -a, it abandons
+// its last frame part way through, as if it had crashed, so you can check
+// that others carry on drawing.
+//
+// Usage: shmdraw.elf [-a] NAME [SECONDS]
+
+#define SIZE 40
+#define FRAME_US (1000000/60)
+
+
+static void Fill(rfb_shm_header *h, U32 *pixels, int x, int y, int w, int hh, U32 colour)
+{
+  int i, j;
+  for (j=y; j<y+hh; ++j)
+  {
+    for (i=x; i<x+w; ++i)
+    {
+      pixels[j*h->stride + i] = colour;
+    }
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  rfb_shm_header *h;
+  U32 *pixels;
+  int x = 0, y = 0, dx = 3, dy = 2;
+  int abandon = 0;
+  int frames, i, opt;
+  while ((opt = getopt(argc, argv, "a")) != -1)
+  {
+    if (opt != 'a')
+    {
+      printf("Usage: %s [-a] NAME [SECONDS]\n", argv[0]);
+      return 1;
+    }
+    abandon = 1;
+  }
+  if (optind >= argc)
+  {
+    printf("Usage: %s [-a] NAME [SECONDS]\n", argv[0]);
+    return 1;
+  }
+  h = SHM_Open(argv[optind]);
+  if (!h)
+  {
+    printf("Can't open shared framebuffer %s\n", argv[optind]);
+    return 1;
+  }
+  if ((int)h->width <= SIZE || (int)h->height <= SIZE)
+  {
+    printf("Framebuffer too small\n");
+    return 1;
+  }
+  frames = (optind + 1 < argc ? atoi(argv[optind + 1]) : 10) * 1000000 / FRAME_US;
+  for (i=0; i<frames; ++i)
+  {
+    // Rub out the square where it was, and draw it where it is now. If
+    // another producer is drawing, skip this frame:
+    if (!(pixels = SHM_BeginFrame(h)))
+    {
+      usleep(FRAME_US);
+      continue;
+    }
+    Fill(h, pixels, x, y, SIZE, SIZE, 0x000000);
+    SHM_Post(h, x, y, SIZE, SIZE);
+    if (abandon && i == frames-1)
+    {
+      return 0;
+    }
+    x += dx;
+    y += dy;
+    if (x < 0 || x + SIZE > (int)h->width)
+    {
+      dx = -dx;
+      x += 2*dx;
+    }
+    if (y < 0 || y + SIZE > (int)h->height)
+    {
+      dy = -dy;
+      y += 2*dy;
+    }
+    Fill(h, pixels, x, y, SIZE, SIZE, ((i*7) & 0xFF) << 16 | 0x00FF00);
+    SHM_Post(h, x, y, SIZE, SIZE);
+    SHM_EndFrame(h);
+    usleep(FRAME_US);
+  }
+  SHM_Close(h);
+  return 0;
+}
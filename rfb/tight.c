@@ -0,0 +1,624 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <zlib.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "encode.h"
+
+// Tight: each rectangle is sent as a solid fill, as JPEG, or run through a
+// filter (copy, palette or gradient) and then one of four zlib streams that
+// live as long as the connection. Which one depends on what's in it:
+//
+// - One colour: fill.
+// - Up to 256 colours: palette (a bitmap for two colours, else a byte per
+//   pixel).
+// - More than that, and smooth (photos, video): JPEG if the client sent a
+//   quality level, otherwise the gradient filter. Areas so smooth they're
+//   almost perfectly predictable (synthetic gradients) always use that.
+// - Anything else: copy.
+
+#define TIGHT_MIN_TO_COMPRESS 12 // Filtered data smaller than this isn't compressed.
+#define TIGHT_MAX_PALETTE     256
+
+// Compression control byte. The low nibble resets streams, which we only
+// need for rectangles shared between connections (see enccache.c):
+#define TIGHT_EXPLICIT_FILTER 0x40
+#define TIGHT_FILL            0x80
+#define TIGHT_JPEG            0x90
+
+#define TIGHT_FILTER_COPY     0
+#define TIGHT_FILTER_PALETTE  1
+#define TIGHT_FILTER_GRADIENT 2
+
+enum {
+  TIGHT_STREAM_FULL,
+  TIGHT_STREAM_MONO,
+  TIGHT_STREAM_INDEXED,
+  TIGHT_STREAM_GRADIENT,
+  TIGHT_STREAMS
+};
+
+// Smoothness is the average error (per channel, 0-255) in predicting each
+// pixel from its neighbours, as the gradient filter does. Photos and video
+// come out low; text and line art high:
+#define TIGHT_JPEG_MAX_ERROR      40
+#define TIGHT_JPEG_MIN_ERROR      2  // Below this, gradient does better losslessly.
+#define TIGHT_GRADIENT_MAX_ERROR  12
+#define TIGHT_SAMPLE_ROWS         16 // Rows sampled for it.
+
+// Smallest rectangle worth JPEG's overhead (and its artefacts):
+#define TIGHT_JPEG_MIN_PIXELS 4096
+
+// JPEG quality for each of the client's quality levels (0-9):
+static const int gJPEGQuality[10] = { 15, 25, 35, 45, 55, 65, 75, 80, 88, 95 };
+
+// Colour lookup, for palette rectangles:
+#define TIGHT_HASH_SIZE 1024
+#define TIGHT_HASH(zzv) ((U32)((zzv) * 0x9E3779B1u) >> 22)
+
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf fail;
+} tight_jpeg_error;
+
+// Compresses into the encoder's scratch space, growing it as needed:
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  rfb_encstate *es;
+  U8 *data; // What's been compressed so far.
+  int size;
+} tight_jpeg_dest;
+
+typedef struct rfb_tight {
+  z_stream zs[TIGHT_STREAMS];
+  int level[TIGHT_STREAMS]; // -1 until the stream is set up.
+  int reset; // Streams (bits) the client has had data from elsewhere on.
+  int have_jpeg;
+  struct jpeg_compress_struct jpeg;
+  tight_jpeg_error jpeg_error;
+  tight_jpeg_dest jpeg_dest;
+} rfb_tight;
+
+typedef struct {
+  U32 colours[TIGHT_MAX_PALETTE];
+  int count;
+  U32 keys[TIGHT_HASH_SIZE];
+  U16 index[TIGHT_HASH_SIZE]; // Palette index + 1, or 0 if the slot is free.
+} tight_palette;
+
+// Full-colour pixels are sent as plain R, G, B to clients with 8 bits per
+// channel in 32bpp, and in the client's pixel format otherwise:
+static int TIGHT_Is24(const rfb_translator *t)
+{
+  return t->format.true_colour && t->format.bpp == 32 && t->format.depth == 24
+    && t->r_max == 255 && t->g_max == 255 && t->b_max == 255;
+}
+
+
+static U8 *TIGHT_PutPixel(rfb_encstate *es, int is24, U32 pixel, U8 *p)
+{
+  if (is24)
+  {
+    *p++ = FB_R(pixel);
+    *p++ = FB_G(pixel);
+    *p++ = FB_B(pixel);
+    return p;
+  }
+  return p + ENC_PutPixel(es, pixel, p);
+}
+
+
+static int TIGHT_PutLength(rfb_outbuf *out, int len)
+{
+  U8 bytes[3];
+  int count = 1;
+  bytes[0] = len & 0x7F;
+  if (len > 0x7F)
+  {
+    bytes[0] |= 0x80;
+    bytes[count++] = (len >> 7) & 0x7F;
+    if (len > 0x3FFF)
+    {
+      bytes[1] |= 0x80;
+      bytes[count++] = (len >> 14) & 0xFF;
+    }
+  }
+  return OUT_Bytes(out, bytes, count);
+}
+
+
+// Counts the colours in 'r' into 'pal', giving up once there are more than
+// the palette can hold. Returns how many it found (up to TIGHT_MAX_PALETTE+1).
+static int TIGHT_CountColours(const rfb_frame *frame, const rfb_rect *r, tight_palette *pal)
+{
+  U32 prev = ~*FB_PIXEL_PTR(frame, r->x, r->y);
+  int x, y;
+  memset(pal->index, 0, sizeof(pal->index));
+  pal->count = 0;
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    for (x=0; x<r->w; ++x)
+    {
+      U32 pixel = row[x];
+      int slot;
+      if (pixel == prev)
+      {
+        continue;
+      }
+      prev = pixel;
+      for (slot=TIGHT_HASH(pixel); pal->index[slot]; slot=(slot+1) & (TIGHT_HASH_SIZE-1))
+      {
+        if (pal->keys[slot] == pixel)
+        {
+          break;
+        }
+      }
+      if (pal->index[slot])
+      {
+        continue;
+      }
+      if (pal->count == TIGHT_MAX_PALETTE)
+      {
+        return TIGHT_MAX_PALETTE+1;
+      }
+      pal->keys[slot] = pixel;
+      pal->index[slot] = pal->count + 1;
+      pal->colours[pal->count++] = pixel;
+    }
+  }
+  return pal->count;
+}
+
+
+static int TIGHT_PaletteIndex(const tight_palette *pal, U32 pixel)
+{
+  int slot = TIGHT_HASH(pixel);
+  while (pal->keys[slot] != pixel)
+  {
+    slot = (slot + 1) & (TIGHT_HASH_SIZE-1);
+  }
+  return pal->index[slot] - 1;
+}
+
+
+static int TIGHT_Predict(int left, int up, int up_left)
+{
+  int p = left + up - up_left;
+  return (p < 0) ? 0 : (p > 255) ? 255 : p;
+}
+
+
+// Average gradient-filter error per channel, over a sample of rows:
+static int TIGHT_Smoothness(const rfb_frame *frame, const rfb_rect *r)
+{
+  int step = Max((r->h - 1) / TIGHT_SAMPLE_ROWS, 1);
+  long error = 0;
+  long samples = 0;
+  int x, y;
+  for (y=1; y<r->h; y+=step)
+  {
+    const U32 *up = FB_PIXEL_PTR(frame, r->x, r->y+y-1);
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    for (x=1; x<r->w; ++x)
+    {
+      error += abs((int)FB_R(row[x]) - TIGHT_Predict(FB_R(row[x-1]), FB_R(up[x]), FB_R(up[x-1])));
+      error += abs((int)FB_G(row[x]) - TIGHT_Predict(FB_G(row[x-1]), FB_G(up[x]), FB_G(up[x-1])));
+      error += abs((int)FB_B(row[x]) - TIGHT_Predict(FB_B(row[x-1]), FB_B(up[x]), FB_B(up[x-1])));
+    }
+    samples += 3 * (r->w - 1);
+  }
+  return samples ? error / samples : 0;
+}
+
+
+// The compression control byte for data that will use 'stream'. Resets the
+// stream (ours, and the client's with the byte's reset bit) if the data
+// mustn't refer back to anything the client already has.
+static U8 TIGHT_Control(rfb_encstate *es, int stream)
+{
+  rfb_tight *t = es->tight;
+  if (!es->independent && !(t->reset & (1 << stream)))
+  {
+    return stream << 4;
+  }
+  if (t->level[stream] >= 0)
+  {
+    deflateReset(&t->zs[stream]);
+  }
+  t->reset &= ~(1 << stream);
+  return (stream << 4) | (1 << stream);
+}
+
+
+// Queues filtered data: as is if it's tiny, otherwise compressed through
+// stream 'id' (with its length first).
+static int TIGHT_Compress(rfb_encstate *es, int id, rfb_outbuf *out, U8 *data, int len)
+{
+  rfb_tight *t = es->tight;
+  int level = ENC_CompressLevel(es);
+  z_stream *zs;
+  int size, total = 0;
+  U8 *dst;
+  if (len < TIGHT_MIN_TO_COMPRESS)
+  {
+    return OUT_Bytes(out, data, len);
+  }
+  zs = &t->zs[id];
+  if (t->level[id] < 0)
+  {
+    if (deflateInit(zs, level) != Z_OK)
+    {
+      return -1;
+    }
+    t->level[id] = level;
+  }
+  size = deflateBound(zs, len) + 16;
+  dst = ENC_Scratch(es, size);
+  if (!dst)
+  {
+    return -1;
+  }
+  if (t->level[id] != level)
+  {
+    // The client asked for a different level. Changing it can flush a
+    // little, so it needs somewhere to put it:
+    zs->next_out = dst;
+    zs->avail_out = size;
+    deflateParams(zs, level, Z_DEFAULT_STRATEGY);
+    t->level[id] = level;
+    total = size - zs->avail_out;
+  }
+  zs->next_in = data;
+  zs->avail_in = len;
+  zs->next_out = dst + total;
+  zs->avail_out = size - total;
+  while (1)
+  {
+    if (deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+    {
+      return -1;
+    }
+    total = size - zs->avail_out;
+    if (zs->avail_out)
+    {
+      break;
+    }
+    dst = ARENA_Grow(es->arena, dst, size, size * 2);
+    if (!dst)
+    {
+      return -1;
+    }
+    zs->next_out = dst + total;
+    zs->avail_out = size;
+    size *= 2;
+  }
+  zs->next_out = NULL;
+  zs->avail_out = 0;
+  if (TIGHT_PutLength(out, total) < 0)
+  {
+    return -1;
+  }
+  return OUT_Bytes(out, dst, total);
+}
+
+
+static int TIGHT_EncodeFill(rfb_encstate *es, rfb_outbuf *out, int is24, U32 pixel)
+{
+  U8 *p = OUT_Reserve(out, 1 + 4);
+  U8 *start = p;
+  if (!p)
+  {
+    return -1;
+  }
+  *p++ = TIGHT_FILL;
+  p = TIGHT_PutPixel(es, is24, pixel, p);
+  OUT_Unreserve(out, 5 - (p - start));
+  return 0;
+}
+
+
+static int TIGHT_EncodePalette(rfb_encstate *es, rfb_outbuf *out, int is24, const rfb_rect *r,
+  const tight_palette *pal)
+{
+  const rfb_frame *frame = es->frame;
+  int mono = (pal->count == 2);
+  int row_bytes = mono ? (r->w + 7) / 8 : r->w;
+  int stream = mono ? TIGHT_STREAM_MONO : TIGHT_STREAM_INDEXED;
+  U8 *data = ENC_Scratch(es, row_bytes * r->h);
+  U8 *header = OUT_Reserve(out, 3 + TIGHT_MAX_PALETTE*4);
+  U8 *p = header;
+  U32 prev;
+  int index = 0;
+  int x, y, i;
+  if (!data || !header)
+  {
+    return -1;
+  }
+  *p++ = TIGHT_Control(es, stream) | TIGHT_EXPLICIT_FILTER;
+  *p++ = TIGHT_FILTER_PALETTE;
+  *p++ = pal->count - 1;
+  for (i=0; i<pal->count; ++i)
+  {
+    p = TIGHT_PutPixel(es, is24, pal->colours[i], p);
+  }
+  OUT_Unreserve(out, 3 + TIGHT_MAX_PALETTE*4 - (p - header));
+  prev = pal->colours[0];
+  for (y=0; y<r->h; ++y)
+  {
+    const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+    U8 *dst = data + y*row_bytes;
+    if (mono)
+    {
+      // A bit per pixel, MSB first, set for the second colour:
+      memset(dst, 0, row_bytes);
+      for (x=0; x<r->w; ++x)
+      {
+        dst[x >> 3] |= (row[x] != pal->colours[0]) << (7 - (x & 7));
+      }
+      continue;
+    }
+    for (x=0; x<r->w; ++x)
+    {
+      if (row[x] != prev)
+      {
+        prev = row[x];
+        index = TIGHT_PaletteIndex(pal, prev);
+      }
+      dst[x] = index;
+    }
+  }
+  return TIGHT_Compress(es, stream, out, data, row_bytes * r->h);
+}
+
+
+// Full colour, either as is (copy) or as the difference from what the
+// gradient filter predicts (24-bit pixels only):
+static int TIGHT_EncodeFull(rfb_encstate *es, rfb_outbuf *out, int is24, const rfb_rect *r, int gradient)
+{
+  const rfb_frame *frame = es->frame;
+  int bpp = is24 ? 3 : es->translator.bytes_per_pixel;
+  int stream = gradient ? TIGHT_STREAM_GRADIENT : TIGHT_STREAM_FULL;
+  U8 *data = ENC_Scratch(es, r->w * r->h * bpp);
+  U8 *p = data;
+  int x, y;
+  if (!data)
+  {
+    return -1;
+  }
+  if (gradient)
+  {
+    if (OUT_U8(out, TIGHT_Control(es, stream) | TIGHT_EXPLICIT_FILTER) < 0 || OUT_U8(out, TIGHT_FILTER_GRADIENT) < 0)
+    {
+      return -1;
+    }
+    for (y=0; y<r->h; ++y)
+    {
+      const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+      const U32 *up = y ? row - frame->stride : NULL;
+      for (x=0; x<r->w; ++x)
+      {
+        U32 left = x ? row[x-1] : 0;
+        U32 above = up ? up[x] : 0;
+        U32 above_left = (up && x) ? up[x-1] : 0;
+        *p++ = FB_R(row[x]) - TIGHT_Predict(FB_R(left), FB_R(above), FB_R(above_left));
+        *p++ = FB_G(row[x]) - TIGHT_Predict(FB_G(left), FB_G(above), FB_G(above_left));
+        *p++ = FB_B(row[x]) - TIGHT_Predict(FB_B(left), FB_B(above), FB_B(above_left));
+      }
+    }
+  }
+  else
+  {
+    if (OUT_U8(out, TIGHT_Control(es, stream)) < 0)
+    {
+      return -1;
+    }
+    for (y=0; y<r->h; ++y)
+    {
+      const U32 *row = FB_PIXEL_PTR(frame, r->x, r->y+y);
+      if (!is24)
+      {
+        PIX_TranslateRow(&es->translator, row, p, r->w);
+        p += r->w * bpp;
+        continue;
+      }
+      for (x=0; x<r->w; ++x)
+      {
+        *p++ = FB_R(row[x]);
+        *p++ = FB_G(row[x]);
+        *p++ = FB_B(row[x]);
+      }
+    }
+  }
+  return TIGHT_Compress(es, stream, out, data, p - data);
+}
+
+
+static void TIGHT_JPEGError(j_common_ptr cinfo)
+{
+  tight_jpeg_error *error = (tight_jpeg_error*)cinfo->err;
+  longjmp(error->fail, 1);
+}
+
+
+static void TIGHT_JPEGInitDest(j_compress_ptr cinfo)
+{
+  tight_jpeg_dest *dest = (tight_jpeg_dest*)cinfo->dest;
+  dest->size = Max(cinfo->image_width * cinfo->image_height / 4, 16*1024);
+  dest->data = ENC_Scratch(dest->es, dest->size);
+  if (!dest->data)
+  {
+    ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+  }
+  dest->pub.next_output_byte = dest->data;
+  dest->pub.free_in_buffer = dest->size;
+}
+
+
+static boolean TIGHT_JPEGGrowDest(j_compress_ptr cinfo)
+{
+  tight_jpeg_dest *dest = (tight_jpeg_dest*)cinfo->dest;
+  int used = dest->size;
+  dest->data = ARENA_Grow(dest->es->arena, dest->data, used, used * 2);
+  if (!dest->data)
+  {
+    ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+  }
+  dest->size = used * 2;
+  dest->pub.next_output_byte = dest->data + used;
+  dest->pub.free_in_buffer = used;
+  return TRUE;
+}
+
+
+static void TIGHT_JPEGTermDest(j_compress_ptr cinfo)
+{
+  (void)cinfo;
+}
+
+
+// Queues 'r' as JPEG. Returns -1 if that didn't work out (and nothing was
+// queued), so it can go out losslessly instead.
+static int TIGHT_EncodeJPEG(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  rfb_tight *t = es->tight;
+  const rfb_frame *frame = es->frame;
+  struct jpeg_compress_struct *jpeg = &t->jpeg;
+  int len;
+  int y;
+  if (!t->have_jpeg)
+  {
+    jpeg->err = jpeg_std_error(&t->jpeg_error.pub);
+    t->jpeg_error.pub.error_exit = TIGHT_JPEGError;
+    jpeg_create_compress(jpeg);
+    t->jpeg_dest.pub.init_destination = TIGHT_JPEGInitDest;
+    t->jpeg_dest.pub.empty_output_buffer = TIGHT_JPEGGrowDest;
+    t->jpeg_dest.pub.term_destination = TIGHT_JPEGTermDest;
+    jpeg->dest = &t->jpeg_dest.pub;
+    t->have_jpeg = 1;
+  }
+  t->jpeg_dest.es = es;
+  if (setjmp(t->jpeg_error.fail))
+  {
+    jpeg_abort_compress(jpeg);
+    return -1;
+  }
+  jpeg->image_width = r->w;
+  jpeg->image_height = r->h;
+  // libjpeg-turbo can read native pixels (0x00RRGGBB) as they are:
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  jpeg->in_color_space = JCS_EXT_BGRX;
+#else
+  jpeg->in_color_space = JCS_EXT_XRGB;
+#endif
+  jpeg->input_components = 4;
+  jpeg_set_defaults(jpeg);
+  jpeg_set_quality(jpeg, gJPEGQuality[ENC_Quality(es)], TRUE);
+  jpeg->dct_method = JDCT_FASTEST;
+  jpeg_start_compress(jpeg, TRUE);
+  for (y=0; y<r->h; ++y)
+  {
+    JSAMPROW row = (JSAMPROW)FB_PIXEL_PTR(frame, r->x, r->y+y);
+    jpeg_write_scanlines(jpeg, &row, 1);
+  }
+  jpeg_finish_compress(jpeg);
+  len = t->jpeg_dest.pub.next_output_byte - t->jpeg_dest.data;
+  if (OUT_U8(out, TIGHT_JPEG) < 0 || TIGHT_PutLength(out, len) < 0)
+  {
+    return -1;
+  }
+  return OUT_Bytes(out, t->jpeg_dest.data, len);
+}
+
+
+static rfb_tight *TIGHT_State(rfb_encstate *es)
+{
+  int i;
+  if (!es->tight)
+  {
+    es->tight = calloc(1, sizeof(rfb_tight));
+    if (!es->tight)
+    {
+      return NULL;
+    }
+    for (i=0; i<TIGHT_STREAMS; ++i)
+    {
+      es->tight->level[i] = -1;
+    }
+  }
+  return es->tight;
+}
+
+
+// Tight rectangles encoded independently (maybe for another connection) are
+// being sent, which may reset any of the client's streams and leave other
+// data in them. So each of ours gets reset before it's next used.
+int ENC_SharedTight(rfb_encstate *es)
+{
+  rfb_tight *t = TIGHT_State(es);
+  if (!t)
+  {
+    return -1;
+  }
+  t->reset = (1 << TIGHT_STREAMS) - 1;
+  return 0;
+}
+
+
+void ENC_FreeTight(rfb_encstate *es)
+{
+  rfb_tight *t = es->tight;
+  int i;
+  if (!t)
+  {
+    return;
+  }
+  for (i=0; i<TIGHT_STREAMS; ++i)
+  {
+    if (t->level[i] >= 0)
+    {
+      deflateEnd(&t->zs[i]);
+    }
+  }
+  if (t->have_jpeg)
+  {
+    jpeg_destroy_compress(&t->jpeg);
+  }
+  free(t);
+  es->tight = NULL;
+}
+
+
+int ENC_EncodeTight(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_translator *tr = &es->translator;
+  int is24 = TIGHT_Is24(tr);
+  tight_palette *pal = (tight_palette*)ENC_Scratch(es, sizeof(tight_palette));
+  int colours, smoothness;
+  if (!TIGHT_State(es) || !pal)
+  {
+    return -1;
+  }
+  colours = TIGHT_CountColours(es->frame, r, pal);
+  if (colours == 1)
+  {
+    return TIGHT_EncodeFill(es, out, is24, pal->colours[0]);
+  }
+  if (colours <= TIGHT_MAX_PALETTE)
+  {
+    return TIGHT_EncodePalette(es, out, is24, r, pal);
+  }
+  smoothness = TIGHT_Smoothness(es->frame, r);
+  if (ENC_Quality(es) >= 0 && tr->format.true_colour && tr->format.bpp >= 16
+    && r->w * r->h >= TIGHT_JPEG_MIN_PIXELS && smoothness <= TIGHT_JPEG_MAX_ERROR
+    && (!is24 || smoothness >= TIGHT_JPEG_MIN_ERROR)
+    && TIGHT_EncodeJPEG(es, out, r) == 0)
+  {
+    return 0;
+  }
+  return TIGHT_EncodeFull(es, out, is24, r, is24 && smoothness <= TIGHT_GRADIENT_MAX_ERROR);
+}
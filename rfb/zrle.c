@@ -0,0 +1,565 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "encode.h"
+
+// ZRLE: rectangles are split into 64x64 tiles, each sent raw, solid, as a
+// packed palette, or run-length encoded (with or without a palette), and
+// the lot goes through a zlib stream that lives as long as the connection.
+//
+// Re-encoding a tile that hasn't changed gives the same bytes, so each
+// connection remembers the last bytes it produced at each tile position
+// along with a hash of the pixels they came from. Damage rectangles are
+// often much bigger than what really changed (and non-incremental requests
+// resend everything), so matching tiles just get copied.
+
+#define ZRLE_TILE 64
+
+// Most a tile can encode to (raw, with 4-byte CPIXELs):
+#define ZRLE_MAX_TILE_BYTES (1 + ZRLE_TILE*ZRLE_TILE*4)
+
+// Each cached tile's room starts at this and doubles as needed, up to
+// ZRLE_MAX_TILE_BYTES. Tiles that don't fit in a connection's
+// ZRLE_CACHE_BYTES just aren't cached:
+#define ZRLE_MIN_TILE_ROOM 256
+#define ZRLE_CACHE_BYTES (8 << 20)
+
+#define ZRLE_MAX_PALETTE 127 // Most colours palette RLE can have.
+#define ZRLE_MAX_PACKED  16  // Most colours a packed palette can have.
+
+// Tile subencodings:
+#define ZRLE_RAW           0
+#define ZRLE_SOLID         1
+#define ZRLE_PLAIN_RLE     128
+#define ZRLE_PALETTE_RLE   128 // Plus the palette size.
+
+// Palette lookup: open addressing, big enough to stay sparse:
+#define ZRLE_HASH_SIZE 512
+#define ZRLE_HASH(zzv) ((U32)((zzv) * 0x9E3779B1u) >> 23)
+
+
+// The bytes a tile encoded to last time:
+typedef struct {
+  rfb_rect r;
+  U64 hash; // Of the framebuffer pixels they came from.
+  U8 *data;
+  int room; // Bytes allocated for 'data'.
+  int len; // 0: nothing cached.
+} zrle_cached;
+
+typedef struct rfb_zrle {
+  // Raw deflate, with the zlib header written by hand. Then the stream can
+  // be reset without another header going out (see enccache.c):
+  z_stream zs;
+  int started; // Zlib header sent.
+  int reset; // Client has had data from elsewhere: no referring back.
+  int level;
+  pixel_format format; // What the cached tiles were encoded for.
+  // Cached tiles, one per 64x64 cell of the framebuffer, by tile position:
+  zrle_cached *cache;
+  int cols;
+  int rows;
+  // Room allocated for all the cached tiles. A tile only gets more when it
+  // encodes to more than it ever has, so once the screen's been seen,
+  // encoding rarely has to allocate:
+  size_t cache_bytes;
+} rfb_zrle;
+
+// Working space for one tile:
+typedef struct {
+  U32 pixels[ZRLE_TILE*ZRLE_TILE]; // In client format, one per U32.
+  U8 bytes[ZRLE_TILE*ZRLE_TILE*4]; // Before widening into 'pixels'.
+  U32 palette[ZRLE_MAX_PALETTE];
+  int palette_size; // ZRLE_MAX_PALETTE+1 once there are too many colours.
+  U16 slot[ZRLE_MAX_PALETTE]; // Where each palette entry is in the hash.
+  U32 keys[ZRLE_HASH_SIZE];
+  U8 index[ZRLE_HASH_SIZE]; // Palette index + 1, or 0 if the slot is free.
+} zrle_tile;
+
+
+// Compressed pixels: 32bpp clients whose colours fit in 3 of the 4 bytes get
+// just those 3. Everyone else gets whole pixels.
+static int ZRLE_CPixel(const rfb_translator *t, int *offset)
+{
+  const pixel_format *f = &t->format;
+  U32 used = (t->r_max << t->r_shift) | (t->g_max << t->g_shift) | (t->b_max << t->b_shift);
+  *offset = 0;
+  if (t->bytes_per_pixel == 4 && f->true_colour && f->depth <= 24)
+  {
+    if (used <= 0xFFFFFF)
+    {
+      *offset = f->big_endian ? 1 : 0;
+      return 3;
+    }
+    if (!(used & 0xFF))
+    {
+      *offset = f->big_endian ? 0 : 1;
+      return 3;
+    }
+  }
+  return t->bytes_per_pixel;
+}
+
+
+// Pixels were loaded by copying their bytes, so copying them back out gives
+// the client's byte order:
+static inline U8 *ZRLE_PutCPixel(U8 *p, U32 pixel, int size, int offset)
+{
+  switch (size)
+  {
+    case 1: *p = pixel; break;
+    case 2: { U16 v = pixel; memcpy(p, &v, 2); break; }
+    default: memcpy(p, (U8*)&pixel + offset, size); break;
+  }
+  return p + size;
+}
+
+
+static U8 *ZRLE_PutRunLength(U8 *p, int run)
+{
+  for (run -= 1; run >= 255; run -= 255)
+  {
+    *p++ = 255;
+  }
+  *p++ = run;
+  return p;
+}
+
+
+static void ZRLE_Load(rfb_encstate *es, zrle_tile *t, const U32 *src, int stride, int w, int h)
+{
+  int n = w*h;
+  int i;
+  switch (es->translator.bytes_per_pixel)
+  {
+    case 4:
+    {
+      PIX_TranslateRect(&es->translator, src, stride, (U8*)t->pixels, w, h);
+      break;
+    }
+    case 2:
+    {
+      U16 *v = (U16*)t->bytes;
+      PIX_TranslateRect(&es->translator, src, stride, t->bytes, w, h);
+      for (i=0; i<n; ++i)
+      {
+        t->pixels[i] = v[i];
+      }
+      break;
+    }
+    default:
+    {
+      PIX_TranslateRect(&es->translator, src, stride, t->bytes, w, h);
+      for (i=0; i<n; ++i)
+      {
+        t->pixels[i] = t->bytes[i];
+      }
+      break;
+    }
+  }
+}
+
+
+static void ZRLE_PaletteAdd(zrle_tile *t, U32 pixel)
+{
+  int slot = ZRLE_HASH(pixel);
+  while (t->index[slot])
+  {
+    if (t->keys[slot] == pixel)
+    {
+      return;
+    }
+    slot = (slot + 1) & (ZRLE_HASH_SIZE-1);
+  }
+  if (t->palette_size == ZRLE_MAX_PALETTE)
+  {
+    t->palette_size = ZRLE_MAX_PALETTE+1;
+    return;
+  }
+  t->keys[slot] = pixel;
+  t->index[slot] = t->palette_size + 1;
+  t->slot[t->palette_size] = slot;
+  t->palette[t->palette_size++] = pixel;
+}
+
+
+static int ZRLE_PaletteIndex(const zrle_tile *t, U32 pixel)
+{
+  int slot = ZRLE_HASH(pixel);
+  while (t->keys[slot] != pixel)
+  {
+    slot = (slot + 1) & (ZRLE_HASH_SIZE-1);
+  }
+  return t->index[slot] - 1;
+}
+
+
+static void ZRLE_PaletteClear(zrle_tile *t)
+{
+  int i;
+  for (i=0; i<Min(t->palette_size, ZRLE_MAX_PALETTE); ++i)
+  {
+    t->index[t->slot[i]] = 0;
+  }
+  t->palette_size = 0;
+}
+
+
+// Encodes one tile (uncompressed) at 'dst', in whichever subencoding comes
+// out smallest, and returns its length. That's never more than 1 + w*h*cp.
+static int ZRLE_EncodeTile(rfb_encstate *es, zrle_tile *t, int cp, int cpoff,
+  const U32 *src, int stride, int w, int h, U8 *dst)
+{
+  const U32 *px = t->pixels;
+  int n = w*h;
+  int runs = 1;
+  int run = 1;
+  int run_bytes = 0; // Run-length bytes for all runs...
+  int long_run_bytes = 0; // ...and for just the ones longer than a pixel.
+  int best, size, bits = 0, mode;
+  U32 prev;
+  U8 *p = dst;
+  int i, j, x, y;
+  ZRLE_Load(es, t, src, stride, w, h);
+  // One pass finds the runs and the palette (which only has to be checked
+  // where a run starts):
+  ZRLE_PaletteClear(t);
+  prev = px[0];
+  ZRLE_PaletteAdd(t, prev);
+  for (i=1; i<=n; ++i)
+  {
+    if (i < n && px[i] == prev)
+    {
+      ++run;
+      continue;
+    }
+    size = (run-1)/255 + 1;
+    run_bytes += size;
+    long_run_bytes += (run > 1) ? size : 0;
+    if (i == n)
+    {
+      break;
+    }
+    prev = px[i];
+    run = 1;
+    ++runs;
+    if (t->palette_size <= ZRLE_MAX_PALETTE)
+    {
+      ZRLE_PaletteAdd(t, prev);
+    }
+  }
+  if (t->palette_size == 1)
+  {
+    *p++ = ZRLE_SOLID;
+    p = ZRLE_PutCPixel(p, px[0], cp, cpoff);
+    return p - dst;
+  }
+  // Pick the smallest:
+  mode = ZRLE_RAW;
+  best = n*cp;
+  size = runs*cp + run_bytes;
+  if (size < best)
+  {
+    mode = ZRLE_PLAIN_RLE;
+    best = size;
+  }
+  if (t->palette_size <= ZRLE_MAX_PALETTE)
+  {
+    size = t->palette_size*cp + runs + long_run_bytes;
+    if (size < best)
+    {
+      mode = ZRLE_PALETTE_RLE + t->palette_size;
+      best = size;
+    }
+  }
+  if (t->palette_size <= ZRLE_MAX_PACKED)
+  {
+    bits = (t->palette_size <= 2) ? 1 : (t->palette_size <= 4) ? 2 : 4;
+    size = t->palette_size*cp + h*((w*bits + 7) / 8);
+    if (size < best)
+    {
+      mode = t->palette_size;
+      best = size;
+    }
+  }
+  *p++ = mode;
+  if (mode == ZRLE_RAW)
+  {
+    for (i=0; i<n; ++i)
+    {
+      p = ZRLE_PutCPixel(p, px[i], cp, cpoff);
+    }
+    return p - dst;
+  }
+  if (mode != ZRLE_PLAIN_RLE)
+  {
+    for (i=0; i<t->palette_size; ++i)
+    {
+      p = ZRLE_PutCPixel(p, t->palette[i], cp, cpoff);
+    }
+  }
+  if (mode <= ZRLE_MAX_PACKED)
+  {
+    // Packed palette: indices MSB first, each row starting on a new byte:
+    for (y=0; y<h; ++y)
+    {
+      U8 byte = 0;
+      int shift = 8;
+      for (x=0; x<w; ++x)
+      {
+        shift -= bits;
+        byte |= ZRLE_PaletteIndex(t, px[y*w + x]) << shift;
+        if (!shift)
+        {
+          *p++ = byte;
+          byte = 0;
+          shift = 8;
+        }
+      }
+      if (shift != 8)
+      {
+        *p++ = byte;
+      }
+    }
+    return p - dst;
+  }
+  for (i=0; i<n; i=j)
+  {
+    for (j=i+1; j<n && px[j] == px[i]; ++j);
+    if (mode == ZRLE_PLAIN_RLE)
+    {
+      p = ZRLE_PutCPixel(p, px[i], cp, cpoff);
+      p = ZRLE_PutRunLength(p, j-i);
+    }
+    else if (j-i == 1)
+    {
+      *p++ = ZRLE_PaletteIndex(t, px[i]);
+    }
+    else
+    {
+      *p++ = ZRLE_PaletteIndex(t, px[i]) | 128;
+      p = ZRLE_PutRunLength(p, j-i);
+    }
+  }
+  return p - dst;
+}
+
+
+static void ZRLE_Remember(rfb_zrle *z, zrle_cached *c, const rfb_rect *r, U64 hash, const U8 *data, int len)
+{
+  if (len > c->room)
+  {
+    int room = c->room ? c->room : ZRLE_MIN_TILE_ROOM;
+    U8 *grown;
+    while (room < len)
+    {
+      room = Min(room * 2, ZRLE_MAX_TILE_BYTES);
+    }
+    c->len = 0;
+    if (z->cache_bytes - c->room + room > ZRLE_CACHE_BYTES || !(grown = realloc(c->data, room)))
+    {
+      return;
+    }
+    z->cache_bytes += room - c->room;
+    c->data = grown;
+    c->room = room;
+  }
+  memcpy(c->data, data, len);
+  c->r = *r;
+  c->hash = hash;
+  c->len = len;
+}
+
+
+// Gets the connection's ZRLE state ready for a rectangle, creating it the
+// first time.
+static rfb_zrle *ZRLE_State(rfb_encstate *es)
+{
+  rfb_zrle *z = es->zrle;
+  int i;
+  if (!z)
+  {
+    z = calloc(1, sizeof(rfb_zrle));
+    if (!z)
+    {
+      return NULL;
+    }
+    z->level = ENC_CompressLevel(es);
+    if (deflateInit2(&z->zs, z->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      free(z);
+      return NULL;
+    }
+    z->cols = (es->frame->width + ZRLE_TILE-1) / ZRLE_TILE;
+    z->rows = (es->frame->height + ZRLE_TILE-1) / ZRLE_TILE;
+    z->cache = calloc(z->cols * z->rows, sizeof(zrle_cached));
+    if (!z->cache)
+    {
+      deflateEnd(&z->zs);
+      free(z);
+      return NULL;
+    }
+    z->format = es->translator.format;
+    es->zrle = z;
+  }
+  if (memcmp(&z->format, &es->translator.format, sizeof(z->format)))
+  {
+    // Cached tiles are in the wrong format now:
+    for (i=0; i<z->cols * z->rows; ++i)
+    {
+      z->cache[i].len = 0;
+    }
+    z->format = es->translator.format;
+  }
+  return z;
+}
+
+
+// A ZRLE rectangle encoded independently (maybe for another connection) is
+// being sent. Returns 1 if it needs the zlib header added, as the first
+// ZRLE data the connection gets; 0 if not; -1 on error.
+int ENC_SharedZRLE(rfb_encstate *es)
+{
+  rfb_zrle *z = ZRLE_State(es);
+  if (!z)
+  {
+    return -1;
+  }
+  z->reset = 1;
+  if (z->started)
+  {
+    return 0;
+  }
+  z->started = 1;
+  return 1;
+}
+
+
+void ENC_FreeZRLE(rfb_encstate *es)
+{
+  rfb_zrle *z = es->zrle;
+  int i;
+  if (!z)
+  {
+    return;
+  }
+  deflateEnd(&z->zs);
+  for (i=0; i<z->cols * z->rows; ++i)
+  {
+    free(z->cache[i].data);
+  }
+  free(z->cache);
+  free(z);
+  es->zrle = NULL;
+}
+
+
+int ENC_EncodeZRLE(rfb_encstate *es, rfb_outbuf *out, const rfb_rect *r)
+{
+  const rfb_frame *frame = es->frame;
+  rfb_zrle *z = ZRLE_State(es);
+  zrle_tile *tile;
+  int tiles = ((r->w + ZRLE_TILE-1) / ZRLE_TILE) * ((r->h + ZRLE_TILE-1) / ZRLE_TILE);
+  int cp, cpoff;
+  int level;
+  int header;
+  int total = 0;
+  int fed = 0;
+  U8 *raw, *p;
+  int tx, ty;
+  if (!z)
+  {
+    return -1;
+  }
+  cp = ZRLE_CPixel(&es->translator, &cpoff);
+  raw = ENC_Scratch(es, tiles + r->w*r->h*cp);
+  tile = (zrle_tile*)ENC_Scratch(es, sizeof(zrle_tile));
+  if (!raw || !tile)
+  {
+    return -1;
+  }
+  // Scratch space starts out as whatever was there, so clear the palette:
+  memset(tile->index, 0, sizeof(tile->index));
+  tile->palette_size = 0;
+  p = raw;
+  for (ty=0; ty<r->h; ty+=ZRLE_TILE)
+  {
+    for (tx=0; tx<r->w; tx+=ZRLE_TILE)
+    {
+      rfb_rect t = { r->x+tx, r->y+ty, Min(ZRLE_TILE, r->w-tx), Min(ZRLE_TILE, r->h-ty) };
+      zrle_cached *c = &z->cache[(t.y / ZRLE_TILE) * z->cols + t.x / ZRLE_TILE];
+      U64 hash = FB_HashRect(frame, &t);
+      int len;
+      if (c->len && c->hash == hash && !memcmp(&c->r, &t, sizeof(t)))
+      {
+        memcpy(p, c->data, c->len);
+        p += c->len;
+        continue;
+      }
+      len = ZRLE_EncodeTile(es, tile, cp, cpoff, FB_PIXEL_PTR(frame, t.x, t.y), frame->stride, t.w, t.h, p);
+      ZRLE_Remember(z, c, &t, hash, p, len);
+      p += len;
+    }
+  }
+  // Compress it all (U32 length first), ending with a sync flush so the
+  // client can decode it without waiting for more:
+  header = out->len;
+  if (!OUT_Reserve(out, 4))
+  {
+    return -1;
+  }
+  if (es->independent || z->reset)
+  {
+    deflateReset(&z->zs);
+    z->reset = 0;
+  }
+  if (!es->independent && !z->started)
+  {
+    if (OUT_U8(out, 0x78) < 0 || OUT_U8(out, 0x01) < 0)
+    {
+      return -1;
+    }
+    total = 2;
+    z->started = 1;
+  }
+  level = ENC_CompressLevel(es);
+  z->zs.next_in = raw;
+  z->zs.avail_in = 0;
+  do
+  {
+    int chunk = Max(deflateBound(&z->zs, p - raw) + 16, 4096);
+    U8 *dst = OUT_Reserve(out, chunk);
+    if (!dst)
+    {
+      return -1;
+    }
+    z->zs.next_out = dst;
+    z->zs.avail_out = chunk;
+    if (level != z->level)
+    {
+      // The client asked for a different compression level. Changing it
+      // can flush a little, so it needs somewhere to put it (and mustn't
+      // see the new data yet):
+      deflateParams(&z->zs, level, Z_DEFAULT_STRATEGY);
+      z->level = level;
+    }
+    if (!fed)
+    {
+      z->zs.avail_in = p - raw;
+      fed = 1;
+    }
+    if (deflate(&z->zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+    {
+      return -1;
+    }
+    total += chunk - z->zs.avail_out;
+    OUT_Unreserve(out, z->zs.avail_out);
+  } while (!z->zs.avail_out);
+  // Don't leave zlib pointing into memory that's about to move:
+  z->zs.next_out = NULL;
+  z->zs.avail_out = 0;
+  p = out->data + header;
+  PUT32(p, total);
+  return 0;
+}